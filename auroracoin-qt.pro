@@ -127,6 +127,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/init.h \
     src/irc.h \
     src/mruset.h \
+    src/invfilter.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -165,6 +166,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/allocators.h \
     src/ui_interface.h \
     src/scrypt.h \
+    src/stratum.h \
     src/qt/miningpage.h \
     src/version.h \
     src/qt/rpcconsole.h \
@@ -228,6 +230,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/qtipcserver.cpp \
     src/qt/rpcconsole.cpp \
     src/scrypt.c \
+    src/stratum.cpp \
     src/qt/miningpage.cpp \
     src/noui.cpp \
 	src/checkpointsync.cpp
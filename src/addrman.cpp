@@ -150,6 +150,7 @@ int CAddrMan::ShrinkNew(int nUBucket)
 {
     assert(nUBucket >= 0 && (unsigned int)nUBucket < vvNew.size());
     std::set<int> &vNew = vvNew[nUBucket];
+    fBucketsDirty = true;
 
     // first look for deletable items
     for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
@@ -200,9 +201,26 @@ int CAddrMan::ShrinkNew(int nUBucket)
     return 1;
 }
 
+void CAddrMan::UpdateFilled()
+{
+    if (!fBucketsDirty)
+        return;
+
+    vTriedFilled.clear();
+    for (unsigned int n = 0; n < vvTried.size(); n++)
+        if (!vvTried[n].empty())
+            vTriedFilled.push_back(n);
+    vNewFilled.clear();
+    for (unsigned int n = 0; n < vvNew.size(); n++)
+        if (!vvNew[n].empty())
+            vNewFilled.push_back(n);
+    fBucketsDirty = false;
+}
+
 void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 {
     assert(vvNew[nOrigin].count(nId) == 1);
+    fBucketsDirty = true;
 
     // remove the entry from all new buckets
     for (std::vector<std::set<int> >::iterator it = vvNew.begin(); it != vvNew.end(); it++)
@@ -363,6 +381,7 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePen
         if (vNew.size() == ADDRMAN_NEW_BUCKET_SIZE)
             ShrinkNew(nUBucket);
         vvNew[nUBucket].insert(nId);
+        fBucketsDirty = true;
     }
     return fNew;
 }
@@ -391,6 +410,9 @@ CAddress CAddrMan::Select_(int nUnkBias)
     if (size() == 0)
         return CAddress();
 
+    // pick buckets from the non-empty ones only, instead of probing at random
+    UpdateFilled();
+
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
     double nCorNew = sqrt(nNew) * nUnkBias;
     if ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried)
@@ -399,9 +421,10 @@ CAddress CAddrMan::Select_(int nUnkBias)
         double fChanceFactor = 1.0;
         while(1)
         {
-            int nKBucket = GetRandInt(vvTried.size());
+            if (vTriedFilled.empty())
+                return CAddress();
+            int nKBucket = vTriedFilled[GetRandInt(vTriedFilled.size())];
             std::vector<int> &vTried = vvTried[nKBucket];
-            if (vTried.size() == 0) continue;
             int nPos = GetRandInt(vTried.size());
             assert(mapInfo.count(vTried[nPos]) == 1);
             CAddrInfo &info = mapInfo[vTried[nPos]];
@@ -414,9 +437,10 @@ CAddress CAddrMan::Select_(int nUnkBias)
         double fChanceFactor = 1.0;
         while(1)
         {
-            int nUBucket = GetRandInt(vvNew.size());
+            if (vNewFilled.empty())
+                return CAddress();
+            int nUBucket = vNewFilled[GetRandInt(vNewFilled.size())];
             std::set<int> &vNew = vvNew[nUBucket];
-            if (vNew.size() == 0) continue;
             int nPos = GetRandInt(vNew.size());
             std::set<int>::iterator it = vNew.begin();
             while (nPos--)
@@ -490,19 +514,38 @@ int CAddrMan::Check_()
 }
 #endif
 
-void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
+boost::shared_ptr<const std::vector<CAddress> > CAddrMan::GetAddrSnapshot_()
+{
+    int64 nNow = GetTime();
+    if (!pGetAddrSnapshot || (pGetAddrSnapshot->empty() && !vRandom.empty()) ||
+        nNow - nGetAddrSnapshotTime > ADDRMAN_GETADDR_SNAPSHOT_INTERVAL)
+    {
+        // readers may still hold the previous snapshot, so build a new one
+        std::vector<CAddress> *pvAll = new std::vector<CAddress>();
+        pvAll->reserve(vRandom.size());
+        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+            pvAll->push_back((*it).second);
+        pGetAddrSnapshot.reset(pvAll);
+        nGetAddrSnapshotTime = nNow;
+    }
+    return pGetAddrSnapshot;
+}
+
+void CAddrMan::GetAddr_(const std::vector<CAddress> &vAll, std::vector<CAddress> &vAddr)
 {
-    int nNodes = ADDRMAN_GETADDR_MAX_PCT*vRandom.size()/100;
+    int nNodes = ADDRMAN_GETADDR_MAX_PCT*vAll.size()/100;
     if (nNodes > ADDRMAN_GETADDR_MAX)
         nNodes = ADDRMAN_GETADDR_MAX;
 
-    // perform a random shuffle over the first nNodes elements of vRandom (selecting from all)
-    for (int n = 0; n<nNodes; n++)
+    // pick nNodes distinct entries; as that is at most a quarter of them,
+    // retrying on a duplicate is cheaper than shuffling a copy of the list
+    std::set<int> setPicked;
+    vAddr.reserve(nNodes);
+    while ((int)vAddr.size() < nNodes)
     {
-        int nRndPos = GetRandInt(vRandom.size() - n) + n;
-        SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
+        int nPos = GetRandInt(vAll.size());
+        if (setPicked.insert(nPos).second)
+            vAddr.push_back(vAll[nPos]);
     }
 }
 
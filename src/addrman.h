@@ -13,6 +13,8 @@
 #include <map>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+
 #include <openssl/rand.h>
 
 
@@ -161,6 +163,9 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// how many seconds getaddr calls may sample from the same snapshot
+#define ADDRMAN_GETADDR_SNAPSHOT_INTERVAL 60
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -195,6 +200,15 @@ private:
     // list of "new" buckets
     std::vector<std::set<int> > vvNew;
 
+    // indexes of the non-empty "tried" and "new" buckets, rebuilt when fBucketsDirty is set
+    std::vector<int> vTriedFilled;
+    std::vector<int> vNewFilled;
+    bool fBucketsDirty;
+
+    // copy of all addresses that getaddr calls sample from outside of cs
+    boost::shared_ptr<const std::vector<CAddress> > pGetAddrSnapshot;
+    int64 nGetAddrSnapshotTime;
+
 protected:
 
     // Find an entry.
@@ -215,6 +229,9 @@ protected:
     // They are never deleted while in the "tried" table, only possibly evicted back to the "new" table.
     int ShrinkNew(int nUBucket);
  
+    // Rebuild the indexes of non-empty buckets, if any bucket changed.
+    void UpdateFilled();
+
     // Move an entry from the "new" table(s) to the "tried" table
     // @pre vvUnkown[nOrigin].count(nId) != 0
     void MakeTried(CAddrInfo& info, int nId, int nOrigin);
@@ -237,8 +254,11 @@ protected:
     int Check_();
 #endif
 
-    // Select several addresses at once.
-    void GetAddr_(std::vector<CAddress> &vAddr);
+    // Return the snapshot of all addresses, refreshing it if it is too old.
+    boost::shared_ptr<const std::vector<CAddress> > GetAddrSnapshot_();
+
+    // Select several addresses at once from a snapshot. Does not need cs.
+    static void GetAddr_(const std::vector<CAddress> &vAll, std::vector<CAddress> &vAddr);
 
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64 nTime);
@@ -324,6 +344,8 @@ public:
                 am->vRandom.clear();
                 am->vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
                 am->vvNew = std::vector<std::set<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>());
+                am->fBucketsDirty = true;
+                am->pGetAddrSnapshot.reset();
                 for (int n = 0; n < am->nNew; n++)
                 {
                     CAddrInfo &info = am->mapInfo[n];
@@ -387,6 +409,8 @@ public:
          nIdCount = 0;
          nTried = 0;
          nNew = 0;
+         fBucketsDirty = true;
+         nGetAddrSnapshotTime = 0;
     }
 
     // Return the number of (unique) addresses in all tables.
@@ -476,15 +500,18 @@ public:
     }
 
     // Return a bunch of addresses, selected at random.
+    // Only taking the snapshot needs cs, so answering getaddr requests does
+    // not hold up the threads that add addresses.
     std::vector<CAddress> GetAddr()
     {
-        Check();
-        std::vector<CAddress> vAddr;
+        boost::shared_ptr<const std::vector<CAddress> > pAll;
         {
             LOCK(cs);
-            GetAddr_(vAddr);
+            Check();
+            pAll = GetAddrSnapshot_();
         }
-        Check();
+        std::vector<CAddress> vAddr;
+        GetAddr_(*pAll, vAddr);
         return vAddr;
     }
 
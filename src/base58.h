@@ -19,50 +19,73 @@
 
 #include <string>
 #include <vector>
-#include "bignum.h"
 #include "key.h"
 #include "script.h"
 
 static const char* pszBase58 = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
+// Reverse lookup of pszBase58, -1 for characters outside the alphabet
+static const signed char mapBase58[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1, 0, 1, 2, 3, 4, 5, 6,  7, 8,-1,-1,-1,-1,-1,-1,
+    -1, 9,10,11,12,13,14,15, 16,-1,17,18,19,20,21,-1,
+    22,23,24,25,26,27,28,29, 30,31,32,-1,-1,-1,-1,-1,
+    -1,33,34,35,36,37,38,39, 40,41,42,43,-1,44,45,46,
+    47,48,49,50,51,52,53,54, 55,56,57,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+};
+
 // Encode a byte sequence as a base58-encoded string
 inline std::string EncodeBase58(const unsigned char* pbegin, const unsigned char* pend)
 {
-    CAutoBN_CTX pctx;
-    CBigNum bn58 = 58;
-    CBigNum bn0 = 0;
-
-    // Convert big endian data to little endian
-    // Extra zero at the end make sure bignum will interpret as a positive number
-    std::vector<unsigned char> vchTmp(pend-pbegin+1, 0);
-    reverse_copy(pbegin, pend, vchTmp.begin());
-
-    // Convert little endian data to bignum
-    CBigNum bn;
-    bn.setvch(vchTmp);
+    // Leading zeroes are encoded as base58 zeros
+    int nZeroes = 0;
+    while (pbegin != pend && *pbegin == 0)
+    {
+        pbegin++;
+        nZeroes++;
+    }
 
-    // Convert bignum to std::string
-    std::string str;
     // Expected size increase from base58 conversion is approximately 137%
     // use 138% to be safe
-    str.reserve((pend - pbegin) * 138 / 100 + 1);
-    CBigNum dv;
-    CBigNum rem;
-    while (bn > bn0)
+    std::vector<unsigned char> vchDigits((pend - pbegin) * 138 / 100 + 1, 0);
+    int nLength = 0;
+
+    // Convert big endian data to big endian base58 digits,
+    // one byte at a time: digits = digits * 256 + byte
+    for (; pbegin != pend; pbegin++)
     {
-        if (!BN_div(&dv, &rem, &bn, &bn58, pctx))
-            throw bignum_error("EncodeBase58 : BN_div failed");
-        bn = dv;
-        unsigned int c = rem.getulong();
-        str += pszBase58[c];
+        unsigned int nCarry = *pbegin;
+        int i = 0;
+        for (std::vector<unsigned char>::reverse_iterator it = vchDigits.rbegin();
+             (nCarry != 0 || i < nLength) && it != vchDigits.rend(); it++, i++)
+        {
+            nCarry += 256 * (*it);
+            *it = nCarry % 58;
+            nCarry /= 58;
+        }
+        nLength = i;
     }
 
-    // Leading zeroes encoded as base58 zeros
-    for (const unsigned char* p = pbegin; p < pend && *p == 0; p++)
-        str += pszBase58[0];
+    // Skip zero digits at the front of the result
+    std::vector<unsigned char>::iterator it = vchDigits.end() - nLength;
+    while (it != vchDigits.end() && *it == 0)
+        it++;
 
-    // Convert little endian std::string to big endian
-    reverse(str.begin(), str.end());
+    std::string str;
+    str.reserve(nZeroes + (vchDigits.end() - it));
+    str.assign(nZeroes, pszBase58[0]);
+    for (; it != vchDigits.end(); it++)
+        str += pszBase58[*it];
     return str;
 }
 
@@ -76,47 +99,54 @@ inline std::string EncodeBase58(const std::vector<unsigned char>& vch)
 // returns true if decoding is successful
 inline bool DecodeBase58(const char* psz, std::vector<unsigned char>& vchRet)
 {
-    CAutoBN_CTX pctx;
     vchRet.clear();
-    CBigNum bn58 = 58;
-    CBigNum bn = 0;
-    CBigNum bnChar;
     while (isspace(*psz))
         psz++;
 
-    // Convert big endian string to bignum
-    for (const char* p = psz; *p; p++)
+    // Leading base58 zeros are restored as zero bytes
+    int nZeroes = 0;
+    while (*psz == pszBase58[0])
     {
-        const char* p1 = strchr(pszBase58, *p);
-        if (p1 == NULL)
+        psz++;
+        nZeroes++;
+    }
+
+    // log(58) / log(256), rounded up
+    std::vector<unsigned char> vchBytes(strlen(psz) * 733 / 1000 + 1, 0);
+    int nLength = 0;
+
+    // Convert big endian base58 digits to big endian data,
+    // one digit at a time: bytes = bytes * 58 + digit
+    for (; *psz && !isspace(*psz); psz++)
+    {
+        int nDigit = mapBase58[(unsigned char)*psz];
+        if (nDigit == -1)
+            return false;
+        unsigned int nCarry = nDigit;
+        int i = 0;
+        for (std::vector<unsigned char>::reverse_iterator it = vchBytes.rbegin();
+             (nCarry != 0 || i < nLength) && it != vchBytes.rend(); it++, i++)
         {
-            while (isspace(*p))
-                p++;
-            if (*p != '\0')
-                return false;
-            break;
+            nCarry += 58 * (*it);
+            *it = nCarry % 256;
+            nCarry /= 256;
         }
-        bnChar.setulong(p1 - pszBase58);
-        if (!BN_mul(&bn, &bn, &bn58, pctx))
-            throw bignum_error("DecodeBase58 : BN_mul failed");
-        bn += bnChar;
+        nLength = i;
     }
 
-    // Get bignum as little endian data
-    std::vector<unsigned char> vchTmp = bn.getvch();
-
-    // Trim off sign byte if present
-    if (vchTmp.size() >= 2 && vchTmp.end()[-1] == 0 && vchTmp.end()[-2] >= 0x80)
-        vchTmp.erase(vchTmp.end()-1);
+    // Only trailing whitespace is allowed
+    while (isspace(*psz))
+        psz++;
+    if (*psz != '\0')
+        return false;
 
-    // Restore leading zeros
-    int nLeadingZeros = 0;
-    for (const char* p = psz; *p == pszBase58[0]; p++)
-        nLeadingZeros++;
-    vchRet.assign(nLeadingZeros + vchTmp.size(), 0);
+    std::vector<unsigned char>::iterator it = vchBytes.end() - nLength;
+    while (it != vchBytes.end() && *it == 0)
+        it++;
 
-    // Convert little endian data to big endian
-    reverse_copy(vchTmp.begin(), vchTmp.end(), vchRet.end() - vchTmp.size());
+    vchRet.reserve(nZeroes + (vchBytes.end() - it));
+    vchRet.assign(nZeroes, 0);
+    vchRet.insert(vchRet.end(), it, vchBytes.end());
     return true;
 }
 
@@ -14,6 +14,7 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include "bitcoinrpc.h"
+#include "stratum.h"
 
 #undef printf
 #include <boost/asio.hpp>
@@ -42,6 +43,7 @@ void ThreadRPCServer2(void* parg);
 static std::string strRPCUserColonPass;
 
 static int64 nWalletUnlockTime;
+static int64 nWalletUnlockSends; // sends left before relocking, 0 for no limit
 static CCriticalSection cs_nWalletUnlockTime;
 
 extern Value getconnectioncount(const Array& params, bool fHelp); // in rpcnet.cpp
@@ -50,6 +52,7 @@ extern Value dumpprivkey(const Array& params, bool fHelp); // in rpcdump.cpp
 extern Value importprivkey(const Array& params, bool fHelp);
 extern Value getrawtransaction(const Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern Value listunspent(const Array& params, bool fHelp);
+extern void ListUnspent(const Array& params, bool fHelp, CRPCResultWriter& writer);
 extern Value createrawtransaction(const Array& params, bool fHelp);
 extern Value decoderawtransaction(const Array& params, bool fHelp);
 extern Value signrawtransaction(const Array& params, bool fHelp);
@@ -62,6 +65,7 @@ extern json_spirit::Value makekeypair(const json_spirit::Array& params, bool fHe
 const Object emptyobj;
 
 void ThreadRPCServer3(void* parg);
+Value getrpcinfo(const Array& params, bool fHelp);
 
 Object JSONRPCError(int code, const string& message)
 {
@@ -70,6 +74,55 @@ Object JSONRPCError(int code, const string& message)
     error.push_back(Pair("message", message));
     return error;
 }
+Value* CRPCValueWriter::Add(const Value& value)
+{
+    if (vOpen.empty())
+    {
+        result = value;
+        return &result;
+    }
+    Value& parent = *vOpen.back();
+    if (parent.type() == array_type)
+    {
+        Array& array = parent.get_array();
+        array.push_back(value);
+        return &array.back();
+    }
+    Object& obj = parent.get_obj();
+    obj.push_back(Pair(strKey, value));
+    return &obj.back().value_;
+}
+
+void CRPCValueWriter::BeginArray()
+{
+    vOpen.push_back(Add(Array()));
+}
+
+void CRPCValueWriter::EndArray()
+{
+    vOpen.pop_back();
+}
+
+void CRPCValueWriter::BeginObject()
+{
+    vOpen.push_back(Add(Object()));
+}
+
+void CRPCValueWriter::EndObject()
+{
+    vOpen.pop_back();
+}
+
+void CRPCValueWriter::Key(const string& strKeyIn)
+{
+    strKey = strKeyIn;
+}
+
+void CRPCValueWriter::Write(const Value& value)
+{
+    Add(value);
+}
+
 void RPCTypeCheck(const Array& params,
                   const list<Value_type>& typesExpected)
 {
@@ -112,10 +165,9 @@ double GetDifficulty(const CBlockIndex* blockindex = NULL)
     // minimum difficulty = 1.0.
     if (blockindex == NULL)
     {
-        if (pindexBest == NULL)
+        blockindex = GetChainTip()->pindex;
+        if (blockindex == NULL)
             return 1.0;
-        else
-            blockindex = pindexBest;
     }
 
     int nShift = (blockindex->nBits >> 24) & 0xff;
@@ -180,6 +232,17 @@ EnsureWalletIsUnlocked()
         throw JSONRPCError(-13, "Error: Please enter the wallet passphrase with walletpassphrase first.");
 }
 
+// Relock the wallet after the number of sends walletpassphrase allowed
+static void CountWalletUnlockSend()
+{
+    LOCK(cs_nWalletUnlockTime);
+    if (nWalletUnlockSends > 0 && --nWalletUnlockSends == 0)
+    {
+        pwalletMain->Lock();
+        nWalletUnlockTime = 0;
+    }
+}
+
 void WalletTxToJSON(const CWalletTx& wtx, Object& entry)
 {
     int confirms = wtx.GetDepthInMainChain();
@@ -203,31 +266,47 @@ string AccountFromValue(const Value& value)
     return strAccount;
 }
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
+void BlockToJSON(const CBlock& block, const CBlockIndex* blockindex, CRPCResultWriter& writer)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    Array txs;
+    int nConfirmations;
+    uint256 hashNext = 0;
+    {
+        LOCK(cs_main);
+        CMerkleTx txGen(block.vtx[0]);
+        txGen.SetMerkleBranch(&block);
+        nConfirmations = txGen.GetDepthInMainChain();
+        if (blockindex->pnext)
+            hashNext = blockindex->pnext->GetBlockHash();
+    }
+
+    writer.BeginObject();
+    writer.Key("hash");          writer.Write(block.GetHash().GetHex());
+    writer.Key("confirmations"); writer.Write(nConfirmations);
+    writer.Key("size");          writer.Write((int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.Key("height");        writer.Write(blockindex->nHeight);
+    writer.Key("version");       writer.Write(block.nVersion);
+    writer.Key("merkleroot");    writer.Write(block.hashMerkleRoot.GetHex());
+    writer.Key("tx");
+    writer.BeginArray();
     BOOST_FOREACH(const CTransaction&tx, block.vtx)
-        txs.push_back(tx.GetHash().GetHex());
-    result.push_back(Pair("tx", txs));
-    result.push_back(Pair("time", (boost::int64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (boost::uint64_t)block.nNonce));
-    result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
+        writer.Write(tx.GetHash().GetHex());
+    writer.EndArray();
+    writer.Key("time");          writer.Write((boost::int64_t)block.GetBlockTime());
+    writer.Key("nonce");         writer.Write((boost::uint64_t)block.nNonce);
+    writer.Key("bits");          writer.Write(HexBits(block.nBits));
+    writer.Key("difficulty");    writer.Write(GetDifficulty(blockindex));
 
     if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-    return result;
+    {
+        writer.Key("previousblockhash");
+        writer.Write(blockindex->pprev->GetBlockHash().GetHex());
+    }
+    if (hashNext != 0)
+    {
+        writer.Key("nextblockhash");
+        writer.Write(hashNext.GetHex());
+    }
+    writer.EndObject();
 }
 
 /// Note: This interface may still be subject to change.
@@ -302,7 +381,7 @@ Value getblockcount(const Array& params, bool fHelp)
             "getblockcount\n"
             "Returns the number of blocks in the longest block chain.");
 
-    return nBestHeight;
+    return GetChainTip()->nHeight;
 }
 
 
@@ -319,25 +398,27 @@ Value getdifficulty(const Array& params, bool fHelp)
 
 // AuroraCoin: Return average network hashes per second based on last number of blocks.
 Value GetNetworkHashPS(int lookup) {
-    if (pindexBest == NULL)
+    CChainTipRef tip = GetChainTip();
+    const CBlockIndex* pindexTip = tip->pindex;
+    if (pindexTip == NULL)
         return 0;
 
     // If lookup is -1, then use blocks since last difficulty change.
     if (lookup <= 0)
-        lookup = pindexBest->nHeight % 2016 + 1;
+        lookup = pindexTip->nHeight % 2016 + 1;
 
     // If lookup is larger than chain, then set it to chain length.
-    if (lookup > pindexBest->nHeight)
-        lookup = pindexBest->nHeight;
+    if (lookup > pindexTip->nHeight)
+        lookup = pindexTip->nHeight;
 
-    CBlockIndex* pindexPrev = pindexBest;
+    const CBlockIndex* pindexPrev = pindexTip;
     for (int i = 0; i < lookup; i++)
         pindexPrev = pindexPrev->pprev;
 
-    double timeDiff = pindexBest->GetBlockTime() - pindexPrev->GetBlockTime();
+    double timeDiff = pindexTip->GetBlockTime() - pindexPrev->GetBlockTime();
     double timePerBlock = timeDiff / lookup;
 
-    return (boost::int64_t)(((double)GetDifficulty() * pow(2.0, 32)) / timePerBlock);
+    return (boost::int64_t)(((double)GetDifficulty(pindexTip) * pow(2.0, 32)) / timePerBlock);
 }
 
 Value getnetworkhashps(const Array& params, bool fHelp)
@@ -455,6 +536,55 @@ Value getmininginfo(const Array& params, bool fHelp)
     return obj;
 }
 
+Value getpoolmininginfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getpoolmininginfo\n"
+            "Returns an object containing the state of the built-in pool miner.");
+
+    CPoolMiningStats stats;
+    GetPoolMiningStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("mining",        stats.fRunning));
+    obj.push_back(Pair("connected",     stats.fConnected));
+    obj.push_back(Pair("server",        stats.strServer));
+    obj.push_back(Pair("user",          stats.strUser));
+    obj.push_back(Pair("job",           stats.strJobId));
+    obj.push_back(Pair("difficulty",    stats.dDifficulty));
+    obj.push_back(Pair("threads",       stats.nThreads));
+    obj.push_back(Pair("hashespersec",  (boost::int64_t)stats.dHashesPerSec));
+    obj.push_back(Pair("accepted",      (boost::int64_t)stats.nAccepted));
+    obj.push_back(Pair("rejected",      (boost::int64_t)stats.nRejected));
+    obj.push_back(Pair("lasterror",     stats.strLastError));
+    return obj;
+}
+
+Value setpoolmining(const Array& params, bool fHelp)
+{
+    if (fHelp || (params.size() != 1 && params.size() != 5 && params.size() != 6))
+        throw runtime_error(
+            "setpoolmining <mine> [server] [port] [user] [password] [threads=1]\n"
+            "<mine> is true or false to turn pool mining on or off.\n"
+            "Turning it on needs the stratum server, port and worker credentials.");
+
+    bool fMine = params[0].get_bool();
+    StopPoolMining();
+    if (!fMine)
+        return Value::null;
+    if (params.size() < 5)
+        throw JSONRPCError(-8, "Pool server, port, user and password are required");
+
+    string strServer = params[1].get_str();
+    if (strServer.find("stratum+tcp://") == 0)
+        strServer = strServer.substr(14);
+    int nThreads = params.size() > 5 ? params[5].get_int() : 1;
+    if (!StartPoolMining(strServer, params[2].get_int(), params[3].get_str(), params[4].get_str(), nThreads))
+        throw JSONRPCError(-1, "Pool mining is still stopping, try again");
+    return Value::null;
+}
+
 
 Value getnewaddress(const Array& params, bool fHelp)
 {
@@ -470,6 +600,8 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
+    // Runs without the wallet locks, so refilling an empty pool doesn't
+    // hold them
     if (!pwalletMain->IsLocked())
         pwalletMain->TopUpKeyPool();
 
@@ -479,6 +611,7 @@ Value getnewaddress(const Array& params, bool fHelp)
         throw JSONRPCError(-12, "Error: Keypool ran out, please call keypoolrefill first");
     CKeyID keyID = newKey.GetID();
 
+    LOCK2(cs_main, pwalletMain->cs_wallet);
     pwalletMain->SetAddressBookName(keyID, strAccount);
 
     return CBitcoinAddress(keyID).ToString();
@@ -672,6 +805,7 @@ Value sendtoaddress(const Array& params, bool fHelp)
     string strError = pwalletMain->SendMoneyToDestination(address.Get(), nAmount, wtx);
     if (strError != "")
         throw JSONRPCError(-4, strError);
+    CountWalletUnlockSend();
 
     return wtx.GetHash().GetHex();
 }
@@ -1004,6 +1138,7 @@ Value sendfrom(const Array& params, bool fHelp)
     string strError = pwalletMain->SendMoneyToDestination(address.Get(), nAmount, wtx);
     if (strError != "")
         throw JSONRPCError(-4, strError);
+    CountWalletUnlockSend();
 
     return wtx.GetHash().GetHex();
 }
@@ -1069,6 +1204,7 @@ Value sendmany(const Array& params, bool fHelp)
     }
     if (!pwalletMain->CommitTransaction(wtx, keyChange))
         throw JSONRPCError(-4, "Transaction commit failed");
+    CountWalletUnlockSend();
 
     return wtx.GetHash().GetHex();
 }
@@ -1363,7 +1499,15 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Ar
     }
 }
 
-Value listtransactions(const Array& params, bool fHelp)
+static void ListTransactionItem(const CWalletTx* pwtx, const CAccountingEntry* pacentry, const string& strAccount, Array& ret)
+{
+    if (pwtx != 0)
+        ListTransactions(*pwtx, strAccount, 0, true, ret);
+    if (pacentry != 0)
+        AcentryToJSON(*pacentry, strAccount, ret);
+}
+
+void ListTransactions(const Array& params, bool fHelp, CRPCResultWriter& writer)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -1385,7 +1529,6 @@ Value listtransactions(const Array& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(-8, "Negative from");
 
-    Array ret;
     CWalletDB walletdb(pwalletMain->strWalletFile);
 
     // First: get all CWalletTx and CAccountingEntry into a sorted-by-time multimap.
@@ -1407,35 +1550,36 @@ Value listtransactions(const Array& params, bool fHelp)
         txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
     }
 
-    // iterate backwards until we have nCount items to return:
+    // Iterate backwards until we have nCount+nFrom entries, keeping only
+    // those in the requested window. Entries are numbered newest to oldest.
+    Array ret;
+    int nEntries = 0;
     for (TxItems::reverse_iterator it = txByTime.rbegin(); it != txByTime.rend(); ++it)
     {
-        CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
-        CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+        Array entries;
+        ListTransactionItem((*it).second.first, (*it).second.second, strAccount, entries);
+        BOOST_FOREACH(const Value& entry, entries)
+        {
+            if (nEntries >= nFrom && nEntries < nFrom + nCount)
+                ret.push_back(entry);
+            nEntries++;
+        }
 
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        if (nEntries >= (nCount+nFrom)) break;
     }
-    // ret is newest to oldest
-
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-    Array::iterator first = ret.begin();
-    std::advance(first, nFrom);
-    Array::iterator last = ret.begin();
-    std::advance(last, nFrom+nCount);
-
-    if (last != ret.end()) ret.erase(last, ret.end());
-    if (first != ret.begin()) ret.erase(ret.begin(), first);
 
-    std::reverse(ret.begin(), ret.end()); // Return oldest to newest
+    // Return them oldest to newest
+    writer.BeginArray();
+    for (Array::reverse_iterator it = ret.rbegin(); it != ret.rend(); ++it)
+        writer.Write(*it);
+    writer.EndArray();
+}
 
-    return ret;
+Value listtransactions(const Array& params, bool fHelp)
+{
+    CRPCValueWriter writer;
+    ListTransactions(params, fHelp, writer);
+    return writer.GetValue();
 }
 
 Value listaccounts(const Array& params, bool fHelp)
@@ -1489,7 +1633,7 @@ Value listaccounts(const Array& params, bool fHelp)
     return ret;
 }
 
-Value listsinceblock(const Array& params, bool fHelp)
+void ListSinceBlock(const Array& params, bool fHelp, CRPCResultWriter& writer)
 {
     if (fHelp)
         throw runtime_error(
@@ -1517,15 +1661,22 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     int depth = pindex ? (1 + nBestHeight - pindex->nHeight) : -1;
 
-    Array transactions;
-
+    writer.BeginObject();
+    writer.Key("transactions");
+    writer.BeginArray();
     for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
     {
-        CWalletTx tx = (*it).second;
+        const CWalletTx& tx = (*it).second;
 
         if (depth == -1 || tx.GetDepthInMainChain() < depth)
+        {
+            Array transactions;
             ListTransactions(tx, "*", 0, true, transactions);
+            BOOST_FOREACH(const Value& entry, transactions)
+                writer.Write(entry);
+        }
     }
+    writer.EndArray();
 
     uint256 lastblock;
 
@@ -1545,11 +1696,16 @@ Value listsinceblock(const Array& params, bool fHelp)
         lastblock = block ? block->GetBlockHash() : 0;
     }
 
-    Object ret;
-    ret.push_back(Pair("transactions", transactions));
-    ret.push_back(Pair("lastblock", lastblock.GetHex()));
+    writer.Key("lastblock");
+    writer.Write(lastblock.GetHex());
+    writer.EndObject();
+}
 
-    return ret;
+Value listsinceblock(const Array& params, bool fHelp)
+{
+    CRPCValueWriter writer;
+    ListSinceBlock(params, fHelp, writer);
+    return writer.GetValue();
 }
 
 Value gettransaction(const Array& params, bool fHelp)
@@ -1591,10 +1747,12 @@ Value backupwallet(const Array& params, bool fHelp)
     if (fHelp || params.size() != 1)
         throw runtime_error(
             "backupwallet <destination>\n"
-            "Safely copies wallet.dat to destination, which can be a directory or a path with filename.");
+            "Safely copies wallet.dat to destination, which can be a directory or a path with filename.\n"
+            "The backup is written in full, an existing one at destination is only replaced if the wallet changed since.");
 
     string strDest = params[0].get_str();
-    BackupWallet(*pwalletMain, strDest);
+    if (!BackupWallet(*pwalletMain, strDest))
+        throw JSONRPCError(-4, "Error: Wallet backup failed!");
 
     return Value::null;
 }
@@ -1610,8 +1768,10 @@ Value keypoolrefill(const Array& params, bool fHelp)
 
     EnsureWalletIsUnlocked();
 
+    // Runs without the wallet locks, TopUpKeyPool only takes them to store the keys
     pwalletMain->TopUpKeyPool();
 
+    LOCK(pwalletMain->cs_wallet);
     if (pwalletMain->GetKeyPoolSize() < GetArg("-keypool", 100))
         throw JSONRPCError(-4, "Error refreshing keypool.");
 
@@ -1673,10 +1833,11 @@ void ThreadCleanWalletPassphrase(void* parg)
 
 Value walletpassphrase(const Array& params, bool fHelp)
 {
-    if (pwalletMain->IsCrypted() && (fHelp || params.size() != 2))
+    if (pwalletMain->IsCrypted() && (fHelp || params.size() < 2 || params.size() > 3))
         throw runtime_error(
-            "walletpassphrase <passphrase> <timeout>\n"
-            "Stores the wallet decryption key in memory for <timeout> seconds.");
+            "walletpassphrase <passphrase> <timeout> [sends]\n"
+            "Stores the wallet decryption key in memory for <timeout> seconds,\n"
+            "or until [sends] sendtoaddress, sendfrom or sendmany calls were made.");
     if (fHelp)
         return true;
     if (!pwalletMain->IsCrypted())
@@ -1699,8 +1860,14 @@ Value walletpassphrase(const Array& params, bool fHelp)
     }
     else
         throw runtime_error(
-            "walletpassphrase <passphrase> <timeout>\n"
-            "Stores the wallet decryption key in memory for <timeout> seconds.");
+            "walletpassphrase <passphrase> <timeout> [sends]\n"
+            "Stores the wallet decryption key in memory for <timeout> seconds,\n"
+            "or until [sends] sendtoaddress, sendfrom or sendmany calls were made.");
+
+    {
+        LOCK(cs_nWalletUnlockTime);
+        nWalletUnlockSends = params.size() > 2 ? max(params[2].get_int64(), (boost::int64_t)0) : 0;
+    }
 
     CreateThread(ThreadTopUpKeyPool, NULL);
     int64* pnSleepTime = new int64(params[1].get_int64());
@@ -1759,7 +1926,10 @@ Value walletlock(const Array& params, bool fHelp)
     {
         LOCK(cs_nWalletUnlockTime);
         pwalletMain->Lock();
+        // Only automatic relocks keep the master key for -walletunlockcache
+        pwalletMain->ExpireUnlockCache(true);
         nWalletUnlockTime = 0;
+        nWalletUnlockSends = 0;
     }
 
     return Value::null;
@@ -2256,7 +2426,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     throw JSONRPCError(-8, "Invalid mode");
 }
 
-Value getrawmempool(const Array& params, bool fHelp)
+void GetRawMempool(const Array& params, bool fHelp, CRPCResultWriter& writer)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
@@ -2266,11 +2436,116 @@ Value getrawmempool(const Array& params, bool fHelp)
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
 
-    Array a;
+    writer.BeginArray();
     BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
+        writer.Write(hash.ToString());
+    writer.EndArray();
+}
+
+Value getrawmempool(const Array& params, bool fHelp)
+{
+    CRPCValueWriter writer;
+    GetRawMempool(params, fHelp, writer);
+    return writer.GetValue();
+}
+
+Value getcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcacheinfo\n"
+            "Returns an object containing statistics of the internal caches.");
+
+    CPubKeyCacheStats pubkeystats;
+    GetPubKeyCacheStats(pubkeystats);
+
+    Object pubkeys;
+    pubkeys.push_back(Pair("size",      (int)pubkeystats.nSize));
+    pubkeys.push_back(Pair("maxsize",   (int)pubkeystats.nMaxSize));
+    pubkeys.push_back(Pair("hits",      (boost::uint64_t)pubkeystats.nHits));
+    pubkeys.push_back(Pair("misses",    (boost::uint64_t)pubkeystats.nMisses));
+    pubkeys.push_back(Pair("evictions", (boost::uint64_t)pubkeystats.nEvictions));
+
+    CBlockCacheStats blockstats;
+    GetBlockCacheStats(blockstats);
+
+    Object blocks;
+    blocks.push_back(Pair("size",      (int)blockstats.nSize));
+    blocks.push_back(Pair("bytes",     (boost::uint64_t)blockstats.nBytes));
+    blocks.push_back(Pair("maxbytes",  (boost::uint64_t)blockstats.nMaxBytes));
+    blocks.push_back(Pair("hits",      (boost::uint64_t)blockstats.nHits));
+    blocks.push_back(Pair("misses",    (boost::uint64_t)blockstats.nMisses));
+    blocks.push_back(Pair("evictions", (boost::uint64_t)blockstats.nEvictions));
+
+    Object obj;
+    obj.push_back(Pair("pubkeys", pubkeys));
+    obj.push_back(Pair("blocks", blocks));
+    return obj;
+}
 
-    return a;
+static bool SortLockStatsByWait(const CLockStats& a, const CLockStats& b)
+{
+    return a.nWaitMicros > b.nWaitMicros;
+}
+
+static bool SortLockStatsByHold(const CLockStats& a, const CLockStats& b)
+{
+    return a.nHoldMicros > b.nHoldMicros;
+}
+
+static bool SortLockStatsByCount(const CLockStats& a, const CLockStats& b)
+{
+    return a.nAcquired > b.nAcquired;
+}
+
+Value getlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "getlockstats [count=20] [sortby=wait]\n"
+            "Returns the <count> lock sites with the most wait time, hold time or\n"
+            "acquisitions, as selected by [sortby] (wait, hold, count or reset).\n"
+            "Times are in microseconds. sortby=reset clears all statistics.");
+
+    int nCount = 20;
+    if (params.size() > 0)
+        nCount = params[0].get_int();
+    string strSort = "wait";
+    if (params.size() > 1)
+        strSort = params[1].get_str();
+
+    if (strSort == "reset")
+    {
+        ResetLockStats();
+        return Value::null;
+    }
+
+    vector<CLockStats> vStats;
+    GetLockStats(vStats);
+    if (strSort == "wait")
+        sort(vStats.begin(), vStats.end(), SortLockStatsByWait);
+    else if (strSort == "hold")
+        sort(vStats.begin(), vStats.end(), SortLockStatsByHold);
+    else if (strSort == "count")
+        sort(vStats.begin(), vStats.end(), SortLockStatsByCount);
+    else
+        throw JSONRPCError(-8, "Invalid sortby, must be wait, hold, count or reset");
+
+    Array ret;
+    for (int i = 0; i < nCount && i < (int)vStats.size(); i++)
+    {
+        const CLockStats& stats = vStats[i];
+        Object obj;
+        obj.push_back(Pair("lock",       stats.strName));
+        obj.push_back(Pair("location",   strprintf("%s:%d", stats.strFile.c_str(), stats.nLine)));
+        obj.push_back(Pair("acquired",   (boost::int64_t)stats.nAcquired));
+        obj.push_back(Pair("contended",  (boost::int64_t)stats.nContended));
+        obj.push_back(Pair("waittime",   (boost::int64_t)stats.nWaitMicros));
+        obj.push_back(Pair("holdtime",   (boost::int64_t)stats.nHoldMicros));
+        obj.push_back(Pair("waiting",    stats.nWaiting));
+        ret.push_back(obj);
+    }
+    return ret;
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -2280,18 +2555,18 @@ Value getblockhash(const Array& params, bool fHelp)
             "getblockhash <index>\n"
             "Returns hash of block in best-block-chain at <index>.");
 
+    CChainTipRef tip = GetChainTip();
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
+    if (nHeight < 0 || nHeight > tip->nHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
+    const CBlockIndex* pblockindex = tip->pindex;
     while (pblockindex->nHeight > nHeight)
         pblockindex = pblockindex->pprev;
     return pblockindex->phashBlock->GetHex();
 }
 
-Value getblock(const Array& params, bool fHelp)
+void GetBlock(const Array& params, bool fHelp, CRPCResultWriter& writer)
 {
     if (fHelp || params.size() != 1)
         throw runtime_error(
@@ -2301,14 +2576,31 @@ Value getblock(const Array& params, bool fHelp)
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(-5, "Block not found");
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(-5, "Block not found");
+        pblockindex = (*mi).second;
+    }
 
+    // Reading the block doesn't need cs_main, only its place in the chain does
+    CSerializedBlockRef pblock = GetSerializedBlock(pblockindex);
+    if (!pblock)
+        throw JSONRPCError(-5, "Block not available");
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex, true);
+    CDataStream ssBlock(pblock->vch, SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock >> block;
 
-    return blockToJSON(block, pblockindex);
+    BlockToJSON(block, pblockindex, writer);
+}
+
+Value getblock(const Array& params, bool fHelp)
+{
+    CRPCValueWriter writer;
+    GetBlock(params, fHelp, writer);
+    return writer.GetValue();
 }
 
 
@@ -2323,69 +2615,74 @@ Value getblock(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      function                 safe mode?
-  //  ------------------------  -----------------------  ----------
-    { "help",                   &help,                   true },
-    { "stop",                   &stop,                   true },
-    { "getblockcount",          &getblockcount,          true },
-    { "getconnectioncount",     &getconnectioncount,     true },
-    { "getpeerinfo",            &getpeerinfo,            true },
-    { "getdifficulty",          &getdifficulty,          true },
-    { "getnetworkhashps",       &getnetworkhashps,       true },
-    { "getgenerate",            &getgenerate,            true },
-    { "setgenerate",            &setgenerate,            true },
-    { "gethashespersec",        &gethashespersec,        true },
-    { "getinfo",                &getinfo,                true },
-    { "getmininginfo",          &getmininginfo,          true },
-    { "getnewaddress",          &getnewaddress,          true },
-    { "getaccountaddress",      &getaccountaddress,      true },
-    { "setaccount",             &setaccount,             true },
-    { "getaccount",             &getaccount,             false },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true },
-    { "sendtoaddress",          &sendtoaddress,          false },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false },
-    { "backupwallet",           &backupwallet,           true },
-    { "keypoolrefill",          &keypoolrefill,          true },
-    { "walletpassphrase",       &walletpassphrase,       true },
-    { "walletpassphrasechange", &walletpassphrasechange, false },
-    { "walletlock",             &walletlock,             true },
-    { "encryptwallet",          &encryptwallet,          false },
-    { "validateaddress",        &validateaddress,        true },
-    { "getbalance",             &getbalance,             false },
-    { "move",                   &movecmd,                false },
-    { "sendfrom",               &sendfrom,               false },
-    { "sendmany",               &sendmany,               false },
-    { "addmultisigaddress",     &addmultisigaddress,     false },
-    { "getrawmempool",          &getrawmempool,          true },
-    { "getblock",               &getblock,               false },
-    { "getblockhash",           &getblockhash,           false },
-    { "gettransaction",         &gettransaction,         false },
-    { "listtransactions",       &listtransactions,       false },
-    { "signmessage",            &signmessage,            false },
-    { "verifymessage",          &verifymessage,          false },
-    { "getwork",                &getwork,                true },
-    { "getworkex",              &getworkex,              true },
-    { "listaccounts",           &listaccounts,           false },
-    { "settxfee",               &settxfee,               false },
-    { "setmininput",            &setmininput,            false },
-    { "getblocktemplate",       &getblocktemplate,       true },
-    { "listsinceblock",         &listsinceblock,         false },
-    { "dumpprivkey",            &dumpprivkey,            false },
-    { "importprivkey",          &importprivkey,          false },
-    { "getcheckpoint",          &getcheckpoint,          true },
-    { "sendcheckpoint",         &sendcheckpoint,         true },
-    { "enforcecheckpoint",      &enforcecheckpoint,      true },
-    { "makekeypair",            &makekeypair,            true },
-    { "makekeypair",            &makekeypair,            true },
-    { "listunspent",            &listunspent,            false },
-    { "getrawtransaction",      &getrawtransaction,      false },
-    { "createrawtransaction",   &createrawtransaction,   false },
-    { "decoderawtransaction",   &decoderawtransaction,   false },
-    { "signrawtransaction",     &signrawtransaction,     false },
-    { "sendrawtransaction",     &sendrawtransaction,     false },
+{ //  name                      function                 safe mode?  thread safe?
+  //  ------------------------  -----------------------  ----------  ------------
+    { "help",                   &help,                   true,       true },
+    { "stop",                   &stop,                   true,       true },
+    { "getblockcount",          &getblockcount,          true,       true },
+    { "getconnectioncount",     &getconnectioncount,     true,       true },
+    { "getpeerinfo",            &getpeerinfo,            true,       true },
+    { "getdifficulty",          &getdifficulty,          true,       true },
+    { "getnetworkhashps",       &getnetworkhashps,       true,       true },
+    { "getgenerate",            &getgenerate,            true,       false },
+    { "setgenerate",            &setgenerate,            true,       false },
+    { "gethashespersec",        &gethashespersec,        true,       true },
+    { "getinfo",                &getinfo,                true,       false },
+    { "getmininginfo",          &getmininginfo,          true,       false },
+    { "getpoolmininginfo",      &getpoolmininginfo,      true,       true },
+    { "setpoolmining",          &setpoolmining,          true,       true },
+    { "getnewaddress",          &getnewaddress,          true,       true },
+    { "getaccountaddress",      &getaccountaddress,      true,       false },
+    { "setaccount",             &setaccount,             true,       false },
+    { "getaccount",             &getaccount,             false,      false },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,       false },
+    { "sendtoaddress",          &sendtoaddress,          false,      false },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,      false },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,      false },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,      false },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,      false },
+    { "backupwallet",           &backupwallet,           true,       true },
+    { "keypoolrefill",          &keypoolrefill,          true,       true },
+    { "walletpassphrase",       &walletpassphrase,       true,       false },
+    { "walletpassphrasechange", &walletpassphrasechange, false,      false },
+    { "walletlock",             &walletlock,             true,       false },
+    { "encryptwallet",          &encryptwallet,          false,      false },
+    { "validateaddress",        &validateaddress,        true,       false },
+    { "getbalance",             &getbalance,             false,      false },
+    { "move",                   &movecmd,                false,      false },
+    { "sendfrom",               &sendfrom,               false,      false },
+    { "sendmany",               &sendmany,               false,      false },
+    { "addmultisigaddress",     &addmultisigaddress,     false,      false },
+    { "getrawmempool",          &getrawmempool,          true,       true, &GetRawMempool },
+    { "getcacheinfo",           &getcacheinfo,           true,       true },
+    { "getrpcinfo",             &getrpcinfo,             true,       true },
+    { "getlockstats",           &getlockstats,           true,       true },
+    { "getblock",               &getblock,               false,      true, &GetBlock },
+    { "getblockhash",           &getblockhash,           false,      true },
+    { "gettransaction",         &gettransaction,         false,      false },
+    { "listtransactions",       &listtransactions,       false,      false, &ListTransactions },
+    { "signmessage",            &signmessage,            false,      false },
+    { "verifymessage",          &verifymessage,          false,      false },
+    { "getwork",                &getwork,                true,       false },
+    { "getworkex",              &getworkex,              true,       false },
+    { "listaccounts",           &listaccounts,           false,      false },
+    { "settxfee",               &settxfee,               false,      false },
+    { "setmininput",            &setmininput,            false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,       false },
+    { "listsinceblock",         &listsinceblock,         false,      false, &ListSinceBlock },
+    { "dumpprivkey",            &dumpprivkey,            false,      false },
+    { "importprivkey",          &importprivkey,          false,      false },
+    { "getcheckpoint",          &getcheckpoint,          true,       false },
+    { "sendcheckpoint",         &sendcheckpoint,         true,       false },
+    { "enforcecheckpoint",      &enforcecheckpoint,      true,       false },
+    { "makekeypair",            &makekeypair,            true,       false },
+    { "makekeypair",            &makekeypair,            true,       false },
+    { "listunspent",            &listunspent,            false,      false, &ListUnspent },
+    { "getrawtransaction",      &getrawtransaction,      false,      false },
+    { "createrawtransaction",   &createrawtransaction,   false,      false },
+    { "decoderawtransaction",   &decoderawtransaction,   false,      false },
+    { "signrawtransaction",     &signrawtransaction,     false,      false },
+    { "sendrawtransaction",     &sendrawtransaction,     false,      false },
 };
 
 CRPCTable::CRPCTable()
@@ -2470,6 +2767,7 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
     else if (nStatus == 403) cStatus = "Forbidden";
     else if (nStatus == 404) cStatus = "Not Found";
     else if (nStatus == 500) cStatus = "Internal Server Error";
+    else if (nStatus == 503) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
@@ -2489,6 +2787,161 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
         strMsg.c_str());
 }
 
+static string HTTPReplyChunkedHeader(bool keepalive)
+{
+    return strprintf(
+            "HTTP/1.1 200 OK\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: application/json\r\n"
+            "Server: AuroraCoin-json-rpc/%s\r\n"
+            "\r\n",
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        FormatFullVersion().c_str());
+}
+
+/**
+ * CRPCResultWriter that renders a JSON-RPC reply as compact JSON text and
+ * sends it with HTTP/1.1 chunked transfer encoding once more than a chunk
+ * has been generated. Shorter replies get a plain Content-Length reply. In
+ * deferred mode everything is kept until Finish(), so that commands
+ * running under cs_main never wait on the client; their reply is buffered
+ * as text, without the json_spirit tree, and sent with Content-Length.
+ */
+class CRPCChunkedWriter : public CRPCResultWriter
+{
+private:
+    std::ostream& stream;
+    bool fKeepAlive;
+    bool fDeferred;
+    bool fHeaderSent;
+    std::string strBuffer;
+    std::vector<bool> vEmpty; // for each open array or object: nothing written to it yet
+    bool fAfterKey;
+
+    static const unsigned int nChunkSize = 64 * 1024;
+
+    void Separator()
+    {
+        if (fAfterKey)
+            fAfterKey = false;
+        else if (!vEmpty.empty())
+        {
+            if (!vEmpty.back())
+                strBuffer += ',';
+            vEmpty.back() = false;
+        }
+    }
+
+    void Append(const string& str)
+    {
+        strBuffer += str;
+        if (!fDeferred && strBuffer.size() >= nChunkSize)
+            Flush();
+    }
+
+    void Flush()
+    {
+        if (!fHeaderSent)
+        {
+            stream << HTTPReplyChunkedHeader(fKeepAlive);
+            fHeaderSent = true;
+        }
+        if (!strBuffer.empty())
+        {
+            stream << strprintf("%x\r\n", (unsigned int)strBuffer.size()) << strBuffer << "\r\n";
+            strBuffer.clear();
+        }
+    }
+
+public:
+    CRPCChunkedWriter(std::ostream& streamIn, bool fKeepAliveIn) :
+        stream(streamIn), fKeepAlive(fKeepAliveIn), fDeferred(false), fHeaderSent(false), fAfterKey(false)
+    {
+    }
+
+    void SetDeferred(bool fDeferredIn)
+    {
+        fDeferred = fDeferredIn;
+    }
+
+    /** Once true, errors can no longer be reported with a normal reply */
+    bool HeaderSent() const
+    {
+        return fHeaderSent;
+    }
+
+    void BeginArray()
+    {
+        Separator();
+        Append("[");
+        vEmpty.push_back(true);
+    }
+
+    void EndArray()
+    {
+        vEmpty.pop_back();
+        Append("]");
+    }
+
+    void BeginObject()
+    {
+        Separator();
+        Append("{");
+        vEmpty.push_back(true);
+    }
+
+    void EndObject()
+    {
+        vEmpty.pop_back();
+        Append("}");
+    }
+
+    void Key(const string& strKey)
+    {
+        Separator();
+        Append(write_string(Value(strKey), false) + ":");
+        fAfterKey = true;
+    }
+
+    void Write(const Value& value)
+    {
+        Separator();
+        Append(write_string(value, false));
+    }
+
+    /** Wrap the result in a JSON-RPC reply object */
+    void BeginReply()
+    {
+        BeginObject();
+        Key("result");
+    }
+
+    void EndReply(const Value& id)
+    {
+        Key("error");
+        Write(Value::null);
+        Key("id");
+        Write(id);
+        EndObject();
+        Append("\n");
+    }
+
+    void Finish()
+    {
+        if (!fHeaderSent)
+        {
+            stream << HTTPReply(200, strBuffer, fKeepAlive) << std::flush;
+            strBuffer.clear();
+            return;
+        }
+        Flush();
+        stream << "0\r\n\r\n" << std::flush;
+    }
+};
+
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
 {
     string str;
@@ -2529,7 +2982,32 @@ int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHea
     return nLen;
 }
 
-int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
+static bool ReadHTTPChunked(std::basic_istream<char>& stream, string& strMessageRet)
+{
+    loop
+    {
+        string str;
+        std::getline(stream, str);
+        if (!stream)
+            return false;
+        int nLen = strtol(str.c_str(), NULL, 16);
+        if (nLen < 0 || strMessageRet.size() + nLen > MAX_SIZE)
+            return false;
+        if (nLen == 0)
+            break;
+        vector<char> vch(nLen);
+        stream.read(&vch[0], nLen);
+        strMessageRet.append(vch.begin(), vch.end());
+        std::getline(stream, str); // CRLF after the chunk data
+    }
+
+    // Skip trailer headers
+    map<string, string> mapTrailers;
+    ReadHTTPHeader(stream, mapTrailers);
+    return true;
+}
+
+int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet, int* pnProto = NULL)
 {
     mapHeadersRet.clear();
     strMessageRet = "";
@@ -2537,6 +3015,8 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
     // Read status
     int nProto = 0;
     int nStatus = ReadHTTPStatus(stream, nProto);
+    if (pnProto)
+        *pnProto = nProto;
 
     // Read header
     int nLen = ReadHTTPHeader(stream, mapHeadersRet);
@@ -2544,7 +3024,12 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
         return 500;
 
     // Read message
-    if (nLen > 0)
+    if (mapHeadersRet["transfer-encoding"] == "chunked")
+    {
+        if (!ReadHTTPChunked(stream, strMessageRet))
+            return 500;
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -2651,10 +3136,11 @@ bool ClientAllowed(const boost::asio::ip::address& address)
 template <typename Protocol>
 class SSLIOStreamDevice : public iostreams::device<iostreams::bidirectional> {
 public:
-    SSLIOStreamDevice(asio::ssl::stream<typename Protocol::socket> &streamIn, bool fUseSSLIn) : stream(streamIn)
+    SSLIOStreamDevice(asio::ssl::stream<typename Protocol::socket> &streamIn, bool fUseSSLIn, int64* pnDeadlineIn = NULL) : stream(streamIn)
     {
         fUseSSL = fUseSSLIn;
         fNeedHandshake = fUseSSLIn;
+        pnDeadline = pnDeadlineIn;
     }
 
     void handshake(ssl::stream_base::handshake_type role)
@@ -2665,6 +3151,13 @@ public:
     }
     std::streamsize read(char* s, std::streamsize n)
     {
+        // A client that is too slow to send its request reads as EOF
+        if (pnDeadline && *pnDeadline)
+        {
+            int64 nLeft = *pnDeadline - GetTimeMillis();
+            if (nLeft <= 0 || !WaitReadable(nLeft))
+                return -1;
+        }
         handshake(ssl::stream_base::server); // HTTPS servers read first
         if (fUseSSL) return stream.read_some(asio::buffer(s, n));
         return stream.next_layer().read_some(asio::buffer(s, n));
@@ -2692,9 +3185,40 @@ public:
         return true;
     }
 
+    // Decrypted data that SSL has read from the socket but not handed out yet
+    bool HasPending()
+    {
+#if BOOST_VERSION >= 104700
+        return fUseSSL && SSL_pending(stream.native_handle()) > 0;
+#else
+        return fUseSSL && SSL_pending(stream.impl()->ssl) > 0;
+#endif
+    }
+
+    // Wait up to nMilliseconds for something to read, without reading it
+    bool WaitReadable(int64 nMilliseconds)
+    {
+        if (HasPending())
+            return true;
+#if BOOST_VERSION >= 104700
+        SOCKET hSocket = stream.lowest_layer().native_handle();
+#else
+        SOCKET hSocket = stream.lowest_layer().native();
+#endif
+        struct timeval timeout;
+        timeout.tv_sec = nMilliseconds / 1000;
+        timeout.tv_usec = (nMilliseconds % 1000) * 1000;
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        FD_SET(hSocket, &fdsetRecv);
+        // Errors count as readable, the read reports them
+        return select(hSocket + 1, &fdsetRecv, NULL, NULL, &timeout) != 0;
+    }
+
 private:
     bool fNeedHandshake;
     bool fUseSSL;
+    int64* pnDeadline;
     asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
@@ -2706,8 +3230,23 @@ public:
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+    // Wait up to nMilliseconds for something to read, without reading it
+    virtual bool WaitReadable(int nMilliseconds) = 0;
+    // Reads fail once GetTimeMillis() passes nDeadline, 0 for no deadline
+    virtual void SetDeadline(int64 nDeadline) = 0;
+    // Queue the connection again once its next request arrives, waiting for
+    // it in the acceptor rather than in a worker. Takes ownership.
+    virtual void WaitNextRequest() = 0;
 };
 
+// Seconds a connection may take to send a request, see -rpcservertimeout
+static int nRPCServerTimeout = 5;
+
+// Seconds a kept-alive connection may wait for its next request
+static const int RPC_IDLE_TIMEOUT = 30;
+
+static bool QueueRPCConnection(AcceptedConnection* conn);
+
 template <typename Protocol>
 class AcceptedConnectionImpl : public AcceptedConnection
 {
@@ -2717,7 +3256,11 @@ public:
             ssl::context &context,
             bool fUseSSL) :
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
+        idleTimer(io_service),
+        nDeadline(0),
+        nIdleHandlers(0),
+        fIdleReadable(false),
+        _d(sslStream, fUseSSL, &nDeadline),
         _stream(_d)
     {
     }
@@ -2737,14 +3280,133 @@ public:
         _stream.close();
     }
 
+    virtual bool WaitReadable(int nMilliseconds)
+    {
+        // Already read from the socket by the stream
+        if (_stream.rdbuf()->in_avail() > 0)
+            return true;
+        return _d.WaitReadable(nMilliseconds);
+    }
+
+    virtual void SetDeadline(int64 nDeadlineIn)
+    {
+        nDeadline = nDeadlineIn;
+    }
+
+    virtual void WaitNextRequest()
+    {
+        if (fShutdown)
+        {
+            close();
+            delete this;
+            return;
+        }
+
+        // A pipelined request is already buffered, the socket may stay quiet
+        if (_stream.rdbuf()->in_avail() > 0 || _d.HasPending())
+        {
+            if (!QueueRPCConnection(this))
+            {
+                close();
+                delete this;
+            }
+            return;
+        }
+
+        sslStream.get_io_service().post(boost::bind(&AcceptedConnectionImpl<Protocol>::StartIdleWait, this));
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
 private:
+    // Runs in the acceptor thread: wait for the socket to become readable or
+    // for RPC_IDLE_TIMEOUT to pass, whichever comes first cancels the other
+    void StartIdleWait()
+    {
+        nIdleHandlers = 2;
+        fIdleReadable = false;
+        idleTimer.expires_from_now(boost::posix_time::seconds(RPC_IDLE_TIMEOUT));
+        idleTimer.async_wait(boost::bind(&AcceptedConnectionImpl<Protocol>::IdleHandler,
+                                         this, false, asio::placeholders::error));
+        sslStream.lowest_layer().async_read_some(asio::null_buffers(),
+                                                 boost::bind(&AcceptedConnectionImpl<Protocol>::IdleHandler,
+                                                             this, true, asio::placeholders::error));
+    }
+
+    void IdleHandler(bool fRead, const boost::system::error_code& error)
+    {
+        if (fRead && error != asio::error::operation_aborted)
+        {
+            fIdleReadable = !error;
+            idleTimer.cancel();
+        }
+        else if (!fRead && !error)
+            sslStream.lowest_layer().cancel();
+
+        // The connection is only ours again once both handlers are done
+        if (--nIdleHandlers > 0)
+            return;
+        if (fIdleReadable && !fShutdown && QueueRPCConnection(this))
+            return;
+        close();
+        delete this;
+    }
+
+    asio::deadline_timer idleTimer;
+    int64 nDeadline;
+    int nIdleHandlers;
+    bool fIdleReadable;
     SSLIOStreamDevice<Protocol> _d;
     iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
 };
 
+//
+// Accepted connections wait in queueRPC until one of the -rpcthreads worker
+// threads is free, so a burst of clients does not turn into a burst of threads.
+//
+static CWaitableCriticalSection cs_queueRPC;
+static boost::condition_variable condQueueRPC;
+static std::deque<AcceptedConnection*> queueRPC;
+static unsigned int nRPCThreads = 0;
+static unsigned int nRPCWorkQueue = 0;
+static uint64 nRPCQueueRejected = 0;
+
+static bool QueueRPCConnection(AcceptedConnection* conn)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_queueRPC);
+        if (queueRPC.size() >= nRPCWorkQueue)
+        {
+            nRPCQueueRejected++;
+            return false;
+        }
+        queueRPC.push_back(conn);
+    }
+    condQueueRPC.notify_one();
+    return true;
+}
+
+static AcceptedConnection* DequeueRPCConnection()
+{
+    boost::unique_lock<boost::mutex> lock(cs_queueRPC);
+    while (queueRPC.empty() && !fShutdown)
+        condQueueRPC.timed_wait(lock, boost::posix_time::milliseconds(500));
+    if (queueRPC.empty())
+        return NULL;
+    AcceptedConnection* conn = queueRPC.front();
+    queueRPC.pop_front();
+    return conn;
+}
+
+static void ClearRPCQueue()
+{
+    boost::unique_lock<boost::mutex> lock(cs_queueRPC);
+    BOOST_FOREACH(AcceptedConnection* conn, queueRPC)
+        delete conn;
+    queueRPC.clear();
+}
+
 void ThreadRPCServer(void* parg)
 {
     IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer(parg));
@@ -2798,6 +3460,24 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
                 boost::asio::placeholders::error));
 }
 
+template <typename Protocol>
+static void RPCAsyncReplyHandler(AcceptedConnectionImpl<Protocol>* conn, boost::shared_ptr<std::string> pstrReply)
+{
+    delete conn;
+}
+
+/**
+ * Send a reply and close the connection, without the acceptor waiting on a
+ * client that doesn't read.
+ */
+template <typename Protocol>
+static void RPCAsyncReply(AcceptedConnectionImpl<Protocol>* conn, const std::string& strReply)
+{
+    boost::shared_ptr<std::string> pstrReply(new std::string(strReply));
+    asio::async_write(conn->sslStream.next_layer(), asio::buffer(*pstrReply),
+                      boost::bind(&RPCAsyncReplyHandler<Protocol>, conn, pstrReply));
+}
+
 /**
  * Accept and handle incoming connection.
  */
@@ -2815,6 +3495,7 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
      && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
+    AcceptedConnectionImpl<Protocol>* proto_conn = static_cast< AcceptedConnectionImpl<Protocol>* >(conn);
     AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
 
     // TODO: Actually handle errors
@@ -2831,14 +3512,19 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(403, "", false) << std::flush;
-        delete conn;
+            RPCAsyncReply(proto_conn, HTTPReply(403, "", false));
+        else
+            delete conn;
     }
 
-    // start HTTP client thread
-    else if (!CreateThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
+    // Hand over to the worker threads, or push back if too much work is queued
+    else if (!QueueRPCConnection(conn))
+    {
+        // Only send a 503 if we're not using SSL to prevent a DoS during the SSL handshake.
+        if (!fUseSSL)
+            RPCAsyncReply(proto_conn, HTTPReply(503, JSONRPCReply(Value::null, JSONRPCError(-32000, "Work queue depth exceeded"), Value::null), false));
+        else
+            delete conn;
     }
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
@@ -2964,11 +3650,19 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    nRPCWorkQueue = std::max((int64)1, GetArg("-rpcworkqueue", 16));
+    nRPCServerTimeout = std::max((int64)1, GetArg("-rpcservertimeout", 5));
+    nRPCThreads = std::max((int64)1, GetArg("-rpcthreads", 4));
+    for (unsigned int i = 0; i < nRPCThreads; i++)
+        if (!CreateThread(ThreadRPCServer3, NULL))
+            printf("Error: CreateThread(ThreadRPCServer3) failed\n");
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
         io_service.run_one();
     vnThreadsRunning[THREAD_RPCLISTENER]++;
     StopRequests();
+    ClearRPCQueue();
 }
 
 class JSONRequest
@@ -3047,104 +3741,290 @@ static string JSONRPCExecBatch(const Array& vReq)
 
 static CCriticalSection cs_THREAD_RPCHANDLER;
 
-void ThreadRPCServer3(void* parg)
+/**
+ * Serve one HTTP request. The whole request has to arrive within
+ * -rpcservertimeout seconds. Returns true if the connection is kept alive
+ * for another request.
+ */
+static bool ServiceConnection(AcceptedConnection *conn)
 {
-    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer3(parg));
+    bool fRun = true;
+    if (!conn->WaitReadable(nRPCServerTimeout * 1000))
+        return false;
 
-    // Make this thread recognisable as the RPC handler
-    RenameThread("bitcoin-rpchand");
+    map<string, string> mapHeaders;
+    string strRequest;
 
+    int nProto = 0;
+    conn->SetDeadline(GetTimeMillis() + nRPCServerTimeout * 1000);
+    ReadHTTP(conn->stream(), mapHeaders, strRequest, &nProto);
+    conn->SetDeadline(0);
+    if (!conn->stream())
+        return false;
+
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]++;
+        conn->stream() << HTTPReply(401, "", false) << std::flush;
+        return false;
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            Sleep(250);
+
+        conn->stream() << HTTPReply(401, "", false) << std::flush;
+        return false;
+    }
+    if (mapHeaders["connection"] == "close")
+        fRun = false;
 
-    bool fRun = true;
-    loop {
-        if (fShutdown || !fRun)
-        {
-            conn->close();
-            delete conn;
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!read_string(strRequest, valRequest))
+            throw JSONRPCError(-32700, "Parse error");
+
+        string strReply;
+
+        // singleton request for a streaming command from a HTTP/1.1
+        // client: stream the reply
+        const CRPCCommand *pcmd = NULL;
+        if (valRequest.type() == obj_type && nProto >= 1) {
+            jreq.parse(valRequest);
+            pcmd = tableRPC[jreq.strMethod];
+        }
+        if (pcmd && pcmd->streamer) {
+            CRPCChunkedWriter writer(conn->stream(), fRun);
+            writer.SetDeferred(!pcmd->threadSafe);
+            try
             {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
+                writer.BeginReply();
+                tableRPC.execute(jreq.strMethod, jreq.params, writer);
+                writer.EndReply(jreq.id);
             }
-            return;
+            catch (...)
+            {
+                if (!writer.HeaderSent())
+                    throw;
+                // Part of the result is already out, all we can do is drop the connection
+                printf("ThreadRPCServer method=%s failed while streaming reply\n", jreq.strMethod.c_str());
+                return false;
+            }
+            writer.Finish();
+            return fRun;
         }
-        map<string, string> mapHeaders;
-        string strRequest;
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(401, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                Sleep(250);
-
-            conn->stream() << HTTPReply(401, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(-32700, "Parse error");
+            // Send reply
+            strReply = JSONRPCReply(result, Value::null, jreq.id);
 
-            string strReply;
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(-32700, "Top-level object parse error");
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+        conn->stream() << HTTPReply(200, strReply, fRun) << std::flush;
+    }
+    catch (Object& objError)
+    {
+        ErrorReply(conn->stream(), objError, jreq.id);
+        return false;
+    }
+    catch (std::exception& e)
+    {
+        ErrorReply(conn->stream(), JSONRPCError(-32700, e.what()), jreq.id);
+        return false;
+    }
+    return fRun;
+}
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+void ThreadRPCServer3(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer3(parg));
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+    // Make this thread recognisable as the RPC handler
+    RenameThread("bitcoin-rpchand");
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(-32700, "Top-level object parse error");
-                
-            conn->stream() << HTTPReply(200, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]++;
+    }
+
+    while (!fShutdown)
+    {
+        AcceptedConnection *conn = DequeueRPCConnection();
+        if (conn == NULL)
+            continue;
+        bool fKeepAlive = false;
+        try
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            fKeepAlive = ServiceConnection(conn);
         }
-        catch (std::exception& e)
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadRPCServer3()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadRPCServer3()");
+        }
+        if (fKeepAlive)
         {
-            ErrorReply(conn->stream(), JSONRPCError(-32700, e.what()), jreq.id);
-            break;
+            conn->WaitNextRequest();
+            continue;
         }
+        conn->close();
+        delete conn;
     }
 
-    delete conn;
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]--;
     }
 }
 
+static void ExecuteCommand(const CRPCCommand *pcmd, const Array& params, CRPCResultWriter& writer)
+{
+    if (pcmd->streamer)
+        pcmd->streamer(params, false, writer);
+    else
+        writer.Write(pcmd->actor(params, false));
+}
+
+//
+// Per-method call statistics, reported by getrpcinfo
+//
+
+// Upper bounds of the latency histogram buckets in milliseconds,
+// the last bucket counts everything slower
+static const int64 nRPCLatencyBounds[] = { 1, 10, 100, 1000, 10000 };
+static const unsigned int RPC_LATENCY_BUCKETS = sizeof(nRPCLatencyBounds) / sizeof(nRPCLatencyBounds[0]) + 1;
+
+class CRPCMethodStats
+{
+public:
+    uint64 nCalls;
+    uint64 nErrors;
+    int nActive;
+    int nMaxActive;
+    int64 nTotalMicros;
+    int64 nMaxMicros;
+    uint64 vnLatency[RPC_LATENCY_BUCKETS];
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nActive(0), nMaxActive(0), nTotalMicros(0), nMaxMicros(0)
+    {
+        for (unsigned int i = 0; i < RPC_LATENCY_BUCKETS; i++)
+            vnLatency[i] = 0;
+    }
+};
+
+static CCriticalSection cs_mapRPCStats;
+static map<string, CRPCMethodStats> mapRPCStats;
+
+/** RAII helper accounting one call of an RPC method, including time spent waiting for locks */
+class CRPCCallTimer
+{
+private:
+    std::string strMethod;
+    int64 nStart;
+    bool fSuccess;
+
+public:
+    CRPCCallTimer(const std::string& strMethodIn) : strMethod(strMethodIn), nStart(GetTimeMicros()), fSuccess(false)
+    {
+        LOCK(cs_mapRPCStats);
+        CRPCMethodStats& stats = mapRPCStats[strMethod];
+        stats.nActive++;
+        stats.nMaxActive = std::max(stats.nMaxActive, stats.nActive);
+    }
+
+    void Success()
+    {
+        fSuccess = true;
+    }
+
+    ~CRPCCallTimer()
+    {
+        int64 nElapsed = GetTimeMicros() - nStart;
+        unsigned int nBucket = 0;
+        while (nBucket < RPC_LATENCY_BUCKETS - 1 && nElapsed >= nRPCLatencyBounds[nBucket] * 1000)
+            nBucket++;
+
+        LOCK(cs_mapRPCStats);
+        CRPCMethodStats& stats = mapRPCStats[strMethod];
+        stats.nActive--;
+        stats.nCalls++;
+        if (!fSuccess)
+            stats.nErrors++;
+        stats.nTotalMicros += nElapsed;
+        stats.nMaxMicros = std::max(stats.nMaxMicros, nElapsed);
+        stats.vnLatency[nBucket]++;
+    }
+};
+
+Value getrpcinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "Returns RPC server work queue state and per-method call counts,\n"
+            "concurrency and latency histograms (in milliseconds).");
+
+    Object obj;
+    obj.push_back(Pair("threads",   (int)nRPCThreads));
+    obj.push_back(Pair("workqueue", (int)nRPCWorkQueue));
+    {
+        boost::unique_lock<boost::mutex> lock(cs_queueRPC);
+        obj.push_back(Pair("queued",   (int)queueRPC.size()));
+        obj.push_back(Pair("rejected", (boost::uint64_t)nRPCQueueRejected));
+    }
+
+    Object methods;
+    {
+        LOCK(cs_mapRPCStats);
+        BOOST_FOREACH(const PAIRTYPE(string, CRPCMethodStats)& item, mapRPCStats)
+        {
+            const CRPCMethodStats& stats = item.second;
+            Object latency;
+            for (unsigned int i = 0; i < RPC_LATENCY_BUCKETS; i++)
+            {
+                string strBucket = (i < RPC_LATENCY_BUCKETS - 1) ? strprintf("<%"PRI64d, nRPCLatencyBounds[i]) : strprintf(">=%"PRI64d, nRPCLatencyBounds[i-1]);
+                latency.push_back(Pair(strBucket, (boost::uint64_t)stats.vnLatency[i]));
+            }
+
+            Object method;
+            method.push_back(Pair("calls",     (boost::uint64_t)stats.nCalls));
+            method.push_back(Pair("errors",    (boost::uint64_t)stats.nErrors));
+            method.push_back(Pair("active",    stats.nActive));
+            method.push_back(Pair("maxactive", stats.nMaxActive));
+            method.push_back(Pair("avgms",     stats.nCalls ? (double)stats.nTotalMicros / stats.nCalls / 1000.0 : 0.0));
+            method.push_back(Pair("maxms",     (double)stats.nMaxMicros / 1000.0));
+            method.push_back(Pair("latency",   latency));
+            methods.push_back(Pair(item.first, method));
+        }
+    }
+    obj.push_back(Pair("methods", methods));
+    return obj;
+}
+
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    CRPCValueWriter writer;
+    execute(strMethod, params, writer);
+    return writer.GetValue();
+}
+
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CRPCResultWriter &writer) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -3157,15 +4037,18 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(-2, string("Safe mode: ") + strWarning);
 
+    CRPCCallTimer timer(pcmd->name);
     try
     {
         // Execute
-        Value result;
+        if (pcmd->threadSafe)
+            ExecuteCommand(pcmd, params, writer);
+        else
         {
             LOCK2(cs_main, pwalletMain->cs_wallet);
-            result = pcmd->actor(params, false);
+            ExecuteCommand(pcmd, params, writer);
         }
-        return result;
+        timer.Success();
     }
     catch (std::exception& e)
     {
@@ -3271,6 +4154,10 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listreceivedbyaccount"  && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getbalance"             && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getblockhash"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "getlockstats"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "setpoolmining"          && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "setpoolmining"          && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "setpoolmining"          && n > 5) ConvertTo<boost::int64_t>(params[5]);
     if (strMethod == "move"                   && n > 2) ConvertTo<double>(params[2]);
     if (strMethod == "move"                   && n > 3) ConvertTo<boost::int64_t>(params[3]);
     if (strMethod == "sendfrom"               && n > 2) ConvertTo<double>(params[2]);
@@ -3279,6 +4166,7 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listtransactions"       && n > 2) ConvertTo<boost::int64_t>(params[2]);
     if (strMethod == "listaccounts"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "walletpassphrase"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "walletpassphrase"       && n > 2) ConvertTo<boost::int64_t>(params[2]);
     if (strMethod == "getblocktemplate"       && n > 0) ConvertTo<Object>(params[0]);
     if (strMethod == "listsinceblock"         && n > 1) ConvertTo<boost::int64_t>(params[1]);
 	if (strMethod == "enforcecheckpoint"      && n > 0) ConvertTo<bool>(params[0]);
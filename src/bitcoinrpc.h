@@ -11,6 +11,7 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
 
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
@@ -38,7 +39,50 @@ void RPCTypeCheck(const json_spirit::Array& params,
 void RPCTypeCheck(const json_spirit::Object& o,
                   const std::map<std::string, json_spirit::Value_type>& typesExpected);
 
+/**
+ * Incremental output of an RPC result. Commands whose results can get large
+ * write them through this interface one piece at a time, so they can be sent
+ * to the client while being generated instead of being built as a whole
+ * json_spirit tree first.
+ */
+class CRPCResultWriter
+{
+public:
+    virtual ~CRPCResultWriter() {}
+
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    /** Name of the next member inside an object */
+    virtual void Key(const std::string& strKey) = 0;
+    /** A complete value: array element, object member or the whole result */
+    virtual void Write(const json_spirit::Value& value) = 0;
+};
+
+/** CRPCResultWriter that collects the result into a json_spirit::Value */
+class CRPCValueWriter : public CRPCResultWriter
+{
+private:
+    json_spirit::Value result;
+    std::vector<json_spirit::Value*> vOpen; // arrays and objects not yet ended
+    std::string strKey;
+
+    json_spirit::Value* Add(const json_spirit::Value& value);
+
+public:
+    void BeginArray();
+    void EndArray();
+    void BeginObject();
+    void EndObject();
+    void Key(const std::string& strKeyIn);
+    void Write(const json_spirit::Value& value);
+
+    const json_spirit::Value& GetValue() const { return result; }
+};
+
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, bool fHelp, CRPCResultWriter& writer);
 
 class CRPCCommand
 {
@@ -46,6 +90,8 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
+    bool threadSafe; // if false, called with cs_main and cs_wallet held
+    rpcstreamfn_type streamer; // optional incremental version of actor
 };
 
 /**
@@ -68,6 +114,12 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method, writing the result to writer as it is generated.
+     * @throws an exception (json_spirit::Value) when an error happens.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CRPCResultWriter &writer) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -115,6 +115,14 @@ void CDBEnv::CheckpointLSN(std::string strFile)
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
+static bool IsChainFile(std::string strFile)
+{
+    if (strFile == "blkindex.dat")
+        return true;
+
+    return false;
+}
+
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
     pdb(NULL), activeTxn(NULL)
@@ -128,6 +136,10 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
     unsigned int nFlags = DB_THREAD;
     if (fCreate)
         nFlags |= DB_CREATE;
+    // Keep page versions so Backup can read a snapshot without blocking
+    // writers. Not worth the cache for the block index.
+    if (!IsChainFile(pszFile))
+        nFlags |= DB_MULTIVERSION;
 
     {
         LOCK(bitdb.cs_db);
@@ -173,14 +185,6 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
     }
 }
 
-static bool IsChainFile(std::string strFile)
-{
-    if (strFile == "blkindex.dat")
-        return true;
-
-    return false;
-}
-
 void CDB::Close()
 {
     if (!pdb)
@@ -315,6 +319,147 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
     return false;
 }
 
+// Order of keys in a btree database with the default comparison
+static int CompareKeys(const CDataStream& ssKey1, const CDataStream& ssKey2)
+{
+    int nCmp = memcmp(&ssKey1[0], &ssKey2[0], std::min(ssKey1.size(), ssKey2.size()));
+    if (nCmp != 0)
+        return nCmp;
+    return (ssKey1.size() < ssKey2.size()) ? -1 : (ssKey1.size() > ssKey2.size()) ? 1 : 0;
+}
+
+bool CDB::Backup(const string& strFile, const boost::filesystem::path& pathDest, unsigned int& nChanged)
+{
+    nChanged = 0;
+
+    // The copy is written next to the destination and only renamed over it
+    // once complete, so a failure never touches the previous backup
+    boost::filesystem::path pathTmp = pathDest.string() + ".tmp";
+    try {
+        boost::filesystem::remove(pathTmp);
+    } catch (const boost::filesystem::filesystem_error& e) {
+        return error("CDB::Backup() : can't remove %s - %s", pathTmp.string().c_str(), e.what());
+    }
+
+    bool fSuccess = true;
+    bool fHaveOld = false;
+    {
+        CDB db(strFile.c_str(), "r");
+
+        // The previous backup, to tell whether anything changed. If it
+        // can't be read everything counts as changed.
+        Db dbOld(NULL, 0);
+        Dbc* pcursorOld = NULL;
+        if (boost::filesystem::exists(pathDest) &&
+            dbOld.open(NULL, pathDest.string().c_str(), "main", DB_BTREE, DB_RDONLY, 0) == 0)
+        {
+            fHaveOld = true;
+            if (dbOld.cursor(NULL, &pcursorOld, 0) != 0)
+                pcursorOld = NULL;
+        }
+
+        // The copy is a standalone file outside the environment, so it can
+        // be restored anywhere
+        Db dbCopy(NULL, 0);
+        int ret = dbCopy.open(NULL, pathTmp.string().c_str(), "main", DB_BTREE, DB_CREATE | DB_EXCL, 0);
+        if (ret != 0)
+        {
+            if (pcursorOld)
+                pcursorOld->close();
+            dbOld.close(0);
+            return error("CDB::Backup() : can't create %s, error %d", pathTmp.string().c_str(), ret);
+        }
+
+        // Read from a snapshot, the file stays open and writers carry on
+        DbTxn* ptxn = bitdb.TxnBegin(DB_TXN_SNAPSHOT);
+        Dbc* pcursor = NULL;
+        if (!ptxn || db.pdb->cursor(ptxn, &pcursor, 0) != 0)
+        {
+            pcursor = NULL;
+            fSuccess = error("CDB::Backup() : can't read snapshot of %s", strFile.c_str());
+        }
+
+        // Walk both files in key order
+        CDataStream ssKeyOld(SER_DISK, CLIENT_VERSION);
+        CDataStream ssValueOld(SER_DISK, CLIENT_VERSION);
+        bool fOld = pcursorOld && db.ReadAtCursor(pcursorOld, ssKeyOld, ssValueOld) == 0;
+        while (fSuccess)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ret = db.ReadAtCursor(pcursor, ssKey, ssValue);
+            if (ret == DB_NOTFOUND)
+                break;
+            if (ret != 0)
+            {
+                fSuccess = error("CDB::Backup() : error %d reading %s", ret, strFile.c_str());
+                break;
+            }
+
+            // Records only in the old backup were deleted since
+            while (fOld && CompareKeys(ssKeyOld, ssKey) < 0)
+            {
+                nChanged++;
+                fOld = db.ReadAtCursor(pcursorOld, ssKeyOld, ssValueOld) == 0;
+            }
+            if (fOld && CompareKeys(ssKeyOld, ssKey) == 0)
+            {
+                if (ssValueOld.size() != ssValue.size() || (ssValue.size() > 0 && memcmp(&ssValueOld[0], &ssValue[0], ssValue.size()) != 0))
+                    nChanged++;
+                fOld = db.ReadAtCursor(pcursorOld, ssKeyOld, ssValueOld) == 0;
+            }
+            else
+                nChanged++;
+
+            Dbt datKey(&ssKey[0], ssKey.size());
+            Dbt datValue(&ssValue[0], ssValue.size());
+            if (dbCopy.put(NULL, &datKey, &datValue, 0) != 0)
+                fSuccess = error("CDB::Backup() : error writing %s", pathTmp.string().c_str());
+        }
+        while (fOld)
+        {
+            nChanged++;
+            fOld = db.ReadAtCursor(pcursorOld, ssKeyOld, ssValueOld) == 0;
+        }
+
+        if (pcursor)
+            pcursor->close();
+        if (ptxn)
+            ptxn->commit(0);
+        if (pcursorOld)
+            pcursorOld->close();
+        dbOld.close(0);
+        if (dbCopy.close(0) != 0)
+            fSuccess = error("CDB::Backup() : error closing %s", pathTmp.string().c_str());
+    }
+
+    if (fSuccess && fHaveOld && nChanged == 0)
+    {
+        // The backup is up to date
+        boost::filesystem::remove(pathTmp);
+        return true;
+    }
+
+    if (fSuccess)
+    {
+        FILE* file = fopen(pathTmp.string().c_str(), "rb+");
+        if (file)
+        {
+            FileCommit(file);
+            fclose(file);
+        }
+        if (!file || !RenameOver(pathTmp, pathDest))
+            fSuccess = error("CDB::Backup() : can't move %s into place", pathTmp.string().c_str());
+    }
+    if (!fSuccess)
+    {
+        try {
+            boost::filesystem::remove(pathTmp);
+        } catch (const boost::filesystem::filesystem_error& e) {}
+    }
+    return fSuccess;
+}
+
 
 void CDBEnv::Flush(bool fShutdown)
 {
@@ -533,6 +678,7 @@ bool CTxDB::LoadBlockIndex()
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
     bnBestChainWork = pindexBest->bnChainWork;
+    PublishChainTip();
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  date=%s\n",
       hashBestChain.ToString().substr(0,20).c_str(), nBestHeight,
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -764,7 +910,9 @@ bool CAddrDB::Write(const CAddrMan& addr)
     RAND_bytes((unsigned char *)&randv, sizeof(randv));
     std::string tmpfn = strprintf("peers.dat.%04x", randv);
 
-    // serialize addresses, checksum data up to that point, then append csum
+    // serialize addresses, checksum data up to that point, then append csum.
+    // addrman's lock is only held while copying into memory, never during
+    // the file I/O below
     CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
     ssPeers << FLATDATA(pchMessageStart);
     ssPeers << addr;
@@ -287,6 +287,10 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+    /** Copy strFile to pathDest without closing it. The copy replaces
+     *  pathDest once it is complete, unless nothing changed since.
+     *  nChanged counts the records added, changed or deleted. */
+    bool static Backup(const std::string& strFile, const boost::filesystem::path& pathDest, unsigned int& nChanged);
 };
 
 
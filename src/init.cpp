@@ -9,6 +9,7 @@
 #include "bitcoinrpc.h"
 #include "net.h"
 #include "init.h"
+#include "stratum.h"
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpointsync.h"
@@ -74,6 +75,7 @@ void Shutdown(void* parg)
     {
         fShutdown = true;
         nTransactionsUpdated++;
+        StopPoolMining();
         bitdb.Flush(false);
         StopNode();
         bitdb.Flush(true);
@@ -83,6 +85,7 @@ void Shutdown(void* parg)
         CreateThread(ExitTimeout, NULL);
         Sleep(50);
         printf("AuroraCoin exited\n\n");
+        StopLogWriter();
         fExit = true;
 #ifndef QT_GUI
         // ensure non UI client get's exited here, but let Bitcoin-Qt reach return 0; in bitcoin.cpp
@@ -225,6 +228,7 @@ std::string HelpMessage()
         "  -gen=0                 " + _("Don't generate coins") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -blockcachesize=<n>    " + _("Set cache size for recently served blocks in megabytes (default: 16)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout (in milliseconds)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
@@ -247,6 +251,7 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -headersfirst          " + _("Download and check block headers before the blocks when far behind (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -265,6 +270,7 @@ std::string HelpMessage()
 #endif
         "  -testnet               " + _("Use the test network") + "\n" +
         "  -debug                 " + _("Output extra debugging information. Implies all other -debug* options") + "\n" +
+        "  -debug=<category>      " + _("Output debugging information for a category: net, mempool, mining, retarget or lock") + "\n" +
         "  -debugnet              " + _("Output extra network debugging information") + "\n" +
         "  -logtimestamps         " + _("Prepend debug output with timestamp") + "\n" +
         "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n" +
@@ -276,9 +282,14 @@ std::string HelpMessage()
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 12341)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
+        "  -rpcthreads=<n>        " + _("Number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Number of accepted RPC connections allowed to wait for a thread (default: 16)") + "\n" +
+        "  -rpcservertimeout=<n>  " + _("Seconds an RPC client may take to send a request (default: 5)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
+        "  -walletunlockcache=<n> " + _("Keep the wallet key for <n> seconds after unlocking unless walletlock is called, unlocking again with the same passphrase is then instant (default: 0)") + "\n" +
+        "  -checkwalletkeys       " + _("Verify the public key of every wallet key at startup (default: 1)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
@@ -370,12 +381,13 @@ bool AppInit2()
     // ********************************************************* Step 3: parameter-to-internal-flags
 
     fDebug = GetBoolArg("-debug");
+    if (mapArgs.count("-debug"))
+        nLogCategories = ParseLogCategories(mapMultiArgs["-debug"]);
+    if (GetBoolArg("-debugnet"))
+        nLogCategories |= LOG_NET;
 
     // -debug implies fDebug*
-    if (fDebug)
-        fDebugNet = true;
-    else
-        fDebugNet = GetBoolArg("-debugnet");
+    fDebugNet = LogAcceptCategory(LOG_NET);
 
     bitdb.SetDetach(GetBoolArg("-detachdb", false));
 
@@ -466,6 +478,7 @@ bool AppInit2()
 
     if (!fDebug)
         ShrinkDebugFile();
+    StartLogWriter();
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("AuroraCoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
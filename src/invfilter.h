@@ -0,0 +1,195 @@
+// Copyright (c) 2013 AuroraCoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_INVFILTER_H
+#define BITCOIN_INVFILTER_H
+
+#include <vector>
+
+#include "protocol.h"
+#include "util.h"
+
+/** 64 bit fingerprint of an inventory item. The salt keeps others from
+ *  crafting items that collide with ours. Never returns 0. */
+inline uint64 GetInvFingerprint(const CInv& inv, uint64 nSalt)
+{
+    uint64 h = (inv.hash.Get64(0) ^ nSalt) * 0x9e3779b97f4a7c15ULL;
+    h ^= inv.hash.Get64(1) + (uint64)inv.type;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+/** Set of the most recent N inventory items, kept as fingerprints in an
+ *  open addressed hash table of fixed size. Insert and lookup are O(1).
+ *  Two items with the same fingerprint are treated as the same item. */
+class CInvFilter
+{
+private:
+    std::vector<uint64> vTable; // linear probing, 0 is an empty slot
+    std::vector<uint64> vQueue; // ring of fingerprints in insertion order
+    unsigned int nQueueStart;
+    unsigned int nSize;
+    unsigned int nMaxSize;
+    uint64 nSalt;
+
+    unsigned int Find(uint64 h) const
+    {
+        unsigned int nMask = vTable.size() - 1;
+        unsigned int i = h & nMask;
+        while (vTable[i] != 0 && vTable[i] != h)
+            i = (i + 1) & nMask;
+        return i;
+    }
+
+    void Remove(uint64 h)
+    {
+        unsigned int nMask = vTable.size() - 1;
+        unsigned int i = Find(h);
+        if (vTable[i] == 0)
+            return;
+        vTable[i] = 0;
+
+        // Move back the entries after it that would no longer be found
+        for (unsigned int j = (i + 1) & nMask; vTable[j] != 0; j = (j + 1) & nMask)
+        {
+            unsigned int k = vTable[j] & nMask;
+            bool fInPlace = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+            if (!fInPlace)
+            {
+                vTable[i] = vTable[j];
+                vTable[j] = 0;
+                i = j;
+            }
+        }
+    }
+
+public:
+    CInvFilter(unsigned int nMaxSizeIn = 1000)
+    {
+        nSalt = GetRand(~(uint64)0);
+        max_size(nMaxSizeIn);
+    }
+
+    unsigned int size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    unsigned int max_size() const { return nMaxSize; }
+
+    // Changing the size forgets all items
+    void max_size(unsigned int nMaxSizeIn)
+    {
+        nMaxSize = std::max(nMaxSizeIn, 1U);
+        unsigned int nTableSize = 1;
+        while (nTableSize < 2 * nMaxSize)
+            nTableSize <<= 1;
+        vTable.assign(nTableSize, 0);
+        vQueue.assign(nMaxSize, 0);
+        nQueueStart = 0;
+        nSize = 0;
+    }
+
+    void clear()
+    {
+        std::fill(vTable.begin(), vTable.end(), 0);
+        nQueueStart = 0;
+        nSize = 0;
+    }
+
+    unsigned int count(const CInv& inv) const
+    {
+        return vTable[Find(GetInvFingerprint(inv, nSalt))] != 0 ? 1 : 0;
+    }
+
+    // Returns true if the item wasn't already contained
+    bool insert(const CInv& inv)
+    {
+        uint64 h = GetInvFingerprint(inv, nSalt);
+        if (vTable[Find(h)] != 0)
+            return false;
+        if (nSize == nMaxSize)
+        {
+            Remove(vQueue[nQueueStart]);
+            nQueueStart = (nQueueStart + 1) % nMaxSize;
+            nSize--;
+        }
+        vTable[Find(h)] = h;
+        vQueue[(nQueueStart + nSize) % nMaxSize] = h;
+        nSize++;
+        return true;
+    }
+};
+
+/** Time associated with inventory items, in a fixed size hash table of
+ *  4-way buckets. When a bucket is full the entry with the lowest time is
+ *  replaced, so an item may be forgotten (get() returns 0 for it) but
+ *  never gets the time of another item. */
+class CInvTimeMap
+{
+private:
+    struct CEntry
+    {
+        uint64 nFingerprint;
+        int64 nTime;
+    };
+    enum { BUCKET_SIZE = 4 };
+
+    std::vector<CEntry> vEntries;
+    uint64 nSalt;
+
+    CEntry* Lookup(uint64 h, bool fCreate)
+    {
+        unsigned int nBuckets = vEntries.size() / BUCKET_SIZE;
+        CEntry* pbucket = &vEntries[(h & (nBuckets - 1)) * BUCKET_SIZE];
+        CEntry* pfree = NULL;
+        for (int i = 0; i < BUCKET_SIZE; i++)
+        {
+            if (pbucket[i].nFingerprint == h)
+                return &pbucket[i];
+            // Prefer an empty entry, then the oldest one
+            if (pbucket[i].nFingerprint == 0)
+            {
+                if (!pfree || pfree->nFingerprint != 0)
+                    pfree = &pbucket[i];
+            }
+            else if (!pfree || (pfree->nFingerprint != 0 && pbucket[i].nTime < pfree->nTime))
+                pfree = &pbucket[i];
+        }
+        if (!fCreate)
+            return NULL;
+        pfree->nFingerprint = h;
+        pfree->nTime = 0;
+        return pfree;
+    }
+
+public:
+    // nSizeLog2 is the log2 of the number of entries
+    CInvTimeMap(unsigned int nSizeLog2 = 16)
+    {
+        CEntry empty = { 0, 0 };
+        vEntries.assign(std::max(1U << nSizeLog2, (unsigned int)BUCKET_SIZE), empty);
+        nSalt = GetRand(~(uint64)0);
+    }
+
+    int64 get(const CInv& inv)
+    {
+        CEntry* pentry = Lookup(GetInvFingerprint(inv, nSalt), false);
+        return pentry ? pentry->nTime : 0;
+    }
+
+    void set(const CInv& inv, int64 nTime)
+    {
+        Lookup(GetInvFingerprint(inv, nSalt), true)->nTime = nTime;
+    }
+
+    void erase(const CInv& inv)
+    {
+        CEntry* pentry = Lookup(GetInvFingerprint(inv, nSalt), false);
+        if (pentry)
+            pentry->nFingerprint = 0;
+    }
+};
+
+#endif
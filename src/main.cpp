@@ -40,10 +40,14 @@ uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
 
+static CCriticalSection cs_chainTip;
+static CChainTipRef pChainTip(new CChainTip());
+
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+static unsigned int nOrphanBlocksSize = 0; // serialized size of mapOrphanBlocks
 
 map<uint256, CDataStream*> mapOrphanTransactions;
 map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
@@ -159,6 +163,53 @@ void static ResendWalletTransactions()
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Recent transactions
+//
+
+// Transactions we know without asking the database: in recent blocks,
+// orphans, and recently rejected ones. Lets SendMessages decide what to
+// request without cs_main or a CTxDB.
+static CCriticalSection cs_recentTx;
+static CInvFilter filterRecentTx(50000);
+static CInvFilter filterRecentRejects(20000);
+static uint256 hashRecentRejectsChainTip;
+
+static void AddRecentTx(const uint256& hash)
+{
+    LOCK(cs_recentTx);
+    filterRecentTx.insert(CInv(MSG_TX, hash));
+}
+
+static void AddRecentReject(const uint256& hash)
+{
+    LOCK(cs_recentTx);
+    filterRecentRejects.insert(CInv(MSG_TX, hash));
+}
+
+static bool AlreadyHaveTx(const uint256& hash)
+{
+    if (mempool.exists(hash))
+        return true;
+
+    CInv inv(MSG_TX, hash);
+    uint256 hashChainTip = GetChainTip()->hashBlock;
+    LOCK(cs_recentTx);
+    // A new block can make a rejected transaction valid, e.g. after a reorg
+    if (hashChainTip != hashRecentRejectsChainTip)
+    {
+        filterRecentRejects.clear();
+        hashRecentRejectsChainTip = hashChainTip;
+    }
+    return filterRecentTx.count(inv) || filterRecentRejects.count(inv);
+}
+
+
+
+
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -584,8 +635,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
                 // At default rate it would take over a month to fill 1GB
                 if (dFreeCount > GetArg("-limitfreerelay", 15)*10*1000 && !IsFromMe(tx))
                     return error("CTxMemPool::accept() : free transaction rejected by rate limiter");
-                if (fDebug)
-                    printf("Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
+                LogPrint(LOG_MEMPOOL, "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
                 dFreeCount += nSize;
             }
         }
@@ -630,6 +680,8 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
+        if (!mapTx.count(hash))
+            mapTxByShortId.insert(make_pair(hash.Get64(), hash));
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
@@ -650,6 +702,16 @@ bool CTxMemPool::remove(CTransaction &tx)
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
+            typedef multimap<uint64, uint256>::iterator ShortIdIter;
+            pair<ShortIdIter, ShortIdIter> range = mapTxByShortId.equal_range(hash.Get64());
+            for (ShortIdIter it = range.first; it != range.second; ++it)
+            {
+                if ((*it).second == hash)
+                {
+                    mapTxByShortId.erase(it);
+                    break;
+                }
+            }
             nTransactionsUpdated++;
         }
     }
@@ -819,6 +881,202 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
     return true;
 }
 
+// Recently served blocks, kept in network serialized form so that blocks
+// requested by several peers (or by RPC) are read from disk only once and
+// never deserialized just to be serialized again.
+
+class CBlockCache
+{
+private:
+    typedef std::list<uint256> list_type;
+    typedef std::pair<CSerializedBlockRef, list_type::iterator> entry_type;
+    std::map<uint256, entry_type> mapBlocks;
+    list_type listLRU; // most recently used at the front
+    uint64 nBytes;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvictions;
+    CCriticalSection cs_blockcache;
+
+    static uint64 GetMaxBytes()
+    {
+        return std::max((int64)0, GetArg("-blockcachesize", 16)) * 1024 * 1024;
+    }
+
+public:
+    CBlockCache() : nBytes(0), nHits(0), nMisses(0), nEvictions(0) { }
+
+    CSerializedBlockRef Get(const uint256& hash)
+    {
+        LOCK(cs_blockcache);
+        std::map<uint256, entry_type>::iterator mi = mapBlocks.find(hash);
+        if (mi == mapBlocks.end())
+        {
+            nMisses++;
+            return CSerializedBlockRef();
+        }
+        nHits++;
+        listLRU.splice(listLRU.begin(), listLRU, (*mi).second.second);
+        return (*mi).second.first;
+    }
+
+    void Add(const uint256& hash, const CSerializedBlockRef& pblock)
+    {
+        uint64 nMaxBytes = GetMaxBytes();
+        if (pblock->vch.size() > nMaxBytes)
+            return;
+
+        LOCK(cs_blockcache);
+        if (mapBlocks.count(hash))
+            return; // another thread got here first
+        while (nBytes + pblock->vch.size() > nMaxBytes)
+        {
+            std::map<uint256, entry_type>::iterator mi = mapBlocks.find(listLRU.back());
+            nBytes -= (*mi).second.first->vch.size();
+            mapBlocks.erase(mi);
+            listLRU.pop_back();
+            nEvictions++;
+        }
+        listLRU.push_front(hash);
+        mapBlocks.insert(make_pair(hash, entry_type(pblock, listLRU.begin())));
+        nBytes += pblock->vch.size();
+    }
+
+    void GetStats(CBlockCacheStats& stats)
+    {
+        LOCK(cs_blockcache);
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+        stats.nEvictions = nEvictions;
+        stats.nSize = mapBlocks.size();
+        stats.nBytes = nBytes;
+        stats.nMaxBytes = GetMaxBytes();
+    }
+};
+
+static CBlockCache blockCache;
+
+static CSerializedBlockRef SerializeBlock(const CBlock& block)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    ss << block;
+    return CSerializedBlockRef(new CSerializedBlock(ss));
+}
+
+CSerializedBlockRef GetSerializedBlock(const CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    CSerializedBlockRef pblock = blockCache.Get(hash);
+    if (pblock)
+        return pblock;
+
+    // Blocks are stored on disk exactly as they are sent on the network,
+    // preceded by the message start and their size
+    unsigned int nSize = 0;
+    if (pindex->nBlockPos < sizeof(nSize))
+        return CSerializedBlockRef();
+    CAutoFile filein = CAutoFile(OpenBlockFile(pindex->nFile, pindex->nBlockPos - sizeof(nSize), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+    {
+        error("GetSerializedBlock() : OpenBlockFile failed");
+        return CSerializedBlockRef();
+    }
+    CSerializedBlock* p = new CSerializedBlock();
+    pblock.reset(p);
+    std::vector<char>& vch = p->vch;
+    try {
+        filein >> nSize;
+        if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+        {
+            error("GetSerializedBlock() : bad block size %u", nSize);
+            return CSerializedBlockRef();
+        }
+        vch.resize(nSize);
+        filein.read(&vch[0], nSize);
+    }
+    catch (std::exception &e) {
+        error("%s() : I/O error", __PRETTY_FUNCTION__);
+        return CSerializedBlockRef();
+    }
+
+    // The header is the first 80 bytes, make sure we read the right thing
+    if (Hash(vch.begin(), vch.begin() + 80) != hash)
+    {
+        error("GetSerializedBlock() : hash doesn't match index");
+        return CSerializedBlockRef();
+    }
+
+    p->SetChecksum();
+
+    blockCache.Add(hash, pblock);
+    return pblock;
+}
+
+void GetBlockCacheStats(CBlockCacheStats& stats)
+{
+    blockCache.GetStats(stats);
+}
+
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header.nVersion       = block.nVersion;
+    header.hashPrevBlock  = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime          = block.nTime;
+    header.nBits          = block.nBits;
+    header.nNonce         = block.nNonce;
+    nShortIdSalt = GetRand(~(uint64)0);
+    txCoinBase = block.vtx[0];
+
+    uint64 nKey = GetShortIdKey();
+    vShortTxIds.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIds.push_back(GetShortTxId(nKey, block.vtx[i].GetHash()));
+}
+
+void CCompactBlock::FillBlock(CTxMemPool& pool, CBlock& block, std::vector<unsigned int>& vMissing) const
+{
+    block = header;
+    block.vtx.clear();
+    block.vtx.resize(vShortTxIds.size() + 1);
+    block.vtx[0] = txCoinBase;
+
+    // A short id used more than once in the block is ambiguous
+    set<uint64> setSeen, setDuplicate;
+    for (unsigned int i = 0; i < vShortTxIds.size(); i++)
+        if (!setSeen.insert(vShortTxIds[i]).second)
+            setDuplicate.insert(vShortTxIds[i]);
+
+    // Look each transaction up in the pool's index, so the work depends on
+    // the size of the block and not of the pool
+    vector<int> vMatches(block.vtx.size(), 0);
+    uint64 nKey = GetShortIdKey();
+    {
+        LOCK(pool.cs);
+        for (unsigned int i = 0; i < vShortTxIds.size(); i++)
+        {
+            if (setDuplicate.count(vShortTxIds[i]))
+                continue;
+            typedef multimap<uint64, uint256>::iterator ShortIdIter;
+            pair<ShortIdIter, ShortIdIter> range = pool.mapTxByShortId.equal_range(vShortTxIds[i] ^ nKey);
+            for (ShortIdIter it = range.first; it != range.second; ++it)
+                if (vMatches[i + 1]++ == 0)
+                    block.vtx[i + 1] = pool.mapTx[(*it).second];
+        }
+    }
+
+    vMissing.clear();
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        if (vMatches[i] != 1)
+        {
+            block.vtx[i] = CTransaction();
+            vMissing.push_back(i);
+        }
+    }
+}
+
 uint256 static GetOrphanRoot(const CBlock* pblock)
 {
     // Work back to the first block in the orphan chain
@@ -922,10 +1180,13 @@ unsigned int static GravityWell(const CBlockIndex* pindexLast, const CBlock *pbl
     if (bnNew > bnProofOfWorkLimit) { bnNew = bnProofOfWorkLimit; }
 	
     /// debug print
-    printf("Difficulty Retarget - Gravity Well\n");
-    printf("PastRateAdjustmentRatio = %g\n", PastRateAdjustmentRatio);
-    printf("Before: %08x  %s\n", BlockLastSolved->nBits, CBigNum().SetCompact(BlockLastSolved->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    if (LogAcceptCategory(LOG_RETARGET))
+    {
+        printf("Difficulty Retarget - Gravity Well\n");
+        printf("PastRateAdjustmentRatio = %g\n", PastRateAdjustmentRatio);
+        printf("Before: %08x  %s\n", BlockLastSolved->nBits, CBigNum().SetCompact(BlockLastSolved->nBits).getuint256().ToString().c_str());
+        printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    }
 	
 	return bnNew.GetCompact();
 }
@@ -1011,10 +1272,13 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
         bnNew = bnProofOfWorkLimit;
 
     /// debug print
-    printf("GetNextWorkRequired RETARGET\n");
-    printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nTargetTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    if (LogAcceptCategory(LOG_RETARGET))
+    {
+        printf("GetNextWorkRequired RETARGET\n");
+        printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nTargetTimespan, nActualTimespan);
+        printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
+        printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    }
 
     return bnNew.GetCompact();
 }
@@ -1041,6 +1305,25 @@ int GetNumBlocksOfPeers()
     return std::max(cPeerBlockCounts.median(), Checkpoints::GetTotalBlocksEstimate());
 }
 
+void PublishChainTip()
+{
+    CChainTip* ptip = new CChainTip();
+    ptip->pindex = pindexBest;
+    ptip->hashBlock = hashBestChain;
+    ptip->nHeight = nBestHeight;
+    ptip->nTimeReceived = nTimeBestReceived;
+
+    CChainTipRef pNew(ptip);
+    LOCK(cs_chainTip);
+    pChainTip.swap(pNew);
+}
+
+CChainTipRef GetChainTip()
+{
+    LOCK(cs_chainTip);
+    return pChainTip;
+}
+
 bool IsInitialBlockDownload()
 {
     if (pindexBest == NULL || nBestHeight < Checkpoints::GetTotalBlocksEstimate())
@@ -1599,7 +1882,10 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Delete redundant memory transactions that are in the connected branch
     BOOST_FOREACH(CTransaction& tx, vDelete)
+    {
         mempool.remove(tx);
+        AddRecentTx(tx.GetHash());
+    }
 
     printf("REORGANIZE: done\n");
 
@@ -1627,7 +1913,10 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
+    {
         mempool.remove(tx);
+        AddRecentTx(tx.GetHash());
+    }
 
     return true;
 }
@@ -1712,6 +2001,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     bnBestChainWork = pindexNew->bnChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    PublishChainTip();
     printf("SetBestChain: new best=%s  height=%d  work=%s  date=%s\n",
       hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -1909,10 +2199,35 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers are about to ask for it
+        bool fCompact = !IsInitialBlockDownload();
+        if (fCompact)
+            blockCache.Add(hash, SerializeBlock(*this));
+        CCompactBlock cmpctblock;
+        if (fCompact)
+            cmpctblock = CCompactBlock(*this);
+
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
+        {
             if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+            {
+                CInv inv(MSG_BLOCK, hash);
+                if (fCompact && pnode->nVersion >= COMPACT_BLOCKS_VERSION)
+                {
+                    // Send the compact block right away instead of an inv
+                    {
+                        LOCK(pnode->cs_inventory);
+                        if (pnode->filterInventoryKnown.count(inv))
+                            continue;
+                    }
+                    pnode->AddInventoryKnown(inv);
+                    pnode->PushMessage("cmpctblock", cmpctblock);
+                }
+                else
+                    pnode->PushInventory(inv);
+            }
+        }
     }
 
     // check pending sync-checkpoint
@@ -1921,10 +2236,313 @@ bool CBlock::AcceptBlock()
     return true;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first synchronization
+//
+// While far behind, the header chain is downloaded first with "getheaders"
+// from one peer and validated on its own (proof of work, difficulty and
+// checkpoints). Block bodies are then requested from all peers in parallel,
+// in a window that moves along the best header chain, and connected in order
+// as they arrive.
+//
+
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const unsigned int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 60;
+static const int64 HEADERS_DOWNLOAD_TIMEOUT = 2 * 60;
+
+// Index entries for headers whose blocks we don't have yet
+static map<uint256, CBlockIndex*> mapHeaderIndex;
+static CBlockIndex* pindexBestHeader = NULL;
+static vector<CBlockIndex*> vBestHeaderChain; // best header chain by height
+
+// Blocks of the header chain that have been requested, and from whom. The
+// peers' own mapBlocksInFlight hold the request times. The lock also covers
+// those, as peers are disconnected from the socket thread without cs_main.
+static CCriticalSection cs_mapBlocksInFlight;
+static map<uint256, CNode*> mapBlocksInFlight;
+// Heights of the header chain below this are stored, orphaned or in flight,
+// so the search for blocks to request starts here. Back to 0 whenever a
+// request or an orphan is dropped.
+static int nBlockDownloadCursor = 0;
+static int64 nHeadersRequestTime = 0;
+static CService addrHeadersRequested; // peer of the last getheaders
+
+static CBlockIndex* LookupHeader(const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        return (*mi).second;
+    return NULL;
+}
+
+static bool IsHeadersSyncActive()
+{
+    return pindexBestHeader && pindexBestHeader->bnChainWork > bnBestChainWork;
+}
+
+void SetBestHeader(CBlockIndex* pindexNew)
+{
+    {
+        LOCK(cs_mapBlocksInFlight);
+        nBlockDownloadCursor = 0;
+    }
+    pindexBestHeader = pindexNew;
+    vBestHeaderChain.resize(pindexNew->nHeight + 1);
+    for (CBlockIndex* pindex = pindexNew; pindex && vBestHeaderChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBestHeaderChain[pindex->nHeight] = pindex;
+}
+
+// Once the blocks have caught up with the headers the header-only
+// entries are not needed anymore
+void PruneHeaderIndex()
+{
+    if (!pindexBestHeader || IsHeadersSyncActive())
+        return;
+    printf("PruneHeaderIndex() : header sync finished at height %d, freeing %d headers\n",
+           pindexBestHeader->nHeight, (int)mapHeaderIndex.size());
+    for (map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); ++mi)
+        delete (*mi).second;
+    mapHeaderIndex.clear();
+    vBestHeaderChain.clear();
+    pindexBestHeader = NULL;
+}
+
+CBlockIndex* AcceptBlockHeader(CBlock& header, int& nDoS)
+{
+    nDoS = 0;
+    uint256 hash = header.GetHash();
+    CBlockIndex* pindex = LookupHeader(hash);
+    if (pindex)
+        return pindex;
+
+    CBlockIndex* pindexPrev = LookupHeader(header.hashPrevBlock);
+    if (!pindexPrev)
+    {
+        nDoS = 10;
+        error("AcceptBlockHeader() : prev block not found");
+        return NULL;
+    }
+    int nHeight = pindexPrev->nHeight+1;
+
+    if (!CheckProofOfWork(header.GetPoWHash(), header.nBits))
+    {
+        nDoS = 50;
+        error("AcceptBlockHeader() : proof of work failed");
+        return NULL;
+    }
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+    {
+        nDoS = 100;
+        error("AcceptBlockHeader() : incorrect proof of work");
+        return NULL;
+    }
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+    {
+        error("AcceptBlockHeader() : block's timestamp is too early");
+        return NULL;
+    }
+    if (header.GetBlockTime() > GetAdjustedTime() + 20 * 60)
+    {
+        error("AcceptBlockHeader() : block timestamp too far in the future");
+        return NULL;
+    }
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+    {
+        nDoS = 100;
+        error("AcceptBlockHeader() : rejected by checkpoint lockin at %d", nHeight);
+        return NULL;
+    }
+
+    // Don't accept forks below the last checkpoint we already have
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    if (pcheckpoint && nHeight <= pcheckpoint->nHeight)
+    {
+        nDoS = 100;
+        error("AcceptBlockHeader() : forks before checkpoint at %d", pcheckpoint->nHeight);
+        return NULL;
+    }
+
+    CBlockIndex* pindexNew = new CBlockIndex(0, 0, header);
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->bnChainWork = pindexPrev->bnChainWork + pindexNew->GetBlockWork();
+
+    CBlockIndex* pindexBestKnown = pindexBestHeader ? pindexBestHeader : pindexBest;
+    if (pindexNew->bnChainWork > pindexBestKnown->bnChainWork)
+        SetBestHeader(pindexNew);
+
+    return pindexNew;
+}
+
+static void RequestHeaders(CNode* pnode)
+{
+    const CBlockIndex* pindexStart = pindexBestHeader ? pindexBestHeader : pindexBest;
+    printf("requesting headers from %d, peer=%s\n", pindexStart->nHeight, pnode->addr.ToString().c_str());
+    pnode->PushMessage("getheaders", CBlockLocator(pindexStart), uint256(0));
+    nHeadersRequestTime = GetTime();
+    addrHeadersRequested = pnode->addr;
+}
+
+// Headers are wanted until the best one we know of is recent
+static bool NeedHeaders()
+{
+    if (!GetBoolArg("-headersfirst", true) || pindexBest == NULL)
+        return false;
+    const CBlockIndex* pindexStart = pindexBestHeader ? pindexBestHeader : pindexBest;
+    return pindexStart->GetBlockTime() < GetTime() - 24 * 60 * 60;
+}
+
+// Choose blocks of the best header chain to fetch from pto
+void FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    LOCK(cs_mapBlocksInFlight);
+
+    // A peer being disconnected has handed back its requests already
+    if (pto->fDisconnect)
+        return;
+
+    int64 nNow = GetTime();
+    for (map<uint256, int64>::iterator mi = pto->mapBlocksInFlight.begin(); mi != pto->mapBlocksInFlight.end(); )
+    {
+        if (nNow - (*mi).second > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            printf("block download timeout: %s peer=%s\n", (*mi).first.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+            mapBlocksInFlight.erase((*mi).first);
+            pto->mapBlocksInFlight.erase(mi++);
+            nBlockDownloadCursor = 0;
+        }
+        else
+            mi++;
+    }
+    if (pto->fClient || pto->mapBlocksInFlight.size() >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+        return;
+
+    // Start right after the last block we have in common with the header chain
+    const CBlockIndex* pindexFork = pindexBest;
+    while (pindexFork && (pindexFork->nHeight >= (int)vBestHeaderChain.size() ||
+                          vBestHeaderChain[pindexFork->nHeight]->GetBlockHash() != pindexFork->GetBlockHash()))
+        pindexFork = pindexFork->pprev;
+    if (!pindexFork)
+        return;
+    int nWindowEnd = min(pindexBestHeader->nHeight, pindexFork->nHeight + BLOCK_DOWNLOAD_WINDOW);
+    if (pto->nStartingHeight != -1)
+        nWindowEnd = min(nWindowEnd, pto->nStartingHeight);
+
+    int nHeight = max(pindexFork->nHeight + 1, nBlockDownloadCursor);
+    for (; nHeight <= nWindowEnd; nHeight++)
+    {
+        uint256 hash = vBestHeaderChain[nHeight]->GetBlockHash();
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapBlocksInFlight.count(hash))
+            continue;
+        // Only the block that connects next while the orphans fill their quota
+        if (nHeight > pindexFork->nHeight + 1 && nOrphanBlocksSize >= MAX_ORPHAN_BLOCKS_SIZE)
+            break;
+        LogPrint(LOG_NET, "requesting block %d %s peer=%s\n", nHeight, hash.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        pto->mapBlocksInFlight[hash] = nNow;
+        mapBlocksInFlight[hash] = pto;
+        if (pto->mapBlocksInFlight.size() >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+        {
+            nHeight++;
+            break;
+        }
+    }
+    nBlockDownloadCursor = nHeight;
+}
+
+// A block arrived, from whichever peer it was requested
+void MarkBlockReceived(const uint256& hash)
+{
+    LOCK(cs_mapBlocksInFlight);
+    map<uint256, CNode*>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    (*mi).second->mapBlocksInFlight.erase(hash);
+    mapBlocksInFlight.erase(mi);
+}
+
+// The blocks a disconnected peer was asked for go to other peers
+void BlockDownloadDisconnected(CNode* pnode)
+{
+    LOCK(cs_mapBlocksInFlight);
+    if (pnode->mapBlocksInFlight.empty())
+        return;
+    for (map<uint256, int64>::iterator mi = pnode->mapBlocksInFlight.begin(); mi != pnode->mapBlocksInFlight.end(); ++mi)
+        mapBlocksInFlight.erase((*mi).first);
+    pnode->mapBlocksInFlight.clear();
+    nBlockDownloadCursor = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// mapOrphanBlocks
+//
+
+CBlock* AddOrphanBlock(const CBlock& block)
+{
+    CBlock* pblock = new CBlock(block);
+    mapOrphanBlocks.insert(make_pair(pblock->GetHash(), pblock));
+    mapOrphanBlocksByPrev.insert(make_pair(pblock->hashPrevBlock, pblock));
+    nOrphanBlocksSize += ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+    return pblock;
+}
+
+void static EraseOrphanBlock(CBlock* pblock)
+{
+    for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(pblock->hashPrevBlock);
+         mi != mapOrphanBlocksByPrev.upper_bound(pblock->hashPrevBlock);
+         ++mi)
+    {
+        if ((*mi).second == pblock)
+        {
+            mapOrphanBlocksByPrev.erase(mi);
+            break;
+        }
+    }
+    mapOrphanBlocks.erase(pblock->GetHash());
+    nOrphanBlocksSize -= ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+    delete pblock;
+}
+
+unsigned int LimitOrphanBlockSize(unsigned int nMaxSize)
+{
+    unsigned int nEvicted = 0;
+    while (nOrphanBlocksSize > nMaxSize && !mapOrphanBlocks.empty())
+    {
+        // Evict a random orphan, or rather the end of its chain of orphans
+        // so that the rest still connects:
+        map<uint256, CBlock*>::iterator it = mapOrphanBlocks.lower_bound(GetRandHash());
+        if (it == mapOrphanBlocks.end())
+            it = mapOrphanBlocks.begin();
+        CBlock* pblock = (*it).second;
+        multimap<uint256, CBlock*>::iterator mi;
+        while ((mi = mapOrphanBlocksByPrev.find(pblock->GetHash())) != mapOrphanBlocksByPrev.end())
+            pblock = (*mi).second;
+        EraseOrphanBlock(pblock);
+        ++nEvicted;
+    }
+    if (nEvicted > 0)
+    {
+        // They may have been fetched along the header chain
+        LOCK(cs_mapBlocksInFlight);
+        nBlockDownloadCursor = 0;
+    }
+    return nEvicted;
+}
+
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
+    MarkBlockReceived(hash);
     if (mapBlockIndex.count(hash))
         return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,20).c_str());
     if (mapOrphanBlocks.count(hash))
@@ -1965,13 +2583,16 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!mapBlockIndex.count(pblock->hashPrevBlock))
     {
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
-        CBlock* pblock2 = new CBlock(*pblock);
-        mapOrphanBlocks.insert(make_pair(hash, pblock2));
-        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+        CBlock* pblock2 = AddOrphanBlock(*pblock);
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless we are already
+        // fetching it along the header chain
+        if (pfrom && !mapHeaderIndex.count(hash))
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+
+        unsigned int nEvicted = LimitOrphanBlockSize(MAX_ORPHAN_BLOCKS_SIZE);
+        if (nEvicted > 0)
+            printf("mapOrphanBlocks overflow, removed %u blocks\n", nEvicted);
         return true;
     }
 
@@ -1993,6 +2614,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             if (pblockOrphan->AcceptBlock())
                 vWorkQueue.push_back(pblockOrphan->GetHash());
             mapOrphanBlocks.erase(pblockOrphan->GetHash());
+            nOrphanBlocksSize -= ::GetSerializeSize(*pblockOrphan, SER_NETWORK, PROTOCOL_VERSION);
             delete pblockOrphan;
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
@@ -2502,12 +3124,79 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 unsigned char pchMessageStart[4] = { 0xfd, 0xa4, 0xdc, 0x6c }; 
 
 
+// Compact blocks waiting for the transactions we didn't have in the memory pool
+class CPartialBlock
+{
+public:
+    CBlock block;
+    std::vector<unsigned int> vMissing;
+    int64 nTimeReceived;
+    CService addrFrom;                  // peer asked with getblocktxn
+    std::set<CService> setAnnouncers;   // other peers that sent the compact block
+};
+
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+static const int64 PARTIAL_BLOCK_TIMEOUT = 60;
+static map<uint256, CPartialBlock> mapPartialBlocks;
+
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+// Called from SendMessages for every peer. A partial block whose missing
+// transactions didn't come in time is fetched whole from another peer that
+// announced it, or dropped after twice the time if there is none, so that
+// the next announcement starts over.
+static void ExpirePartialBlocks(CNode* pto, vector<CInv>& vGetData)
+{
+    int64 nNow = GetTime();
+    for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); )
+    {
+        CPartialBlock& partial = (*mi).second;
+        int64 nAge = nNow - partial.nTimeReceived;
+        if (nAge > PARTIAL_BLOCK_TIMEOUT && partial.setAnnouncers.count(pto->addr))
+        {
+            LogPrint(LOG_NET, "compact block %s timed out, fetching it from %s\n", (*mi).first.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+            vGetData.push_back(CInv(MSG_BLOCK, (*mi).first));
+            mapPartialBlocks.erase(mi++);
+        }
+        else if (nAge > 2 * PARTIAL_BLOCK_TIMEOUT)
+            mapPartialBlocks.erase(mi++);
+        else
+            mi++;
+    }
+}
+
+// Hand a rebuilt compact block to ProcessBlock
+static void ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hash = block.GetHash();
+
+    // A short id collision gives a block with the wrong transactions,
+    // which is not the peer's fault
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s did not rebuild, requesting full block\n", hash.ToString().substr(0,20).c_str());
+        RequestFullBlock(pfrom, hash);
+        return;
+    }
+
+    printf("received compact block %s\n", hash.ToString().substr(0,20).c_str());
+    if (ProcessBlock(pfrom, &block))
+    {
+        LOCK(cs_mapAlreadyAskedFor);
+        mapAlreadyAskedFor.erase(CInv(MSG_BLOCK, hash));
+    }
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     static map<CService, CPubKey> mapReuseKey;
     RandAddSeedPerfmon();
-    if (fDebug)
-        printf("received: %s (%d bytes)\n", strCommand.c_str(), vRecv.size());
+    LogPrint(LOG_NET, "received: %s (%d bytes)\n", strCommand.c_str(), vRecv.size());
     if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
     {
         printf("dropmessagestest DROPPING RECV MESSAGE\n");
@@ -2609,7 +3298,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
              (nAskedForBlocks < 1 || vNodes.size() <= 1))
         {
             nAskedForBlocks++;
-            pfrom->PushGetBlocks(pindexBest, uint256(0));
+            // With headers-first the first headers request goes out from SendMessages
+            if (!NeedHeaders())
+                pfrom->PushGetBlocks(pindexBest, uint256(0));
         }
 
         // Relay alerts
@@ -2631,6 +3322,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("receive version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", pfrom->nVersion, pfrom->nStartingHeight, addrMe.ToString().c_str(), addrFrom.ToString().c_str(), pfrom->addr.ToString().c_str());
 
         cPeerBlockCounts.input(pfrom->nStartingHeight);
+        uiInterface.NotifyBlocksChanged(); // the estimate of the chain height may have moved
 
         // ask for pending sync-checkpoint if any
         if (!IsInitialBlockDownload())
@@ -2747,12 +3439,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(txdb, inv);
-            if (fDebug)
-                printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
+            LogPrint(LOG_NET, "  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave)
                 pfrom->AskFor(inv);
-            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+            else if (IsHeadersSyncActive()) {
+                // Missing blocks are fetched along the header chain
+            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
@@ -2760,8 +3453,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 // this situation and push another getblocks to continue.
                 std::vector<CInv> vGetData(1,inv);
                 pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
-                if (fDebug)
-                    printf("force request: %s\n", inv.ToString().c_str());
+                LogPrint(LOG_NET, "force request: %s\n", inv.ToString().c_str());
             }
 
             // Track requests for our stuff
@@ -2796,9 +3488,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    CSerializedBlockRef pblock = GetSerializedBlock((*mi).second);
+                    if (pblock)
+                        pfrom->PushMessageRaw("block", pblock);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2816,12 +3508,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             else if (inv.IsKnownType())
             {
                 // Send stream from relay memory
+                CMessagePayloadRef payload;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CMessagePayloadRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end())
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        payload = (*mi).second;
                 }
+                if (payload)
+                    pfrom->PushMessageRaw(inv.GetCommand(), payload);
             }
 
             // Track requests for our stuff
@@ -2843,12 +3538,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (pindex)
             pindex = pindex->pnext;
         int nLimit = 500;
-        printf("getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str(), nLimit);
+        LogPrint(LOG_NET, "getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str(), nLimit);
         for (; pindex; pindex = pindex->pnext)
         {
             if (pindex->GetBlockHash() == hashStop)
             {
-                printf("  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str());
+                LogPrint(LOG_NET, "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str());
                 break;
             }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
@@ -2856,7 +3551,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             {
                 // When this block is requested, we'll send an inv that'll make them
                 // getblocks the next batch of inventory.
-                printf("  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str());
+                LogPrint(LOG_NET, "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str());
                 pfrom->hashContinue = pindex->GetBlockHash();
                 break;
             }
@@ -2900,6 +3595,39 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %d", vHeaders.size());
+        }
+
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(CBlock& header, vHeaders)
+        {
+            int nDoS = 0;
+            pindexLast = AcceptBlockHeader(header, nDoS);
+            if (!pindexLast)
+            {
+                if (nDoS > 0)
+                    pfrom->Misbehaving(nDoS);
+                return error("message headers : invalid header %s", header.GetHash().ToString().substr(0,20).c_str());
+            }
+        }
+        printf("received %d headers, best header height=%d\n", (int)vHeaders.size(), pindexBestHeader ? pindexBestHeader->nHeight : nBestHeight);
+
+        // A full batch from the peer we asked means it has more. Anything
+        // else leaves the request to time out, so peers without newer
+        // headers aren't asked again and again.
+        if (vHeaders.size() == MAX_HEADERS_RESULTS && pindexLast == pindexBestHeader &&
+            (CService)pfrom->addr == addrHeadersRequested)
+            RequestHeaders(pfrom);
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -2917,7 +3645,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         {
             SyncWithWallets(tx, NULL, true);
             RelayMessage(inv, vMsg);
-            mapAlreadyAskedFor.erase(inv);
+            {
+                LOCK(cs_mapAlreadyAskedFor);
+                mapAlreadyAskedFor.erase(inv);
+            }
             vWorkQueue.push_back(inv.hash);
             vEraseQueue.push_back(inv.hash);
 
@@ -2940,13 +3671,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                         printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
                         SyncWithWallets(tx, NULL, true);
                         RelayMessage(inv, vMsg);
-                        mapAlreadyAskedFor.erase(inv);
+                        {
+                            LOCK(cs_mapAlreadyAskedFor);
+                            mapAlreadyAskedFor.erase(inv);
+                        }
                         vWorkQueue.push_back(inv.hash);
                         vEraseQueue.push_back(inv.hash);
                     }
                     else if (!fMissingInputs2)
                     {
                         // invalid orphan
+                        AddRecentReject(inv.hash);
                         vEraseQueue.push_back(inv.hash);
                         printf("   removed invalid orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
                     }
@@ -2959,12 +3694,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         else if (fMissingInputs)
         {
             AddOrphanTx(vMsg);
+            AddRecentTx(inv.hash);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
             if (nEvicted > 0)
                 printf("mapOrphan overflow, removed %u tx\n", nEvicted);
         }
+        else
+            AddRecentReject(inv.hash);
         if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
     }
 
@@ -2981,11 +3719,126 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->AddInventoryKnown(inv);
 
         if (ProcessBlock(pfrom, &block))
+        {
+            LOCK(cs_mapAlreadyAskedFor);
             mapAlreadyAskedFor.erase(inv);
+        }
         if (block.nDoS) pfrom->Misbehaving(block.nDoS);
     }
 
 
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hash);
+        pfrom->AddInventoryKnown(inv);
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            return true;
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(hash);
+        if (mi != mapPartialBlocks.end())
+        {
+            // Remember who else has it, in case the first one never answers
+            if ((CService)pfrom->addr != (*mi).second.addrFrom)
+                (*mi).second.setAnnouncers.insert(pfrom->addr);
+            return true;
+        }
+
+        if (!CheckProofOfWork(cmpctblock.header.GetPoWHash(), cmpctblock.header.nBits))
+        {
+            pfrom->Misbehaving(50);
+            return error("message cmpctblock : proof of work failed");
+        }
+
+        // Without the previous block there is nothing to gain, get it the usual way
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+        {
+            pfrom->AskFor(inv);
+            return true;
+        }
+
+        CPartialBlock partial;
+        cmpctblock.FillBlock(mempool, partial.block, partial.vMissing);
+        if (partial.vMissing.empty())
+        {
+            ProcessCompactBlock(pfrom, partial.block);
+            return true;
+        }
+
+        if (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+        {
+            RequestFullBlock(pfrom, hash);
+            return true;
+        }
+
+        LogPrint(LOG_NET, "compact block %s missing %d of %d transactions\n", hash.ToString().substr(0,20).c_str(),
+                 (int)partial.vMissing.size(), (int)partial.block.vtx.size());
+        partial.nTimeReceived = GetTime();
+        partial.addrFrom = pfrom->addr;
+        pfrom->PushMessage("getblocktxn", hash, partial.vMissing);
+        mapPartialBlocks[hash] = partial;
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        uint256 hash;
+        vector<unsigned int> vIndexes;
+        vRecv >> hash >> vIndexes;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            return true;
+        CSerializedBlockRef pblock = GetSerializedBlock((*mi).second);
+        if (!pblock)
+            return true;
+        CBlock block;
+        CDataStream ssBlock(pblock->vch, SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock >> block;
+
+        vector<CTransaction> vtx;
+        vtx.reserve(vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("message getblocktxn : index %u out of range", nIndex);
+            }
+            vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", hash, vtx);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        uint256 hash;
+        vector<CTransaction> vtx;
+        vRecv >> hash >> vtx;
+
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(hash);
+        if (mi == mapPartialBlocks.end())
+            return true;
+        CPartialBlock& partial = (*mi).second;
+        if (vtx.size() != partial.vMissing.size())
+        {
+            mapPartialBlocks.erase(mi);
+            RequestFullBlock(pfrom, hash);
+            return error("message blocktxn : got %d transactions, expected %d", vtx.size(), partial.vMissing.size());
+        }
+
+        CBlock block = partial.block;
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            block.vtx[partial.vMissing[i]] = vtx[i];
+        mapPartialBlocks.erase(mi);
+
+        ProcessCompactBlock(pfrom, block);
+    }
+
+
     else if (strCommand == "getaddr")
     {
         pfrom->vAddrToSend.clear();
@@ -3131,7 +3984,7 @@ bool ProcessMessages(CNode* pfrom)
     loop
     {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize())
+        if (pfrom->nSendSize >= SendBufferSize())
             break;
 
         // Scan for message start
@@ -3235,22 +4088,26 @@ bool ProcessMessages(CNode* pfrom)
 
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
+    // Don't send anything until we get their version message
+    if (pto->nVersion == 0)
+        return true;
+
+    // Only the parts that need the block chain or the wallets wait for
+    // cs_main, everything else is per peer and goes out regardless
     TRY_LOCK(cs_main, lockMain);
-    if (lockMain) {
-        // Don't send anything until we get their version message
-        if (pto->nVersion == 0)
-            return true;
 
-        // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
-        // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty()) {
-            uint64 nonce = 0;
-            if (pto->nVersion > BIP0031_VERSION)
-                pto->PushMessage("ping", nonce);
-            else
-                pto->PushMessage("ping");
-        }
+    // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
+    // right now.
+    if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
+        uint64 nonce = 0;
+        if (pto->nVersion > BIP0031_VERSION)
+            pto->PushMessage("ping", nonce);
+        else
+            pto->PushMessage("ping");
+    }
 
+    if (lockMain)
+    {
         // Resend wallet transactions that haven't gotten in a block yet
         ResendWalletTransactions();
 
@@ -3277,119 +4134,138 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             nLastRebroadcast = GetTime();
         }
+    }
 
-        //
-        // Message: addr
-        //
-        if (fSendTrickle)
+    //
+    // Message: addr
+    //
+    if (fSendTrickle)
+    {
+        vector<CAddress> vAddr;
+        vAddr.reserve(pto->vAddrToSend.size());
+        BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            // returns true if wasn't already contained in the set
+            if (pto->setAddrKnown.insert(addr).second)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                vAddr.push_back(addr);
+                // receiver rejects addr messages larger than 1000
+                if (vAddr.size() >= 1000)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    pto->PushMessage("addr", vAddr);
+                    vAddr.clear();
                 }
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
         }
+        pto->vAddrToSend.clear();
+        if (!vAddr.empty())
+            pto->PushMessage("addr", vAddr);
+    }
 
 
-        //
-        // Message: inventory
-        //
-        vector<CInv> vInv;
-        vector<CInv> vInvWait;
+    //
+    // Message: inventory
+    //
+    vector<CInv> vInv;
+    vector<CInv> vInvWait;
+    {
+        LOCK(pto->cs_inventory);
+        vInv.reserve(pto->vInventoryToSend.size());
+        vInvWait.reserve(pto->vInventoryToSend.size());
+        BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
         {
-            LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
-            {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
+            if (pto->filterInventoryKnown.count(inv))
+                continue;
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
+            // trickle out tx inv to protect privacy
+            if (inv.type == MSG_TX && !fSendTrickle)
+            {
+                // 1/4 of tx invs blast to all immediately
+                static uint64 nTrickleSalt;
+                if (nTrickleSalt == 0)
+                    nTrickleSalt = GetRand(~(uint64)0);
+                bool fTrickleWait = ((GetInvFingerprint(inv, nTrickleSalt) & 3) != 0);
 
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
+                // always trickle our own transactions
+                if (!fTrickleWait && IsOwnInventory(inv))
+                    fTrickleWait = true;
 
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                if (fTrickleWait)
+                {
+                    vInvWait.push_back(inv);
+                    continue;
                 }
+            }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+            // returns true if wasn't already contained in the set
+            if (pto->filterInventoryKnown.insert(inv))
+            {
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
         }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
+        pto->vInventoryToSend = vInvWait;
+    }
+    if (!vInv.empty())
+        pto->PushMessage("inv", vInv);
 
 
-        //
-        // Message: getdata
-        //
-        vector<CInv> vGetData;
-        int64 nNow = GetTime() * 1000000;
-        CTxDB txdb("r");
-        while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+    //
+    // Message: getdata
+    //
+    vector<CInv> vGetData;
+    int64 nNow = GetTime() * 1000000;
+    while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+    {
+        const CInv& inv = (*pto->mapAskFor.begin()).second;
+        bool fAlreadyHave;
+        if (inv.type == MSG_TX)
+            fAlreadyHave = AlreadyHaveTx(inv.hash);
+        else if (inv.type == MSG_BLOCK)
+        {
+            // Keep the request queued until we can look at the block index
+            if (!lockMain)
+                break;
+            fAlreadyHave = mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
+        }
+        else
+            fAlreadyHave = true;
+
+        if (!fAlreadyHave)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(txdb, inv))
+            LogPrint(LOG_NET, "sending getdata: %s\n", inv.ToString().c_str());
+            vGetData.push_back(inv);
+            if (vGetData.size() >= 1000)
             {
-                if (fDebugNet)
-                    printf("sending getdata: %s\n", inv.ToString().c_str());
-                vGetData.push_back(inv);
-                if (vGetData.size() >= 1000)
-                {
-                    pto->PushMessage("getdata", vGetData);
-                    vGetData.clear();
-                }
-                mapAlreadyAskedFor[inv] = nNow;
+                pto->PushMessage("getdata", vGetData);
+                vGetData.clear();
             }
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
+            LOCK(cs_mapAlreadyAskedFor);
+            mapAlreadyAskedFor.set(inv, nNow);
         }
-        if (!vGetData.empty())
-            pto->PushMessage("getdata", vGetData);
+        pto->mapAskFor.erase(pto->mapAskFor.begin());
+    }
+
+    if (lockMain)
+    {
+        // Headers-first synchronization
+        if (NeedHeaders() && !pto->fClient && GetTime() - nHeadersRequestTime > HEADERS_DOWNLOAD_TIMEOUT)
+            RequestHeaders(pto);
+        if (IsHeadersSyncActive())
+            FindBlocksToDownload(pto, vGetData);
+        else
+            PruneHeaderIndex();
 
+        ExpirePartialBlocks(pto, vGetData);
     }
+
+    if (!vGetData.empty())
+        pto->PushMessage("getdata", vGetData);
+
     return true;
 }
 
@@ -3662,7 +4538,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
-        printf("CreateNewBlock(): total size %lu\n", nBlockSize);
+        LogPrint(LOG_MINING, "CreateNewBlock(): total size %lu\n", nBlockSize);
 
     }
     pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
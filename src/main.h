@@ -15,9 +15,12 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
+class CTxMemPool;
 class CKeyItem;
 class CReserveKey;
 
@@ -30,6 +33,7 @@ static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+static const unsigned int MAX_ORPHAN_BLOCKS_SIZE = 32 * MAX_BLOCK_SIZE;
 static const int64 MIN_TX_FEE = 0.001 * COIN;
 static const int64 MIN_RELAY_TX_FEE = MIN_TX_FEE;
 static const int64 MAX_MONEY = 21000000 * COIN; // 
@@ -95,6 +99,7 @@ bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+void BlockDownloadDisconnected(CNode* pnode);
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 CBlock* CreateNewBlock(CReserveKey& reservekey);
@@ -108,6 +113,49 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 
+/** Immutable copy of the best chain tip state. A new one is published on every
+ *  tip change, so readers such as RPC can use it without taking cs_main.
+ *  pindex may be followed through pprev: block index entries are never freed
+ *  and their pprev, nHeight, nBits and nTime do not change once created. */
+class CChainTip
+{
+public:
+    const CBlockIndex* pindex;
+    uint256 hashBlock;
+    int nHeight;
+    int64 nTimeReceived;
+
+    CChainTip() : pindex(NULL), hashBlock(0), nHeight(-1), nTimeReceived(0) { }
+};
+
+typedef boost::shared_ptr<const CChainTip> CChainTipRef;
+
+/** Publish the current best chain tip, called with cs_main held */
+void PublishChainTip();
+/** Return the last published best chain tip, does not require cs_main */
+CChainTipRef GetChainTip();
+
+/** A block serialized as it is sent on the network */
+typedef CMessagePayload CSerializedBlock;
+typedef CMessagePayloadRef CSerializedBlockRef;
+
+/** Return the serialized block for a block index entry, from the recent
+ *  blocks cache or from disk. Returns an empty reference on failure. */
+CSerializedBlockRef GetSerializedBlock(const CBlockIndex* pindex);
+
+/** Counters of the serialized block cache */
+struct CBlockCacheStats
+{
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvictions;
+    unsigned int nSize;
+    uint64 nBytes;
+    uint64 nMaxBytes;
+};
+
+void GetBlockCacheStats(CBlockCacheStats& stats);
+
 
 
 
@@ -1041,6 +1089,66 @@ private:
 
 
 
+/** Compact announcement of a new block: the header, a short id for every
+ * transaction after the coinbase, and the coinbase itself. The receiver
+ * rebuilds the block from its memory pool and asks with "getblocktxn" only
+ * for the transactions it is missing. Sent to peers with a protocol version
+ * of at least COMPACT_BLOCKS_VERSION instead of an inv.
+ */
+class CCompactBlock
+{
+public:
+    CBlock header;
+    uint64 nShortIdSalt;
+    CTransaction txCoinBase;
+    std::vector<uint64> vShortTxIds;
+
+    CCompactBlock()
+    {
+        nShortIdSalt = 0;
+    }
+
+    CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(nShortIdSalt);
+        READWRITE(txCoinBase);
+        READWRITE(vShortTxIds);
+    )
+
+    // Short ids are the first 64 bits of the txid masked with a key from the
+    // block and a random salt, so the receiver finds them through the memory
+    // pool's index instead of hashing every transaction in it. Colliding
+    // txids only cost a getblocktxn round trip.
+    uint64 GetShortIdKey() const
+    {
+        uint256 hashBlock = header.GetHash();
+        return Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nShortIdSalt), END(nShortIdSalt)).Get64();
+    }
+
+    static uint64 GetShortTxId(uint64 nKey, const uint256& hashTx)
+    {
+        return hashTx.Get64() ^ nKey;
+    }
+
+    /** Rebuild the block from the transactions in pool. Positions of
+     *  transactions that are missing or ambiguous are returned in vMissing
+     *  and left empty in block.vtx. */
+    void FillBlock(CTxMemPool& pool, CBlock& block, std::vector<unsigned int>& vMissing) const;
+};
+
+
+
+
+
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block.  pprev and pnext link a path through the
@@ -1612,6 +1720,7 @@ public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::multimap<uint64, uint256> mapTxByShortId; // txids by their first 64 bits, for compact blocks
 
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
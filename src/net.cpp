@@ -15,6 +15,8 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -28,6 +30,7 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 16;
+static const int MAX_SEND_IOV = 64;
 
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
@@ -64,10 +67,14 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CMessagePayloadRef> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-map<CInv, int64> mapAlreadyAskedFor;
+CCriticalSection cs_mapAlreadyAskedFor;
+CInvTimeMap mapAlreadyAskedFor;
+
+static CCriticalSection cs_filterOwnInventory;
+static CInvFilter filterOwnInventory(10000);
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -77,6 +84,10 @@ CCriticalSection cs_setservAddNodeAddresses;
 
 static CSemaphore *semOutbound = NULL;
 
+// Host names of DNS seeds and added nodes are resolved in the background
+static const int RESOLVER_THREADS = 4;
+static CResolver *presolver = NULL;
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -99,6 +110,18 @@ void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
     PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+void AddOwnInventory(const CInv& inv)
+{
+    LOCK(cs_filterOwnInventory);
+    filterOwnInventory.insert(inv);
+}
+
+bool IsOwnInventory(const CInv& inv)
+{
+    LOCK(cs_filterOwnInventory);
+    return filterOwnInventory.count(inv) != 0;
+}
+
 // find 'best' local address for a particular peer
 bool GetLocal(CService& addr, const CNetAddr *paddrPeer)
 {
@@ -490,14 +513,24 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
         pszDest ? pszDest : addrConnect.ToString().c_str(),
         pszDest ? 0 : (double)(GetAdjustedTime() - addrConnect.nTime)/3600.0);
 
-    // Connect
+    // Connect. Direct connections to an address only start the connect,
+    // the socket handler finishes it.
     SOCKET hSocket;
-    if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort()) : ConnectSocket(addrConnect, hSocket))
+    CService addrProxy;
+    bool fAsync = (pszDest == NULL && !GetProxy(addrConnect.GetNetwork(), addrProxy));
+    bool fConnected;
+    if (fAsync)
+        fConnected = StartConnectSocket(addrConnect, hSocket);
+    else if (pszDest)
+        fConnected = ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort());
+    else
+        fConnected = ConnectSocket(addrConnect, hSocket);
+    if (fConnected)
     {
         addrman.Attempt(addrConnect);
 
         /// debug print
-        printf("connected %s\n", pszDest ? pszDest : addrConnect.ToString().c_str());
+        printf("%s %s\n", fAsync ? "connecting" : "connected", pszDest ? pszDest : addrConnect.ToString().c_str());
 
         // Set to nonblocking
 #ifdef WIN32
@@ -509,8 +542,17 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
             printf("ConnectSocket() : fcntl nonblocking setting failed, error %d\n", errno);
 #endif
 
+        // A blocking connect may finish after shutdown started, the node
+        // would never be cleaned up
+        if (fShutdown)
+        {
+            closesocket(hSocket);
+            return NULL;
+        }
+
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+        pnode->fConnecting = fAsync;
         if (nTimeout != 0)
             pnode->AddRef(nTimeout);
         else
@@ -544,6 +586,77 @@ void CNode::CloseSocketDisconnect()
 
 void CNode::Cleanup()
 {
+    BlockDownloadDisconnected(this);
+}
+
+// Send as much of the send queue as the socket takes, many buffers per
+// system call. Called with cs_vSend held.
+void CNode::SocketSendData()
+{
+    while (!vSendMsg.empty())
+    {
+        unsigned int nRequested = 0;
+#ifdef WIN32
+        const std::vector<char>& vch = vSendMsg.front()->vch;
+        nRequested = vch.size() - nSendOffset;
+        int nBytes = send(hSocket, &vch[nSendOffset], nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec vIov[MAX_SEND_IOV];
+        int nIov = 0;
+        unsigned int nOffset = nSendOffset;
+        for (deque<CMessagePayloadRef>::iterator it = vSendMsg.begin(); it != vSendMsg.end() && nIov < MAX_SEND_IOV; ++it)
+        {
+            const std::vector<char>& vch = (*it)->vch;
+            vIov[nIov].iov_base = (void*)&vch[nOffset];
+            vIov[nIov].iov_len = vch.size() - nOffset;
+            nRequested += vIov[nIov].iov_len;
+            nIov++;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes <= 0)
+        {
+            if (nBytes < 0)
+            {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                {
+                    printf("socket send error %d\n", nErr);
+                    CloseSocketDisconnect();
+                }
+            }
+            break;
+        }
+
+        nLastSend = GetTime();
+        nSendBytes += nBytes;
+        nSendSize -= nBytes;
+
+        // Drop the buffers that went out completely
+        unsigned int nLeft = nBytes;
+        while (nLeft > 0)
+        {
+            unsigned int nFront = vSendMsg.front()->vch.size() - nSendOffset;
+            if (nLeft < nFront)
+            {
+                nSendOffset += nLeft;
+                break;
+            }
+            nLeft -= nFront;
+            vSendMsg.pop_front();
+            nSendOffset = 0;
+        }
+
+        // Socket buffer is full, wait for select
+        if ((unsigned int)nBytes < nRequested)
+            break;
+    }
 }
 
 
@@ -626,6 +739,7 @@ void CNode::copyStats(CNodeStats &stats)
     X(nReleaseTime);
     X(nStartingHeight);
     X(nMisbehavior);
+    X(nSendBytes);
 }
 #undef X
 
@@ -679,7 +793,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->nSendSize == 0))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -764,12 +878,19 @@ void ThreadSocketHandler2(void* parg)
             {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
+                hSocketMax = max(hSocketMax, pnode->hSocket);
+                if (pnode->fConnecting)
+                {
+                    // writable once the connect finished
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    continue;
+                }
                 FD_SET(pnode->hSocket, &fdsetRecv);
                 FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
+                    if (lockSend && !pnode->vSendMsg.empty())
                         FD_SET(pnode->hSocket, &fdsetSend);
                 }
             }
@@ -868,11 +989,37 @@ void ThreadSocketHandler2(void* parg)
             if (fShutdown)
                 return;
 
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            //
+            // Finish outbound connects
+            //
+            if (pnode->fConnecting)
+            {
+                if (FD_ISSET(pnode->hSocket, &fdsetSend) || FD_ISSET(pnode->hSocket, &fdsetError))
+                {
+                    if (FinishConnectSocket(pnode->hSocket))
+                    {
+                        printf("connected %s\n", pnode->addrName.c_str());
+                        pnode->fConnecting = false;
+                        pnode->nTimeConnected = GetTime();
+                    }
+                    else
+                        pnode->CloseSocketDisconnect();
+                }
+                else if (GetTime() - pnode->nTimeConnected > max(nConnectTimeout / 1000, 1))
+                {
+                    printf("connection timeout %s\n", pnode->addrName.c_str());
+                    pnode->CloseSocketDisconnect();
+                }
+                if (pnode->fConnecting || pnode->hSocket == INVALID_SOCKET)
+                    continue;
+            }
+
             //
             // Receive
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
@@ -927,34 +1074,13 @@ void ThreadSocketHandler2(void* parg)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    pnode->SocketSendData();
             }
 
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (pnode->nSendSize == 0)
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -1169,38 +1295,39 @@ void ThreadDNSAddressSeed(void* parg)
     printf("ThreadDNSAddressSeed exited\n");
 }
 
+// Called from a resolver thread with the addresses of a DNS seed
+void static DNSSeedResult(void* parg, const std::string& strName, const std::vector<CNetAddr>& vIP)
+{
+    unsigned int seed_idx = (unsigned int)(size_t)parg;
+    vector<CAddress> vAdd;
+    BOOST_FOREACH(const CNetAddr& ip, vIP)
+    {
+        int nOneDay = 24*3600;
+        CAddress addr = CAddress(CService(ip, GetDefaultPort()));
+        addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
+        vAdd.push_back(addr);
+    }
+    if (!vAdd.empty())
+        addrman.Add(vAdd, CNetAddr(strDNSSeed[seed_idx][0], true));
+    printf("%d addresses found from DNS seed %s\n", (int)vAdd.size(), strName.c_str());
+}
+
 void ThreadDNSAddressSeed2(void* parg)
 {
     printf("ThreadDNSAddressSeed started\n");
-    int found = 0;
 
     if (!fTestNet)
     {
-        printf("Loading addresses from DNS seeds (could take a while)\n");
+        printf("Loading addresses from DNS seeds\n");
 
+        // All seeds are queried at once, their results arrive in DNSSeedResult
         for (unsigned int seed_idx = 0; seed_idx < ARRAYLEN(strDNSSeed); seed_idx++) {
-            if (GetNameProxy()) {
+            if (GetNameProxy())
                 AddOneShot(strDNSSeed[seed_idx][1]);
-            } else {
-                vector<CNetAddr> vaddr;
-                vector<CAddress> vAdd;
-                if (LookupHost(strDNSSeed[seed_idx][1], vaddr))
-                {
-                    BOOST_FOREACH(CNetAddr& ip, vaddr)
-                    {
-                        int nOneDay = 24*3600;
-                        CAddress addr = CAddress(CService(ip, GetDefaultPort()));
-                        addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
-                        vAdd.push_back(addr);
-                        found++;
-                    }
-                }
-                addrman.Add(vAdd, CNetAddr(strDNSSeed[seed_idx][0], true));
-            }
+            else
+                presolver->LookupAsync(strDNSSeed[seed_idx][1], DNSSeedResult, (void*)(size_t)seed_idx);
         }
     }
-
-    printf("%d addresses found from DNS seeds\n", found);
 }
 
 
@@ -1458,23 +1585,50 @@ void ThreadOpenAddedConnections2(void* parg)
         return;
     }
 
-    vector<vector<CService> > vservAddressesToAdd(0);
+    vector<string> vHosts;
+    vector<int> vPorts;
     BOOST_FOREACH(string& strAddNode, mapMultiArgs["-addnode"])
     {
-        vector<CService> vservNode(0);
-        if(Lookup(strAddNode.c_str(), vservNode, GetDefaultPort(), fNameLookup, 0))
-        {
-            vservAddressesToAdd.push_back(vservNode);
-            {
-                LOCK(cs_setservAddNodeAddresses);
-                BOOST_FOREACH(CService& serv, vservNode)
-                    setservAddNodeAddresses.insert(serv);
-            }
-        }
+        string strHost;
+        int nPort = GetDefaultPort();
+        SplitHostPort(strAddNode, nPort, strHost);
+        vHosts.push_back(strHost);
+        vPorts.push_back(nPort);
     }
+    // Addresses each host resolved to last
+    vector<vector<CService> > vservHostAddresses(vHosts.size());
     loop
     {
-        vector<vector<CService> > vservConnectAddresses = vservAddressesToAdd;
+        // Names are resolved again once their cached result expired, all
+        // of them at the same time
+        if (fNameLookup)
+            presolver->Prefetch(vHosts);
+        vector<vector<CService> > vservConnectAddresses;
+        for (unsigned int i = 0; i < vHosts.size(); i++)
+        {
+            vector<CNetAddr> vIP;
+            if (fNameLookup ? !presolver->Lookup(vHosts[i], vIP) : !LookupHostNumeric(vHosts[i].c_str(), vIP))
+                continue;
+            vector<CService> vservNode;
+            BOOST_FOREACH(const CNetAddr& ip, vIP)
+                vservNode.push_back(CService(ip, vPorts[i]));
+            vservConnectAddresses.push_back(vservNode);
+            vservHostAddresses[i] = vservNode;
+        }
+
+        // Rebuilt from this pass, so addresses a name no longer resolves to
+        // drop out. A host that failed to resolve keeps its last ones.
+        set<CNetAddr> setAddresses;
+        BOOST_FOREACH(const vector<CService>& vservNode, vservHostAddresses)
+            BOOST_FOREACH(const CService& serv, vservNode)
+                setAddresses.insert(serv);
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            setservAddNodeAddresses.swap(setAddresses);
+        }
+        if (fShutdown)
+            return;
+
         // Attempt to connect to each IP for each addnode entry until at least one is successful per addnode entry
         // (keeping in mind that addnode entries can have many IPs if fNameLookup)
         {
@@ -1507,6 +1661,58 @@ void ThreadOpenAddedConnections2(void* parg)
     }
 }
 
+static void SetupOutboundNode(CNode* pnode, CSemaphoreGrant *grantOutbound, bool fOneShot)
+{
+    if (grantOutbound)
+        grantOutbound->MoveTo(pnode->grantOutbound);
+    pnode->fNetworkNode = true;
+    if (fOneShot)
+        pnode->fOneShot = true;
+}
+
+// Connections by name or through a proxy need blocking lookups and proxy
+// handshakes, each of them gets its own thread
+class CBlockingConnection
+{
+public:
+    CAddress addrConnect;
+    std::string strDest;
+    std::string strKey;
+    CSemaphoreGrant grantOutbound;
+    bool fOneShot;
+};
+
+static CCriticalSection cs_setBlockingConnections;
+static set<string> setBlockingConnections;
+
+void static ThreadOpenBlockingConnection(void* parg)
+{
+    // Make this thread recognisable as a connection opening thread
+    RenameThread("bitcoin-opencon");
+
+    CBlockingConnection* pconn = (CBlockingConnection*)parg;
+    try
+    {
+        CNode* pnode = ConnectNode(pconn->addrConnect, pconn->strDest.empty() ? NULL : pconn->strDest.c_str());
+        if (pnode)
+            SetupOutboundNode(pnode, &pconn->grantOutbound, pconn->fOneShot);
+        else if (pconn->fOneShot && !fShutdown)
+            AddOneShot(pconn->strDest);
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadOpenBlockingConnection()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadOpenBlockingConnection()");
+    }
+
+    {
+        LOCK(cs_setBlockingConnections);
+        setBlockingConnections.erase(pconn->strKey);
+        vnThreadsRunning[THREAD_OPENBLOCKING]--;
+    }
+    delete pconn;
+}
+
 // if succesful, this moves the passed grant to the constructed node
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound, const char *strDest, bool fOneShot)
 {
@@ -1523,19 +1729,43 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
     if (strDest && FindNode(strDest))
         return false;
 
-    vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
+    CService addrProxy;
+    if (strDest || GetProxy(addrConnect.GetNetwork(), addrProxy))
+    {
+        CBlockingConnection* pconn = new CBlockingConnection();
+        pconn->addrConnect = addrConnect;
+        pconn->strDest = strDest ? strDest : "";
+        pconn->strKey = strDest ? strDest : addrConnect.ToStringIPPort();
+        pconn->fOneShot = fOneShot;
+        {
+            LOCK(cs_setBlockingConnections);
+            if (!setBlockingConnections.insert(pconn->strKey).second)
+            {
+                delete pconn;
+                return false;
+            }
+            // Counted before the thread starts, so StopNode can't miss it
+            vnThreadsRunning[THREAD_OPENBLOCKING]++;
+        }
+        if (grantOutbound)
+            grantOutbound->MoveTo(pconn->grantOutbound);
+        if (!CreateThread(ThreadOpenBlockingConnection, pconn))
+        {
+            printf("Error: CreateThread(ThreadOpenBlockingConnection) failed\n");
+            LOCK(cs_setBlockingConnections);
+            setBlockingConnections.erase(pconn->strKey);
+            vnThreadsRunning[THREAD_OPENBLOCKING]--;
+            delete pconn;
+            return false;
+        }
+        return true;
+    }
+
+    // Returns as soon as the connect is started
     CNode* pnode = ConnectNode(addrConnect, strDest);
-    vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
-    if (fShutdown)
-        return false;
     if (!pnode)
         return false;
-    if (grantOutbound)
-        grantOutbound->MoveTo(pnode->grantOutbound);
-    pnode->fNetworkNode = true;
-    if (fOneShot)
-        pnode->fOneShot = true;
-
+    SetupOutboundNode(pnode, grantOutbound, fOneShot);
     return true;
 }
 
@@ -1804,6 +2034,11 @@ void StartNode(void* parg)
         semOutbound = new CSemaphore(nMaxOutbound);
     }
 
+    if (presolver == NULL) {
+        presolver = new CResolver();
+        presolver->Start(RESOLVER_THREADS);
+    }
+
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
@@ -1883,8 +2118,12 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DNSSEED] > 0) printf("ThreadDNSAddressSeed still running\n");
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
+    if (vnThreadsRunning[THREAD_OPENBLOCKING] > 0) printf("ThreadOpenBlockingConnection still running\n");
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         Sleep(20);
+    // Waits for lookups in progress, later ones are done by their caller
+    if (presolver)
+        presolver->Stop();
     Sleep(50);
     DumpAddresses();
     return true;
@@ -10,13 +10,14 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
+#include "invfilter.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
@@ -31,6 +32,9 @@ extern int nBestHeight;
 inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+/** Maximum number of inventory items a peer can have waiting to be requested */
+static const unsigned int MAX_ASKFOR_SIZE = 50000;
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
@@ -95,6 +99,31 @@ public:
 };
 
 
+/** A serialized message payload and its checksum. Payloads are immutable
+ *  once built, so one copy can be shared by all the peers it goes to. */
+class CMessagePayload
+{
+public:
+    std::vector<char> vch;
+    unsigned int nChecksum; // of vch as a message payload
+
+    CMessagePayload() : nChecksum(0) { }
+
+    explicit CMessagePayload(const CDataStream& ss) : vch(ss.begin(), ss.end())
+    {
+        SetChecksum();
+    }
+
+    void SetChecksum()
+    {
+        uint256 hash = Hash(vch.begin(), vch.end());
+        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    }
+};
+
+typedef boost::shared_ptr<const CMessagePayload> CMessagePayloadRef;
+
+
 /** Thread types */
 enum threadId
 {
@@ -108,6 +137,7 @@ enum threadId
     THREAD_ADDEDCONNECTIONS,
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
+    THREAD_OPENBLOCKING,
 
     THREAD_MAX
 };
@@ -122,10 +152,11 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CMessagePayloadRef> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern std::map<CInv, int64> mapAlreadyAskedFor;
+extern CCriticalSection cs_mapAlreadyAskedFor;
+extern CInvTimeMap mapAlreadyAskedFor;
 
 
 
@@ -144,6 +175,7 @@ public:
     int64 nReleaseTime;
     int nStartingHeight;
     int nMisbehavior;
+    uint64 nSendBytes;
 };
 
 
@@ -157,7 +189,11 @@ public:
     // socket
     uint64 nServices;
     SOCKET hSocket;
-    CDataStream vSend;
+    CDataStream vSend; // the message being built, see BeginMessage
+    std::deque<CMessagePayloadRef> vSendMsg; // buffers waiting to be sent
+    unsigned int nSendOffset; // bytes of vSendMsg.front() already sent
+    uint64 nSendSize; // bytes in vSendMsg not sent yet
+    uint64 nSendBytes; // total bytes sent
     CDataStream vRecv;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
@@ -178,6 +214,7 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fConnecting; // outbound connect still in progress
     CSemaphoreGrant grantOutbound;
 protected:
     int nRefCount;
@@ -205,15 +242,21 @@ public:
 	uint256 hashCheckpointKnown; // known sent sync-checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CInvFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
+    // headers-first block download, blocks requested and when (cs_mapBlocksInFlight in main.cpp)
+    std::map<uint256, int64> mapBlocksInFlight;
+
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nSendOffset = 0;
+        nSendSize = 0;
+        nSendBytes = 0;
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
@@ -230,6 +273,7 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fConnecting = false;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
@@ -239,7 +283,7 @@ public:
         fGetAddr = false;
         nMisbehavior = 0;
 		hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        filterInventoryKnown.max_size(SendBufferSize() / 1000);
 
         // Be shy and don't send version until we hear
         if (!fInbound)
@@ -301,7 +345,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
@@ -309,16 +353,21 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.count(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
 
     void AskFor(const CInv& inv)
     {
+        // Don't let a peer queue up requests without limit
+        if (mapAskFor.size() >= MAX_ASKFOR_SIZE)
+            return;
+
         // We're using mapAskFor as a priority queue,
         // the key is the earliest time the request can be sent
-        int64& nRequestTime = mapAlreadyAskedFor[inv];
+        LOCK(cs_mapAlreadyAskedFor);
+        int64 nRequestTime = mapAlreadyAskedFor.get(inv);
         if (fDebugNet)
             printf("askfor %s   %"PRI64d"\n", inv.ToString().c_str(), nRequestTime);
 
@@ -331,11 +380,18 @@ public:
 
         // Each retry is 2 minutes after the last
         nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
+        mapAlreadyAskedFor.set(inv, nRequestTime);
         mapAskFor.insert(std::make_pair(nRequestTime, inv));
     }
 
 
 
+    void QueueSend(const CMessagePayloadRef& pbuf)
+    {
+        vSendMsg.push_back(pbuf);
+        nSendSize += pbuf->vch.size();
+    }
+
     void BeginMessage(const char* pszCommand)
     {
         ENTER_CRITICAL_SECTION(cs_vSend);
@@ -361,7 +417,8 @@ public:
             printf("(aborted)\n");
     }
 
-    void EndMessage()
+    // A shared payload is queued by reference after the header in vSend
+    void EndMessage(const CMessagePayloadRef& payload = CMessagePayloadRef())
     {
         if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
         {
@@ -375,12 +432,22 @@ public:
 
         // Set the size
         unsigned int nSize = vSend.size() - nMessageStart;
+        if (payload)
+            nSize += payload->vch.size();
         memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
 
         // Set the checksum
-        uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
         unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+        if (payload)
+        {
+            assert(vSend.size() == nMessageStart);
+            nChecksum = payload->nChecksum;
+        }
+        else
+        {
+            uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
+            memcpy(&nChecksum, &hash, sizeof(nChecksum));
+        }
         assert(nMessageStart - nHeaderStart >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
         memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
 
@@ -388,6 +455,14 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
+        // Move the message to the send queue
+        CMessagePayload* pmsg = new CMessagePayload();
+        pmsg->vch.assign(vSend.begin() + nHeaderStart, vSend.end());
+        vSend.clear();
+        QueueSend(CMessagePayloadRef(pmsg));
+        if (payload && !payload->vch.empty())
+            QueueSend(payload);
+
         nHeaderStart = -1;
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
@@ -423,6 +498,21 @@ public:
         }
     }
 
+    // Send an already serialized payload without copying it
+    void PushMessageRaw(const char* pszCommand, const CMessagePayloadRef& payload)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            EndMessage(payload);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -620,6 +710,7 @@ public:
     void CancelSubscribe(unsigned int nChannel);
     void CloseSocketDisconnect();
     void Cleanup();
+    void SocketSendData();
 
 
     // Denial-of-service detection/prevention
@@ -651,6 +742,10 @@ public:
 
 
 
+/** Remember that an inventory item is our own, so it is always trickled */
+void AddOwnInventory(const CInv& inv);
+bool IsOwnInventory(const CInv& inv);
+
 inline void RelayInventory(const CInv& inv)
 {
     // Put on lists to offer to the other nodes
@@ -673,6 +768,8 @@ void RelayMessage(const CInv& inv, const T& a)
 template<>
 inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
 {
+    // Serialized once, peers asking for it all get the same buffer
+    CMessagePayloadRef payload(new CMessagePayload(ss));
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -683,7 +780,7 @@ inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, payload));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -319,7 +319,7 @@ bool static Socks5(string strDest, int port, SOCKET& hSocket)
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+bool StartConnectSocket(const CService &addrConnect, SOCKET& hSocketRet)
 {
     hSocketRet = INVALID_SOCKET;
 
@@ -359,43 +359,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
         {
-            struct timeval timeout;
-            timeout.tv_sec  = nTimeout / 1000;
-            timeout.tv_usec = (nTimeout % 1000) * 1000;
-
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-            if (nRet == 0)
-            {
-                printf("connection timeout\n");
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet == SOCKET_ERROR)
-            {
-                printf("select() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            socklen_t nRetSize = sizeof(nRet);
-#ifdef WIN32
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
-#else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
-#endif
-            {
-                printf("getsockopt() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet != 0)
-            {
-                printf("connect() failed after select(): %s\n",strerror(nRet));
-                closesocket(hSocket);
-                return false;
-            }
+            // in progress, wait for the socket to become writable
         }
 #ifdef WIN32
         else if (WSAGetLastError() != WSAEISCONN)
@@ -409,14 +373,73 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         }
     }
 
+    hSocketRet = hSocket;
+    return true;
+}
+
+bool FinishConnectSocket(SOCKET hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
+#ifdef WIN32
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+#else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+#endif
+    {
+        printf("getsockopt() for connection failed: %i\n",WSAGetLastError());
+        return false;
+    }
+    if (nRet != 0)
+    {
+        printf("connect() failed after select(): %s\n",strerror(nRet));
+        return false;
+    }
+    return true;
+}
+
+bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+{
+    hSocketRet = INVALID_SOCKET;
+
+    SOCKET hSocket;
+    if (!StartConnectSocket(addrConnect, hSocket))
+        return false;
+
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+    if (nRet == 0)
+    {
+        printf("connection timeout\n");
+        closesocket(hSocket);
+        return false;
+    }
+    if (nRet == SOCKET_ERROR)
+    {
+        printf("select() for connection failed: %i\n",WSAGetLastError());
+        closesocket(hSocket);
+        return false;
+    }
+    if (!FinishConnectSocket(hSocket))
+    {
+        closesocket(hSocket);
+        return false;
+    }
+
     // this isn't even strictly necessary
     // CNode::ConnectNode immediately turns the socket back to non-blocking
     // but we'll turn it back to blocking just in case
 #ifdef WIN32
-    fNonblock = 0;
+    u_long fNonblock = 0;
     if (ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
 #else
-    fFlags = fcntl(hSocket, F_GETFL, 0);
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
     if (fcntl(hSocket, F_SETFL, fFlags & !O_NONBLOCK) == SOCKET_ERROR)
 #endif
     {
@@ -428,6 +451,150 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
     return true;
 }
 
+static bool ResolverLookup(const std::string& strName, std::vector<CNetAddr>& vIP)
+{
+    return LookupHost(strName.c_str(), vIP);
+}
+
+CResolver::CResolver(LookupFunc pfnLookupIn, int64 nTTLIn, int64 nFailTTLIn)
+{
+    pfnLookup = pfnLookupIn ? pfnLookupIn : ResolverLookup;
+    nTTL = nTTLIn;
+    nFailTTL = nFailTTLIn;
+    nThreads = 0;
+    fStop = false;
+}
+
+CResolver::~CResolver()
+{
+    Stop();
+}
+
+void CResolver::Start(int nThreadsIn)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fStop = false;
+    for (int i = 0; i < nThreadsIn; i++)
+    {
+        if (!CreateThread(CResolver::ThreadWorker, this))
+            break;
+        nThreads++;
+    }
+}
+
+// Waits for the threads to finish their current lookup
+void CResolver::Stop()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fStop = true;
+    condWork.notify_all();
+    while (nThreads > 0)
+        condDone.wait(lock);
+}
+
+// Called with the mutex held. Queues a lookup if there is no fresh result.
+CResolver::CEntry& CResolver::Request(const std::string& strName)
+{
+    CEntry& entry = mapCache[strName];
+    if (!entry.fPending && entry.nExpire <= GetTime())
+    {
+        entry.fPending = true;
+        vQueue.push_back(strName);
+        condWork.notify_one();
+    }
+    return entry;
+}
+
+// Called with the mutex held, which is released during the lookup
+void CResolver::ProcessOne(boost::unique_lock<boost::mutex>& lock)
+{
+    std::string strName = vQueue.front();
+    vQueue.pop_front();
+
+    lock.unlock();
+    std::vector<CNetAddr> vIP;
+    bool fFound = pfnLookup(strName, vIP) && !vIP.empty();
+    lock.lock();
+
+    CEntry& entry = mapCache[strName];
+    entry.vIP = vIP;
+    entry.nExpire = GetTime() + (fFound ? nTTL : nFailTTL);
+    entry.fPending = false;
+    std::vector<std::pair<Callback, void*> > vCallbacks;
+    vCallbacks.swap(entry.vCallbacks);
+    condDone.notify_all();
+
+    lock.unlock();
+    for (unsigned int i = 0; i < vCallbacks.size(); i++)
+        vCallbacks[i].first(vCallbacks[i].second, strName, vIP);
+    lock.lock();
+}
+
+void CResolver::ThreadWorker(void* parg)
+{
+    RenameThread("bitcoin-resolver");
+    CResolver* presolver = (CResolver*)parg;
+
+    boost::unique_lock<boost::mutex> lock(presolver->mutex);
+    while (!presolver->fStop)
+    {
+        if (presolver->vQueue.empty())
+            presolver->condWork.wait(lock);
+        else
+            presolver->ProcessOne(lock);
+    }
+    presolver->nThreads--;
+    presolver->condDone.notify_all();
+}
+
+void CResolver::LookupAsync(const std::string& strName, Callback pfn, void* parg)
+{
+    std::vector<CNetAddr> vIP;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CEntry& entry = Request(strName);
+        if (entry.fPending)
+        {
+            entry.vCallbacks.push_back(std::make_pair(pfn, parg));
+            if (nThreads == 0)
+                while (!vQueue.empty())
+                    ProcessOne(lock);
+            return;
+        }
+        vIP = entry.vIP;
+    }
+    pfn(parg, strName, vIP);
+}
+
+void CResolver::Prefetch(const std::vector<std::string>& vNames)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (unsigned int i = 0; i < vNames.size(); i++)
+        Request(vNames[i]);
+}
+
+bool CResolver::Lookup(const std::string& strName, std::vector<CNetAddr>& vIP)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    CEntry& entry = Request(strName);
+    while (entry.fPending)
+    {
+        // Without threads, do the lookups here
+        if (nThreads == 0 && !vQueue.empty())
+            ProcessOne(lock);
+        else
+            condDone.wait(lock);
+    }
+    vIP = entry.vIP;
+    return !vIP.empty();
+}
+
+unsigned int CResolver::GetCacheSize()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return mapCache.size();
+}
+
 bool SetProxy(enum Network net, CService addrProxy, int nSocksVersion) {
     assert(net >= 0 && net < NET_MAX);
     if (nSocksVersion != 0 && nSocksVersion != 4 && nSocksVersion != 5)
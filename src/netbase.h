@@ -8,6 +8,10 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <deque>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include "serialize.h"
 #include "compat.h"
@@ -149,5 +153,62 @@ bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
+/** Start a non-blocking connect. The socket becomes writable when the
+ *  connect has finished, then FinishConnectSocket tells if it succeeded. */
+bool StartConnectSocket(const CService &addrConnect, SOCKET& hSocketRet);
+bool FinishConnectSocket(SOCKET hSocket);
+
+/** Resolves host names in a pool of threads and caches the results for a
+ *  while, failures for a shorter while. The lookup function can be
+ *  replaced, e.g. by a stub for testing. */
+class CResolver
+{
+public:
+    typedef bool (*LookupFunc)(const std::string& strName, std::vector<CNetAddr>& vIP);
+    typedef void (*Callback)(void* parg, const std::string& strName, const std::vector<CNetAddr>& vIP);
+
+private:
+    struct CEntry
+    {
+        std::vector<CNetAddr> vIP;
+        int64 nExpire;
+        bool fPending;
+        std::vector<std::pair<Callback, void*> > vCallbacks;
+
+        CEntry() : nExpire(0), fPending(false) { }
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    std::map<std::string, CEntry> mapCache;
+    std::deque<std::string> vQueue;
+    LookupFunc pfnLookup;
+    int64 nTTL;
+    int64 nFailTTL;
+    int nThreads;
+    bool fStop;
+
+    CEntry& Request(const std::string& strName);
+    void ProcessOne(boost::unique_lock<boost::mutex>& lock);
+    static void ThreadWorker(void* parg);
+
+public:
+    CResolver(LookupFunc pfnLookupIn = NULL, int64 nTTLIn = 10 * 60, int64 nFailTTLIn = 60);
+    ~CResolver();
+
+    void Start(int nThreadsIn);
+    void Stop();
+
+    // Look up a name in the background. The callback runs in a resolver
+    // thread, or right away if the result is cached.
+    void LookupAsync(const std::string& strName, Callback pfn, void* parg);
+    // Start looking up several names at once, so that Lookup calls for
+    // them don't each wait in turn
+    void Prefetch(const std::vector<std::string>& vNames);
+    // Waits for the result if it is not cached yet
+    bool Lookup(const std::string& strName, std::vector<CNetAddr>& vIP);
+    unsigned int GetCacheSize();
+};
 
 #endif
@@ -7,6 +7,7 @@
 #include "main.h"
 #include "init.h" // for pwalletMain
 #include "ui_interface.h"
+#include "stratum.h"
 
 #include <QDateTime>
 #include <QTimer>
@@ -15,11 +16,12 @@ static const int64 nClientStartupTime = GetTime();
 
 ClientModel::ClientModel(OptionsModel *optionsModel, QObject *parent) :
     QObject(parent), optionsModel(optionsModel),
-    cachedNumBlocks(0), cachedNumBlocksOfPeers(0), cachedHashrate(0), pollTimer(0)
+    cachedNumBlocks(0), cachedNumBlocksOfPeers(0), cachedHashrate(0), pollTimer(0), updateQueued(0), miningTimer(0)
 {
     numBlocksAtStartup = -1;
 
     pollTimer = new QTimer(this);
+    miningTimer = new QTimer(this);
     // Read our specific settings from the wallet db
     /*
     CWalletDB walletdb(optionsModel->getWallet()->strWalletFile);
@@ -47,10 +49,15 @@ ClientModel::ClientModel(OptionsModel *optionsModel, QObject *parent) :
 //    }
 //    miningThreads = nLimitProcessors;
 
+    pollTimer->setSingleShot(true);
     pollTimer->setInterval(MODEL_UPDATE_DELAY);
-    pollTimer->start();
     connect(pollTimer, SIGNAL(timeout()), this, SLOT(updateTimer()));
 
+    miningTimer->setInterval(MODEL_UPDATE_DELAY);
+    connect(miningTimer, SIGNAL(timeout()), this, SLOT(updateHashrate()));
+    if (miningStarted)
+        miningTimer->start();
+
     subscribeToCoreSignals();
 }
 
@@ -158,6 +165,12 @@ void ClientModel::setMiningPassword(QString password)
 
 int ClientModel::getHashrate() const
 {
+    if (miningType == PoolMining)
+    {
+        CPoolMiningStats stats;
+        GetPoolMiningStats(stats);
+        return stats.fRunning ? (int)stats.dHashesPerSec : 0;
+    }
     if (GetTimeMillis() - nHPSTimerStart > 8000)
         return (boost::int64_t)0;
     return (boost::int64_t)dHashesPerSec;
@@ -195,10 +208,19 @@ QDateTime ClientModel::getLastBlockDate() const
     return QDateTime::fromTime_t(pindexBest->GetBlockTime());
 }
 
+void ClientModel::queueUpdate()
+{
+    // Only the first notification of a burst gets through to the GUI thread
+    if (updateQueued.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(pollTimer, "start", Qt::QueuedConnection);
+}
+
 void ClientModel::updateTimer()
 {
     // Some quantities (such as number of blocks) change so fast that we don't want to be notified for each change.
-    // Periodically check and update with a timer.
+    // The core notifications only start a timer, and this runs when it fires.
+    updateQueued.fetchAndStoreOrdered(0);
+
     int newNumBlocks = getNumBlocks();
     int newNumBlocksOfPeers = getNumBlocksOfPeers();
 
@@ -207,15 +229,14 @@ void ClientModel::updateTimer()
 
     cachedNumBlocks = newNumBlocks;
     cachedNumBlocksOfPeers = newNumBlocksOfPeers;
+}
 
-    // Only need to update if solo mining. When pool mining, stats are pushed.
-    if (miningType == SoloMining)
-    {
-        int newHashrate = getHashrate();
-        if (cachedHashrate != newHashrate)
-            emit miningChanged(miningStarted, newHashrate);
-        cachedHashrate = newHashrate;
-    }
+void ClientModel::updateHashrate()
+{
+    int newHashrate = getHashrate();
+    if (cachedHashrate != newHashrate)
+        emit miningChanged(miningStarted, newHashrate);
+    cachedHashrate = newHashrate;
 }
 
 void ClientModel::updateNumConnections(int numConnections)
@@ -242,6 +263,11 @@ void ClientModel::updateAlert(const QString &hash, int status)
     emit numBlocksChanged(getNumBlocks(), getNumBlocksOfPeers());
 }
 
+void ClientModel::updatePoolMining(int event, const QString &message)
+{
+    emit poolMiningEvent(event, message);
+}
+
 bool ClientModel::isTestNet() const
 {
     return fTestNet;
@@ -265,6 +291,10 @@ void ClientModel::setMining(MiningType type, bool mining, int threads, int hashr
     }
     miningType = type;
     miningStarted = mining;
+    if (mining)
+        miningTimer->start();
+    else
+        miningTimer->stop();
 //    WriteSetting("miningStarted", mining);
 //    WriteSetting("fLimitProcessors", 1);
 //    WriteSetting("nLimitProcessors", threads);
@@ -304,8 +334,9 @@ QString ClientModel::formatClientStartupTime() const
 // Handlers for core signals
 static void NotifyBlocksChanged(ClientModel *clientmodel)
 {
-    // This notification is too frequent. Don't trigger a signal.
-    // Don't remove it, though, as it might be useful later.
+    // This notification is too frequent to trigger a signal each time,
+    // it is coalesced into one update per MODEL_UPDATE_DELAY.
+    clientmodel->queueUpdate();
 }
 
 static void NotifyNumConnectionsChanged(ClientModel *clientmodel, int newNumConnections)
@@ -323,12 +354,21 @@ static void NotifyAlertChanged(ClientModel *clientmodel, const uint256 &hash, Ch
                               Q_ARG(int, status));
 }
 
+static void NotifyPoolMining(ClientModel *clientmodel, int nEvent, const std::string &message)
+{
+    // Sent from the miner threads, queue to the GUI thread
+    QMetaObject::invokeMethod(clientmodel, "updatePoolMining", Qt::QueuedConnection,
+                              Q_ARG(int, nEvent),
+                              Q_ARG(QString, QString::fromStdString(message)));
+}
+
 void ClientModel::subscribeToCoreSignals()
 {
     // Connect signals to client
     uiInterface.NotifyBlocksChanged.connect(boost::bind(NotifyBlocksChanged, this));
     uiInterface.NotifyNumConnectionsChanged.connect(boost::bind(NotifyNumConnectionsChanged, this, _1));
     uiInterface.NotifyAlertChanged.connect(boost::bind(NotifyAlertChanged, this, _1, _2));
+    uiInterface.NotifyPoolMining.connect(boost::bind(NotifyPoolMining, this, _1, _2));
 }
 
 void ClientModel::unsubscribeFromCoreSignals()
@@ -337,4 +377,5 @@ void ClientModel::unsubscribeFromCoreSignals()
     uiInterface.NotifyBlocksChanged.disconnect(boost::bind(NotifyBlocksChanged, this));
     uiInterface.NotifyNumConnectionsChanged.disconnect(boost::bind(NotifyNumConnectionsChanged, this, _1));
     uiInterface.NotifyAlertChanged.disconnect(boost::bind(NotifyAlertChanged, this, _1, _2));
+    uiInterface.NotifyPoolMining.disconnect(boost::bind(NotifyPoolMining, this, _1, _2));
 }
@@ -2,6 +2,7 @@
 #define CLIENTMODEL_H
 
 #include <QObject>
+#include <QAtomicInt>
 
 class OptionsModel;
 class AddressTableModel;
@@ -89,7 +90,11 @@ private:
 
     int numBlocksAtStartup;
 
+    // Started by core notifications, so that a burst of them costs one update
     QTimer *pollTimer;
+    QAtomicInt updateQueued;
+    // Runs only while mining, to show the hash rate
+    QTimer *miningTimer;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
@@ -97,14 +102,20 @@ signals:
     void numConnectionsChanged(int count);
     void numBlocksChanged(int count, int countOfPeers);
     void miningChanged(bool mining, int count);
+    //! Event from the built-in pool miner, see PoolMiningEvent
+    void poolMiningEvent(int event, const QString &message);
 
     //! Asynchronous error notification
     void error(const QString &title, const QString &message, bool modal);
 
 public slots:
     void updateTimer();
+    void updateHashrate();
+    /* Schedule updateTimer, may be called from any thread */
+    void queueUpdate();
     void updateNumConnections(int numConnections);
     void updateAlert(const QString &hash, int status);
+    void updatePoolMining(int event, const QString &message);
 };
 
 #endif // CLIENTMODEL_H
@@ -1,6 +1,8 @@
 #include "miningpage.h"
 #include "ui_miningpage.h"
 
+#include "stratum.h"
+
 MiningPage::MiningPage(QWidget *parent) :
     QWidget(parent),
     ui(new Ui::MiningPage)
@@ -11,9 +13,6 @@ MiningPage::MiningPage(QWidget *parent) :
 
     minerActive = false;
 
-    minerProcess = new QProcess(this);
-    minerProcess->setProcessChannelMode(QProcess::MergedChannels);
-
     readTimer = new QTimer(this);
 
     acceptedShares = 0;
@@ -24,20 +23,16 @@ MiningPage::MiningPage(QWidget *parent) :
 
     initThreads = 0;
 
-    connect(readTimer, SIGNAL(timeout()), this, SLOT(readProcessOutput()));
+    connect(readTimer, SIGNAL(timeout()), this, SLOT(updateSpeed()));
 
     connect(ui->startButton, SIGNAL(pressed()), this, SLOT(startPressed()));
     connect(ui->typeBox, SIGNAL(currentIndexChanged(int)), this, SLOT(typeChanged(int)));
     connect(ui->debugCheckBox, SIGNAL(toggled(bool)), this, SLOT(debugToggled(bool)));
-    connect(minerProcess, SIGNAL(started()), this, SLOT(minerStarted()));
-    connect(minerProcess, SIGNAL(error(QProcess::ProcessError)), this, SLOT(minerError(QProcess::ProcessError)));
-    connect(minerProcess, SIGNAL(finished(int,QProcess::ExitStatus)), this, SLOT(minerFinished()));
-    connect(minerProcess, SIGNAL(readyRead()), this, SLOT(readProcessOutput()));
 }
 
 MiningPage::~MiningPage()
 {
-    minerProcess->kill();
+    StopPoolMining(false);
 
     delete ui;
 }
@@ -48,6 +43,8 @@ void MiningPage::setModel(ClientModel *model)
 
     loadSettings();
 
+    connect(model, SIGNAL(poolMiningEvent(int,QString)), this, SLOT(poolMiningEvent(int,QString)));
+
     bool pool = model->getMiningType() == ClientModel::PoolMining;
     ui->threadsBox->setValue(model->getMiningThreads());
     ui->typeBox->setCurrentIndex(pool ? 1 : 0);
@@ -79,21 +76,12 @@ void MiningPage::startPressed()
 
 void MiningPage::startPoolMining()
 {
-    QStringList args;
-    QString url = ui->serverLine->text();
-    if (!url.contains("http://"))
-        url.prepend("http://");
-    QString urlLine = QString("%1:%2").arg(url, ui->portLine->text());
-    QString userpassLine = QString("%1:%2").arg(ui->usernameLine->text(), ui->passwordLine->text());
-    args << "--algo" << "scrypt";
-    args << "--scantime" << ui->scantimeBox->text().toAscii();
-    args << "--url" << urlLine.toAscii();
-    args << "--userpass" << userpassLine.toAscii();
-    args << "--threads" << ui->threadsBox->text().toAscii();
-    args << "--retries" << "-1"; // Retry forever.
-    args << "-P"; // This is needed for this to work correctly on Windows. Extra protocol dump helps flush the buffer quicker.
-
-    threadSpeed.clear();
+    // The pool is spoken to over stratum directly, an URL scheme is only a hint
+    QString server = ui->serverLine->text().trimmed();
+    server.remove("stratum+tcp://");
+    server.remove("http://");
+    while (server.endsWith("/"))
+        server.chop(1);
 
     acceptedShares = 0;
     rejectedShares = 0;
@@ -101,27 +89,28 @@ void MiningPage::startPoolMining()
     roundAcceptedShares = 0;
     roundRejectedShares = 0;
 
-    // If minerd is in current path, then use that. Otherwise, assume minerd is in the path somewhere.
-    QString program = QDir::current().filePath("minerd");
-    if (!QFile::exists(program))
-        program = "minerd";
-
     if (ui->debugCheckBox->isChecked())
-        ui->list->addItem(args.join(" ").prepend(" ").prepend(program));
+        ui->list->addItem(QString("stratum+tcp://%1:%2 as %3, %4 thread(s)").arg(server, ui->portLine->text(), ui->usernameLine->text(), ui->threadsBox->text()));
 
     ui->mineSpeedLabel->setText("Speed: N/A");
     ui->shareCount->setText("Accepted: 0 - Rejected: 0");
-    minerProcess->start(program,args);
-    minerProcess->waitForStarted(-1);
+    if (!StartPoolMining(server.toStdString(), ui->portLine->text().toInt(),
+                         ui->usernameLine->text().toStdString(), ui->passwordLine->text().toStdString(),
+                         initThreads, ui->scantimeBox->value()))
+    {
+        reportToList("The miner is still shutting down, try again in a moment.", ERROR, NULL);
+        return;
+    }
 
-    readTimer->start(500);
+    readTimer->start(1000);
 }
 
 void MiningPage::stopPoolMining()
 {
     ui->mineSpeedLabel->setText("");
-    minerProcess->kill();
     readTimer->stop();
+    // Don't block the GUI, POOL_STOPPED arrives once the threads exited
+    StopPoolMining(false);
 }
 
 void MiningPage::saveSettings()
@@ -144,75 +133,43 @@ void MiningPage::loadSettings()
     ui->passwordLine->setText(model->getMiningPassword());
 }
 
-void MiningPage::readProcessOutput()
+// Events pushed by the built-in stratum client
+void MiningPage::poolMiningEvent(int event, const QString &message)
 {
-    QByteArray output;
+    if (getMiningType() != ClientModel::PoolMining)
+        return;
 
-    minerProcess->reset();
+    switch(event)
+    {
+        case POOL_STARTED:
+            minerStarted();
+            break;
 
-    output = minerProcess->readAll();
+        case POOL_CONNECTED:
+            reportToList(message, STARTED, NULL);
+            break;
 
-    QString outputString(output);
+        case POOL_NEWBLOCK:
+            // Only work for a new block starts a new round, other jobs just refresh it
+            reportToList("Pool sent work for a new block", LONGPOLL, NULL);
+            break;
 
-    if (!outputString.isEmpty())
-    {
-        QStringList list = outputString.split("\n", QString::SkipEmptyParts);
-        int i;
-        for (i=0; i<list.size(); i++)
-        {
-            QString line = list.at(i);
-
-            // Ignore protocol dump
-            if (!line.startsWith("[") || line.contains("JSON protocol") || line.contains("HTTP hdr"))
-                continue;
-
-            if (ui->debugCheckBox->isChecked())
-            {
-                ui->list->addItem(line.trimmed());
-                ui->list->scrollToBottom();
-            }
-
-            if (line.contains("(yay!!!)"))
-                reportToList("Share accepted", SHARE_SUCCESS, getTime(line));
-            else if (line.contains("(booooo)"))
-                reportToList("Share rejected", SHARE_FAIL, getTime(line));
-            else if (line.contains("LONGPOLL detected new block"))
-                reportToList("LONGPOLL detected a new block", LONGPOLL, getTime(line));
-            else if (line.contains("Supported options:"))
-                reportToList("Miner didn't start properly. Try checking your settings.", ERROR, NULL);
-            else if (line.contains("The requested URL returned error: 403"))
-                reportToList("Couldn't connect. Please check your username and password.", ERROR, NULL);
-            else if (line.contains("HTTP request failed"))
-                reportToList("Couldn't connect. Please check pool server and port.", ERROR, NULL);
-            else if (line.contains("JSON-RPC call failed"))
-                reportToList("Couldn't communicate with server. Retrying in 30 seconds.", ERROR, NULL);
-            else if (line.contains("thread ") && line.contains("khash/s"))
-            {
-                QString threadIDstr = line.at(line.indexOf("thread ")+7);
-                int threadID = threadIDstr.toInt();
-
-                int threadSpeedindx = line.indexOf(",");
-                QString threadSpeedstr = line.mid(threadSpeedindx);
-                threadSpeedstr.chop(8);
-                threadSpeedstr.remove(", ");
-                threadSpeedstr.remove(" ");
-                threadSpeedstr.remove('\n');
-                double speed=0;
-                speed = threadSpeedstr.toDouble();
-
-                threadSpeed[threadID] = speed;
-
-                updateSpeed();
-            }
-        }
-    }
-}
+        case POOL_SHARE_ACCEPTED:
+            reportToList(message, SHARE_SUCCESS, NULL);
+            break;
 
-void MiningPage::minerError(QProcess::ProcessError error)
-{
-    if (error == QProcess::FailedToStart)
-    {
-        reportToList("Miner failed to start. Make sure you have the minerd executable and libraries in the same directory as AuroraCoin-Qt.", ERROR, NULL);
+        case POOL_SHARE_REJECTED:
+            reportToList(message, SHARE_FAIL, NULL);
+            break;
+
+        case POOL_ERROR:
+            reportToList(message, ERROR, NULL);
+            break;
+
+        case POOL_STOPPED:
+            if (minerActive)
+                minerFinished();
+            break;
     }
 }
 
@@ -221,7 +178,10 @@ void MiningPage::minerFinished()
     if (getMiningType() == ClientModel::SoloMining)
         reportToList("Solo mining stopped.", ERROR, NULL);
     else
+    {
+        readTimer->stop();
         reportToList("Miner exited.", ERROR, NULL);
+    }
     ui->list->addItem("");
     minerActive = false;
     resetMiningButton();
@@ -234,7 +194,7 @@ void MiningPage::minerStarted()
         if (getMiningType() == ClientModel::SoloMining)
             reportToList("Solo mining started.", ERROR, NULL);
         else
-            reportToList("Miner started. You might not see any output for a few minutes.", STARTED, NULL);
+            reportToList("Miner started, connecting to the pool.", STARTED, NULL);
     }
     minerActive = true;
     resetMiningButton();
@@ -243,22 +203,16 @@ void MiningPage::minerStarted()
 
 void MiningPage::updateSpeed()
 {
-    double totalSpeed=0;
-    int totalThreads=0;
+    CPoolMiningStats stats;
+    GetPoolMiningStats(stats);
+    if (!stats.fRunning)
+        return;
 
-    QMapIterator<int, double> iter(threadSpeed);
-    while(iter.hasNext())
-    {
-        iter.next();
-        totalSpeed += iter.value();
-        totalThreads++;
-    }
+    // Shares are counted by the pool client too, ours include this round
+    acceptedShares = stats.nAccepted;
+    rejectedShares = stats.nRejected;
 
-    // If all threads haven't reported the hash speed yet, make an assumption
-    if (totalThreads != initThreads)
-    {
-        totalSpeed = (totalSpeed/totalThreads)*initThreads;
-    }
+    double totalSpeed = stats.dHashesPerSec / 1000.0;
 
     QString speedString = QString("%1").arg(totalSpeed);
     QString threadsString = QString("%1").arg(initThreads);
@@ -269,10 +223,10 @@ void MiningPage::updateSpeed()
     QString roundAcceptedString = QString("%1").arg(roundAcceptedShares);
     QString roundRejectedString = QString("%1").arg(roundRejectedShares);
 
-    if (totalThreads == initThreads)
+    if (stats.dHashesPerSec > 0)
         ui->mineSpeedLabel->setText(QString("Speed: %1 khash/sec - %2 thread(s)").arg(speedString, threadsString));
     else
-        ui->mineSpeedLabel->setText(QString("Speed: ~%1 khash/sec - %2 thread(s)").arg(speedString, threadsString));
+        ui->mineSpeedLabel->setText(QString("Speed: N/A - %1 thread(s)").arg(threadsString));
 
     ui->shareCount->setText(QString("Accepted: %1 (%3) - Rejected: %2 (%4)").arg(acceptedString, rejectedString, roundAcceptedString, roundRejectedString));
 
@@ -290,13 +244,11 @@ void MiningPage::reportToList(QString msg, int type, QString time)
     switch(type)
     {
         case SHARE_SUCCESS:
-            acceptedShares++;
             roundAcceptedShares++;
             updateSpeed();
             break;
 
         case SHARE_FAIL:
-            rejectedShares++;
             roundRejectedShares++;
             updateSpeed();
             break;
@@ -5,9 +5,6 @@
 
 #include <QWidget>
 
-#include <QDir>
-#include <QFile>
-#include <QProcess>
 #include <QTime>
 #include <QTimer>
 #include <QStringList>
@@ -36,10 +33,6 @@ public:
 
     bool minerActive;
 
-    QProcess *minerProcess;
-
-    QMap<int, double> threadSpeed;
-
     QTimer *readTimer;
 
     int acceptedShares;
@@ -67,10 +60,9 @@ public slots:
 
     void minerStarted();
 
-    void minerError(QProcess::ProcessError);
     void minerFinished();
 
-    void readProcessOutput();
+    void poolMiningEvent(int event, const QString &message);
 
     QString getTime(QString);
     void enableMiningControls(bool enable);
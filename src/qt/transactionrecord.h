@@ -117,6 +117,11 @@ public:
     /** Return the unique identifier for this transaction (part) */
     std::string getTxID();
 
+    /** Update the sort key from the block the core wallet tx is in. Cheap
+        enough to keep current for every record, unlike the full status.
+     */
+    void updateSortKey(const CWalletTx &wtx);
+
     /** Update status from core wallet tx.
      */
     void updateStatus(const CWalletTx &wtx);
@@ -14,10 +14,8 @@
 #include <QLocale>
 #include <QList>
 #include <QColor>
-#include <QTimer>
 #include <QIcon>
 #include <QDateTime>
-#include <QtAlgorithms>
 
 // Amount column is right-aligned it contains numbers
 static int column_alignments[] = {
@@ -28,22 +26,8 @@ static int column_alignments[] = {
         Qt::AlignRight|Qt::AlignVCenter
     };
 
-// Comparison operator for sort/binary search of model tx list
-struct TxLessThan
-{
-    bool operator()(const TransactionRecord &a, const TransactionRecord &b) const
-    {
-        return a.hash < b.hash;
-    }
-    bool operator()(const TransactionRecord &a, const uint256 &b) const
-    {
-        return a.hash < b;
-    }
-    bool operator()(const uint256 &a, const TransactionRecord &b) const
-    {
-        return a < b.hash;
-    }
-};
+// Transactions decomposed per page by the loader thread
+static const int LOAD_PAGE_SIZE = 1000;
 
 // Private implementation
 class TransactionTablePriv
@@ -51,34 +35,137 @@ class TransactionTablePriv
 public:
     TransactionTablePriv(CWallet *wallet, TransactionTableModel *parent):
             wallet(wallet),
-            parent(parent)
+            parent(parent),
+            nNextSeq(0),
+            fStopLoading(false)
+    {
+    }
+    ~TransactionTablePriv()
     {
+        fStopLoading = true;
+        if(loader.joinable())
+            loader.join();
     }
     CWallet *wallet;
     TransactionTableModel *parent;
 
     /* Local cache of wallet.
-     * As it is in the same order as the CWallet, by definition
-     * this is sorted by sha256.
+     * Filled newest first by the loader thread, transactions that arrive
+     * later are appended. The records of one transaction are adjacent.
      */
     QList<TransactionRecord> cachedWallet;
-
-    /* Query entire wallet anew from core.
+    /* Sequence number of each row of cachedWallet. Numbers are handed out
+     * in increasing order as records are appended, so they stay sorted and
+     * removing rows never renumbers the others.
+     */
+    std::vector<int> vRowSeq;
+    int nNextSeq;
+    /* Sequence number of the first record of each transaction */
+    std::map<uint256, int> mapSeq;
+
+    /* Pages decomposed by the loader, waiting to be added to the model */
+    boost::thread loader;
+    boost::mutex mutexLoaded;
+    QList<TransactionRecord> loadedRecords;
+    volatile bool fStopLoading;
+
+    /* Start filling the model from the wallet in the background.
      */
     void refreshWallet()
     {
         OutputDebugStringF("refreshWallet\n");
         cachedWallet.clear();
+        vRowSeq.clear();
+        mapSeq.clear();
+        loader = boost::thread(boost::bind(&TransactionTablePriv::loadWallet, this));
+    }
+
+    /* Loader thread: decompose the wallet a page at a time, newest
+     * transactions first, so that cs_wallet is never held for long and the
+     * recent history shows up right away.
+     */
+    void loadWallet()
+    {
+        std::vector<std::pair<int64, uint256> > vOrdered;
         {
             LOCK(wallet->cs_wallet);
+            vOrdered.reserve(wallet->mapWallet.size());
             for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
+                vOrdered.push_back(std::make_pair(it->second.GetTxTime(), it->first));
+        }
+        std::sort(vOrdered.rbegin(), vOrdered.rend());
+
+        for(unsigned int nPage = 0; nPage < vOrdered.size() && !fStopLoading; nPage += LOAD_PAGE_SIZE)
+        {
+            QList<TransactionRecord> page;
             {
-                if(TransactionRecord::showTransaction(it->second))
-                    cachedWallet.append(TransactionRecord::decomposeTransaction(wallet, it->second));
+                LOCK2(cs_main, wallet->cs_wallet);
+                for(unsigned int i = nPage; i < vOrdered.size() && i < nPage + LOAD_PAGE_SIZE; i++)
+                {
+                    std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(vOrdered[i].second);
+                    if(mi != wallet->mapWallet.end() && TransactionRecord::showTransaction(mi->second))
+                        page.append(TransactionRecord::decomposeTransaction(wallet, mi->second));
+                }
+            }
+            {
+                boost::mutex::scoped_lock lock(mutexLoaded);
+                loadedRecords.append(page);
             }
+            QMetaObject::invokeMethod(parent, "fetchLoaded", Qt::QueuedConnection);
         }
     }
 
+    /* Add the pages the loader has finished to the model. Transactions that
+     * changed meanwhile have been handled by updateWallet already, they are
+     * skipped.
+     */
+    void fetchLoaded()
+    {
+        QList<TransactionRecord> loaded;
+        {
+            boost::mutex::scoped_lock lock(mutexLoaded);
+            loaded.swap(loadedRecords);
+        }
+
+        QList<TransactionRecord> toInsert;
+        {
+            LOCK(wallet->cs_wallet);
+            foreach(const TransactionRecord &rec, loaded)
+            {
+                if(mapSeq.count(rec.hash))
+                    continue;
+                std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec.hash);
+                if(mi != wallet->mapWallet.end() && TransactionRecord::showTransaction(mi->second))
+                    toInsert.append(rec);
+            }
+        }
+        appendRecords(toInsert);
+    }
+
+    void appendRecords(const QList<TransactionRecord> &toInsert)
+    {
+        if(toInsert.isEmpty())
+            return;
+        parent->beginInsertRows(QModelIndex(), cachedWallet.size(), cachedWallet.size()+toInsert.size()-1);
+        foreach(const TransactionRecord &rec, toInsert)
+        {
+            if(!mapSeq.count(rec.hash))
+                mapSeq[rec.hash] = nNextSeq;
+            vRowSeq.push_back(nNextSeq++);
+            cachedWallet.append(rec);
+        }
+        parent->endInsertRows();
+    }
+
+    /* Row of the first record of a transaction, -1 if it is not in the model */
+    int findRow(const uint256 &hash)
+    {
+        std::map<uint256, int>::iterator it = mapSeq.find(hash);
+        if(it == mapSeq.end())
+            return -1;
+        return std::lower_bound(vRowSeq.begin(), vRowSeq.end(), it->second) - vRowSeq.begin();
+    }
+
     /* Update our model of the wallet incrementally, to synchronize our model of the wallet
        with that of the core.
 
@@ -88,20 +175,19 @@ public:
     {
         OutputDebugStringF("updateWallet %s %i\n", hash.ToString().c_str(), status);
         {
-            LOCK(wallet->cs_wallet);
+            LOCK2(cs_main, wallet->cs_wallet);
 
             // Find transaction in wallet
             std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(hash);
             bool inWallet = mi != wallet->mapWallet.end();
 
             // Find bounds of this transaction in model
-            QList<TransactionRecord>::iterator lower = qLowerBound(
-                cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
-            QList<TransactionRecord>::iterator upper = qUpperBound(
-                cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
-            int lowerIndex = (lower - cachedWallet.begin());
-            int upperIndex = (upper - cachedWallet.begin());
-            bool inModel = (lower != upper);
+            int nRow = findRow(hash);
+            bool inModel = (nRow >= 0);
+            int lowerIndex = inModel ? nRow : cachedWallet.size();
+            int upperIndex = lowerIndex;
+            while(upperIndex < cachedWallet.size() && cachedWallet[upperIndex].hash == hash)
+                upperIndex++;
 
             // Determine whether to show transaction or not
             bool showTransaction = (inWallet && TransactionRecord::showTransaction(mi->second));
@@ -132,20 +218,8 @@ public:
                 }
                 if(showTransaction)
                 {
-                    // Added -- insert at the right position
-                    QList<TransactionRecord> toInsert =
-                            TransactionRecord::decomposeTransaction(wallet, mi->second);
-                    if(!toInsert.isEmpty()) /* only if something to insert */
-                    {
-                        parent->beginInsertRows(QModelIndex(), lowerIndex, lowerIndex+toInsert.size()-1);
-                        int insert_idx = lowerIndex;
-                        foreach(const TransactionRecord &rec, toInsert)
-                        {
-                            cachedWallet.insert(insert_idx, rec);
-                            insert_idx += 1;
-                        }
-                        parent->endInsertRows();
-                    }
+                    // Added -- append, the view sorts
+                    appendRecords(TransactionRecord::decomposeTransaction(wallet, mi->second));
                 }
                 break;
             case CT_DELETED:
@@ -156,12 +230,21 @@ public:
                 }
                 // Removed -- remove entire transaction from table
                 parent->beginRemoveRows(QModelIndex(), lowerIndex, upperIndex-1);
-                cachedWallet.erase(lower, upper);
+                cachedWallet.erase(cachedWallet.begin() + lowerIndex, cachedWallet.begin() + upperIndex);
+                vRowSeq.erase(vRowSeq.begin() + lowerIndex, vRowSeq.begin() + upperIndex);
+                mapSeq.erase(hash);
                 parent->endRemoveRows();
                 break;
             case CT_UPDATED:
-                // Miscellaneous updates -- nothing to do, status update will take care of this, and is only computed for
-                // visible transactions.
+                // The transaction may have entered or left a block, refresh the sort key so sorting by status
+                // stays right. The rest of the status is only computed for visible transactions.
+                if(inModel)
+                {
+                    for(int i = lowerIndex; i < upperIndex; i++)
+                        cachedWallet[i].updateSortKey(mi->second);
+                    emit parent->dataChanged(parent->index(lowerIndex, TransactionTableModel::Status),
+                                             parent->index(upperIndex-1, TransactionTableModel::Status));
+                }
                 break;
             }
         }
@@ -175,36 +258,33 @@ public:
     TransactionRecord *index(int idx)
     {
         if(idx >= 0 && idx < cachedWallet.size())
+            return &cachedWallet[idx];
+        else
+            return 0;
+    }
+
+    /* Bring the status of a record up to date. It is computed only when
+     * shown and kept until the next block. The sort key is kept current
+     * apart from it, so sorting and filtering never touch the wallet.
+     */
+    void updateStatus(TransactionRecord *rec)
+    {
+        if(rec->statusUpdateNeeded())
         {
-            TransactionRecord *rec = &cachedWallet[idx];
+            LOCK2(cs_main, wallet->cs_wallet);
+            std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
 
-            // If a status update is needed (blocks came in since last check),
-            //  update the status of this transaction from the wallet. Otherwise,
-            // simply re-use the cached status.
-            if(rec->statusUpdateNeeded())
+            if(mi != wallet->mapWallet.end())
             {
-                {
-                    LOCK(wallet->cs_wallet);
-                    std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
-
-                    if(mi != wallet->mapWallet.end())
-                    {
-                        rec->updateStatus(mi->second);
-                    }
-                }
+                rec->updateStatus(mi->second);
             }
-            return rec;
-        }
-        else
-        {
-            return 0;
         }
     }
 
     QString describe(TransactionRecord *rec)
     {
         {
-            LOCK(wallet->cs_wallet);
+            LOCK2(cs_main, wallet->cs_wallet);
             std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
             if(mi != wallet->mapWallet.end())
             {
@@ -227,10 +307,6 @@ TransactionTableModel::TransactionTableModel(CWallet* wallet, WalletModel *paren
 
     priv->refreshWallet();
 
-    QTimer *timer = new QTimer(this);
-    connect(timer, SIGNAL(timeout()), this, SLOT(updateConfirmations()));
-    timer->start(MODEL_UPDATE_DELAY);
-
     connect(walletModel->getOptionsModel(), SIGNAL(displayUnitChanged(int)), this, SLOT(updateDisplayUnit()));
 }
 
@@ -247,6 +323,11 @@ void TransactionTableModel::updateTransaction(const QString &hash, int status)
     priv->updateWallet(updated, status);
 }
 
+void TransactionTableModel::fetchLoaded()
+{
+    priv->fetchLoaded();
+}
+
 void TransactionTableModel::updateConfirmations()
 {
     if(nBestHeight != cachedNumBlocks)
@@ -492,11 +573,31 @@ QString TransactionTableModel::formatTooltip(const TransactionRecord *rec) const
     return tooltip;
 }
 
+// Whether a role shows the confirmation status of a transaction
+static bool roleNeedsStatus(int column, int role)
+{
+    switch(role)
+    {
+    case Qt::DecorationRole:
+        return column == TransactionTableModel::Status;
+    case Qt::DisplayRole:
+        return column == TransactionTableModel::Amount;
+    case Qt::ToolTipRole:
+    case Qt::ForegroundRole:
+    case TransactionTableModel::ConfirmedRole:
+    case TransactionTableModel::FormattedAmountRole:
+        return true;
+    }
+    return false;
+}
+
 QVariant TransactionTableModel::data(const QModelIndex &index, int role) const
 {
     if(!index.isValid())
         return QVariant();
     TransactionRecord *rec = static_cast<TransactionRecord*>(index.internalPointer());
+    if(roleNeedsStatus(index.column(), role))
+        priv->updateStatus(rec);
 
     switch(role)
     {
@@ -618,7 +719,7 @@ QModelIndex TransactionTableModel::index(int row, int column, const QModelIndex
     TransactionRecord *data = priv->index(row);
     if(data)
     {
-        return createIndex(row, column, priv->index(row));
+        return createIndex(row, column, data);
     }
     else
     {
@@ -77,6 +77,8 @@ public slots:
     void updateTransaction(const QString &hash, int status);
     void updateConfirmations();
     void updateDisplayUnit();
+    /* Add transactions the background loader has decomposed */
+    void fetchLoaded();
 
     friend class TransactionTablePriv;
 };
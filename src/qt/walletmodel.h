@@ -2,6 +2,7 @@
 #define WALLETMODEL_H
 
 #include <QObject>
+#include <QAtomicInt>
 
 #include "allocators.h" /* for SecureString */
 
@@ -124,9 +125,11 @@ private:
     qint64 cachedImmatureBalance;
     qint64 cachedNumTransactions;
     EncryptionStatus cachedEncryptionStatus;
-    int cachedNumBlocks;
 
+    // Balance checks are queued by core notifications and run once per
+    // MODEL_UPDATE_DELAY at most, however many notifications arrive
     QTimer *pollTimer;
+    QAtomicInt balanceCheckQueued;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
@@ -159,6 +162,8 @@ public slots:
     void updateAddressBook(const QString &address, const QString &label, bool isMine, int status);
     /* Current, immature or unconfirmed balance might have changed - emit 'balanceChanged' if so */
     void pollBalanceChanged();
+    /* Schedule pollBalanceChanged, may be called from any thread */
+    void queueBalanceCheck();
 };
 
 
@@ -19,7 +19,11 @@ Value getconnectioncount(const Array& params, bool fHelp)
             "Returns the number of connections to other nodes.");
 
     LOCK(cs_vNodes);
-    return (int)vNodes.size();
+    int nCount = 0;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        if (!pnode->fConnecting)
+            nCount++;
+    return nCount;
 }
 
 static void CopyNodeStats(std::vector<CNodeStats>& vstats)
@@ -29,6 +33,8 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     LOCK(cs_vNodes);
     vstats.reserve(vNodes.size());
     BOOST_FOREACH(CNode* pnode, vNodes) {
+        if (pnode->fConnecting)
+            continue;
         CNodeStats stats;
         pnode->copyStats(stats);
         vstats.push_back(stats);
@@ -61,6 +67,7 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("releasetime", (boost::int64_t)stats.nReleaseTime));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("bytessent", (boost::int64_t)stats.nSendBytes));
 
         ret.push_back(obj);
     }
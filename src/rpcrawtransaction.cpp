@@ -143,7 +143,7 @@ Value getrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
-Value listunspent(const Array& params, bool fHelp)
+void ListUnspent(const Array& params, bool fHelp, CRPCResultWriter& writer)
 {
     if (fHelp || params.size() > 2)
         throw runtime_error(
@@ -163,9 +163,9 @@ Value listunspent(const Array& params, bool fHelp)
     if (params.size() > 1)
         nMaxDepth = params[1].get_int();
 
-    Array results;
     vector<COutput> vecOutputs;
     pwalletMain->AvailableCoins(vecOutputs, false);
+    writer.BeginArray();
     BOOST_FOREACH(const COutput& out, vecOutputs)
     {
         if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
@@ -179,10 +179,16 @@ Value listunspent(const Array& params, bool fHelp)
         entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
         entry.push_back(Pair("amount",ValueFromAmount(nValue)));
         entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        writer.Write(entry);
     }
+    writer.EndArray();
+}
 
-    return results;
+Value listunspent(const Array& params, bool fHelp)
+{
+    CRPCValueWriter writer;
+    ListUnspent(params, fHelp, writer);
+    return writer.GetValue();
 }
 
 Value createrawtransaction(const Array& params, bool fHelp)
@@ -5,6 +5,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/tuple/tuple.hpp>
 
 using namespace std;
@@ -1161,6 +1162,82 @@ public:
     }
 };
 
+// Parsed public key cache, to avoid decoding (and, for compressed keys,
+// decompressing) the same public key over and over again when one key
+// signs many inputs of a transaction or block.
+
+class CPubKeyCache
+{
+private:
+    typedef std::list<std::vector<unsigned char> > list_type;
+    typedef std::pair<boost::shared_ptr<CKey>, list_type::iterator> entry_type;
+    std::map<std::vector<unsigned char>, entry_type> mapKeys;
+    list_type listLRU; // most recently used at the front
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvictions;
+    CCriticalSection cs_pubkeycache;
+
+public:
+    CPubKeyCache() : nHits(0), nMisses(0), nEvictions(0) { }
+
+    boost::shared_ptr<CKey>
+    Get(const std::vector<unsigned char>& vchPubKey)
+    {
+        {
+            LOCK(cs_pubkeycache);
+            std::map<std::vector<unsigned char>, entry_type>::iterator mi = mapKeys.find(vchPubKey);
+            if (mi != mapKeys.end())
+            {
+                nHits++;
+                listLRU.splice(listLRU.begin(), listLRU, (*mi).second.second);
+                return (*mi).second.first;
+            }
+            nMisses++;
+        }
+
+        // Parse outside the lock, it's the expensive part
+        boost::shared_ptr<CKey> pkey(new CKey());
+        if (!pkey->SetPubKey(vchPubKey))
+            return boost::shared_ptr<CKey>();
+
+        int64 nMaxCacheSize = GetArg("-maxpubkeycachesize", 1000);
+        if (nMaxCacheSize <= 0)
+            return pkey;
+
+        LOCK(cs_pubkeycache);
+        if (mapKeys.count(vchPubKey))
+            return pkey; // another thread got here first
+        while (static_cast<int64>(mapKeys.size()) >= nMaxCacheSize)
+        {
+            mapKeys.erase(listLRU.back());
+            listLRU.pop_back();
+            nEvictions++;
+        }
+        listLRU.push_front(vchPubKey);
+        mapKeys.insert(make_pair(vchPubKey, entry_type(pkey, listLRU.begin())));
+        return pkey;
+    }
+
+    void
+    GetStats(CPubKeyCacheStats& stats)
+    {
+        LOCK(cs_pubkeycache);
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+        stats.nEvictions = nEvictions;
+        stats.nSize = mapKeys.size();
+        stats.nMaxSize = std::max((int64)0, GetArg("-maxpubkeycachesize", 1000));
+    }
+};
+
+static CPubKeyCache pubKeyCache;
+
+void GetPubKeyCacheStats(CPubKeyCacheStats& stats)
+{
+    pubKeyCache.GetStats(stats);
+}
+
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
@@ -1180,11 +1257,11 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
+    boost::shared_ptr<CKey> pkey = pubKeyCache.Get(vchPubKey);
+    if (!pkey)
         return false;
 
-    if (!key.Verify(sighash, vchSig))
+    if (!pkey->Verify(sighash, vchSig))
         return false;
 
     signatureCache.Set(sighash, vchSig, vchPubKey);
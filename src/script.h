@@ -599,6 +599,18 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                   bool fValidatePayToScriptHash, int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
 
+/** Counters of the parsed public key cache used by signature checking */
+struct CPubKeyCacheStats
+{
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvictions;
+    unsigned int nSize;
+    unsigned int nMaxSize;
+};
+
+void GetPubKeyCacheStats(CPubKeyCacheStats& stats);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
@@ -0,0 +1,648 @@
+// Copyright (c) 2013 AuroraCoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+#include "bignum.h"
+#include "netbase.h"
+#include "scrypt.h"
+#include "sync.h"
+#include "ui_interface.h"
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+#include "json/json_spirit_utils.h"
+
+#include <set>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+//
+// Stratum pool mining client. One thread talks to the pool (JSON-RPC
+// objects, one per line, over a plain TCP connection), the worker threads
+// scan nonces with scrypt on the latest job and hand shares to it.
+//
+
+static CCriticalSection cs_stratum;     // protects everything below except the socket
+static bool fPoolMining = false;
+static int nPoolThreadsRunning = 0;
+static string strPoolServer;
+static int nPoolPort = 0;
+static string strPoolUser;
+static string strPoolPassword;
+static int nPoolScanTime = 60;
+
+static CStratumJob poolJob;
+static int nPoolJobSerial = 0;          // changes whenever workers have to restart their scan
+static vector<unsigned char> vchPoolExtraNonce1;
+static unsigned int nPoolExtraNonce2Size = 0;
+static uint64 nPoolExtraNonce2 = 0;     // next extranonce2 to give to a worker
+static uint256 hashPoolTarget;
+static set<int> setPendingShares;       // ids of submitted shares without an answer
+static CPoolMiningStats poolStats;
+static int64 nPoolHPSTimerStart = 0;
+static int64 nPoolHashCounter = 0;
+
+static CCriticalSection cs_stratumSend; // protects the socket and the request ids
+static SOCKET hPoolSocket = INVALID_SOCKET;
+static int nPoolRequestId = 0;
+static int nSubscribeId = -1;
+static int nAuthorizeId = -1;
+
+
+uint256 CStratumJob::GetMerkleRoot(const vector<unsigned char>& vchExtraNonce1, const vector<unsigned char>& vchExtraNonce2) const
+{
+    vector<unsigned char> vchCoinbase(vchCoinbase1);
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce1.begin(), vchExtraNonce1.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchCoinbase2.begin(), vchCoinbase2.end());
+
+    uint256 hash = Hash(vchCoinbase.begin(), vchCoinbase.end());
+    BOOST_FOREACH(const uint256& hashBranch, vMerkleBranch)
+        hash = Hash(BEGIN(hash), END(hash), BEGIN(hashBranch), END(hashBranch));
+    return hash;
+}
+
+void CStratumJob::BuildHeader(const uint256& hashMerkleRoot, unsigned int nNonce, unsigned char* pheader) const
+{
+    memcpy(pheader, &nVersion, 4);
+    for (int i = 0; i < 32; i++)
+        pheader[4 + i] = vchPrevHash[(i & ~3) + 3 - (i & 3)];
+    memcpy(pheader + 36, &hashMerkleRoot, 32);
+    memcpy(pheader + 68, &nTime, 4);
+    memcpy(pheader + 72, &nBits, 4);
+    memcpy(pheader + 76, &nNonce, 4);
+}
+
+uint256 StratumDifficultyToTarget(double dDifficulty)
+{
+    // Divide with 32 bits of fraction, so difficulties below 1 work too
+    double dDivisor = dDifficulty * 4294967296.0;
+    if (dDivisor < 1.0)
+        return ~uint256(0);
+    CBigNum bnTarget = CBigNum(0xffff) << 224;
+    if (dDivisor < 1.8e19)
+    {
+        bnTarget <<= 32;
+        bnTarget /= CBigNum((uint64)dDivisor);
+    }
+    else
+        bnTarget /= CBigNum((uint64)dDifficulty);
+    if (bnTarget > CBigNum(~uint256(0)))
+        return ~uint256(0);
+    return bnTarget.getuint256();
+}
+
+static void PoolEvent(int nEvent, const string& strMessage)
+{
+    // Jobs and shares arrive every few seconds, only log them with -debug=mining
+    if (nEvent == POOL_NEWJOB || nEvent == POOL_NEWBLOCK || nEvent == POOL_SHARE_ACCEPTED || nEvent == POOL_SHARE_REJECTED)
+        LogPrint(LOG_MINING, "stratum: %s\n", strMessage.c_str());
+    else
+        printf("stratum: %s\n", strMessage.c_str());
+    if (nEvent == POOL_ERROR)
+    {
+        LOCK(cs_stratum);
+        poolStats.strLastError = strMessage;
+    }
+    uiInterface.NotifyPoolMining(nEvent, strMessage);
+}
+
+// Each pool thread calls this as it exits. The last one out after
+// StopPoolMining reports the stop.
+static void PoolThreadExited()
+{
+    {
+        LOCK(cs_stratum);
+        if (--nPoolThreadsRunning > 0 || fPoolMining)
+            return;
+        poolStats.fRunning = false;
+        poolStats.fConnected = false;
+        poolStats.dHashesPerSec = 0;
+    }
+    PoolEvent(POOL_STOPPED, "Pool mining stopped");
+}
+
+static bool PoolMiningRunning()
+{
+    return fPoolMining && !fShutdown;
+}
+
+// Returns the request id, or -1 if it couldn't be sent
+static int SendPoolRequest(const string& strMethod, const Array& params, bool fShare = false)
+{
+    LOCK(cs_stratumSend);
+    if (hPoolSocket == INVALID_SOCKET)
+        return -1;
+
+    int nId = ++nPoolRequestId;
+    if (fShare)
+    {
+        LOCK(cs_stratum);
+        setPendingShares.insert(nId);
+    }
+    Object request;
+    request.push_back(Pair("id", nId));
+    request.push_back(Pair("method", strMethod));
+    request.push_back(Pair("params", params));
+    string strRequest = write_string(Value(request), false) + "\n";
+
+    const char* psz = strRequest.data();
+    const char* pszEnd = psz + strRequest.size();
+    while (psz < pszEnd)
+    {
+        int nBytes = send(hPoolSocket, psz, pszEnd - psz, MSG_NOSIGNAL);
+        if (nBytes > 0)
+        {
+            psz += nBytes;
+            continue;
+        }
+        int nErr = WSAGetLastError();
+        if (nBytes < 0 && (nErr == WSAEWOULDBLOCK || nErr == WSAEINTR || nErr == WSAEINPROGRESS))
+        {
+            struct timeval timeout;
+            timeout.tv_sec = 10;
+            timeout.tv_usec = 0;
+            fd_set fdsetSend;
+            FD_ZERO(&fdsetSend);
+            FD_SET(hPoolSocket, &fdsetSend);
+            if (select(hPoolSocket + 1, NULL, &fdsetSend, NULL, &timeout) > 0)
+                continue;
+        }
+        printf("stratum: send failed: %d\n", nErr);
+        return -1;
+    }
+    return nId;
+}
+
+static void SubmitShare(const CStratumJob& job, const vector<unsigned char>& vchExtraNonce2, unsigned int nNonce)
+{
+    Array params;
+    params.push_back(strPoolUser);
+    params.push_back(job.strJobId);
+    params.push_back(HexStr(vchExtraNonce2));
+    params.push_back(strprintf("%08x", job.nTime));
+    params.push_back(strprintf("%08x", nNonce));
+    if (SendPoolRequest("mining.submit", params, true) < 0)
+        PoolEvent(POOL_ERROR, "Couldn't submit share");
+}
+
+static bool ParseHexUInt(const Value& value, unsigned int& n)
+{
+    if (value.type() != str_type || value.get_str().size() != 8 || !IsHex(value.get_str()))
+        return false;
+    n = strtoul(value.get_str().c_str(), NULL, 16);
+    return true;
+}
+
+static bool ParseHexBytes(const Value& value, vector<unsigned char>& vch)
+{
+    if (value.type() != str_type || (value.get_str().size() != 0 && !IsHex(value.get_str())))
+        return false;
+    vch = ParseHex(value.get_str());
+    return true;
+}
+
+static bool ParseJob(const Array& params, CStratumJob& job)
+{
+    if (params.size() < 9 || params[0].type() != str_type || params[4].type() != array_type)
+        return false;
+    job.strJobId = params[0].get_str();
+    if (!ParseHexBytes(params[1], job.vchPrevHash) || job.vchPrevHash.size() != 32)
+        return false;
+    if (!ParseHexBytes(params[2], job.vchCoinbase1) || !ParseHexBytes(params[3], job.vchCoinbase2))
+        return false;
+    job.vMerkleBranch.clear();
+    BOOST_FOREACH(const Value& value, params[4].get_array())
+    {
+        vector<unsigned char> vch;
+        if (!ParseHexBytes(value, vch) || vch.size() != 32)
+            return false;
+        job.vMerkleBranch.push_back(uint256(vch));
+    }
+    if (!ParseHexUInt(params[5], job.nVersion) || !ParseHexUInt(params[6], job.nBits) || !ParseHexUInt(params[7], job.nTime))
+        return false;
+    job.fClean = params[8].type() == bool_type && params[8].get_bool();
+    return !job.strJobId.empty();
+}
+
+static double GetNumber(const Value& value)
+{
+    if (value.type() == int_type)
+        return (double)value.get_int64();
+    if (value.type() == real_type)
+        return value.get_real();
+    return 0;
+}
+
+// Returns false if the connection should be dropped
+static bool ProcessPoolMessage(const string& strLine)
+{
+    Value valMessage;
+    if (!read_string(strLine, valMessage) || valMessage.type() != obj_type)
+    {
+        PoolEvent(POOL_ERROR, "Invalid message from pool");
+        return false;
+    }
+    const Object& message = valMessage.get_obj();
+    const Value& method = find_value(message, "method");
+    const Value& valParams = find_value(message, "params");
+    const Value& id = find_value(message, "id");
+    const Value& result = find_value(message, "result");
+    const Value& error = find_value(message, "error");
+    Array params;
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+
+    if (method.type() == str_type)
+    {
+        const string& strMethod = method.get_str();
+        if (strMethod == "mining.notify")
+        {
+            CStratumJob job;
+            if (!ParseJob(params, job))
+            {
+                PoolEvent(POOL_ERROR, "Invalid job from pool");
+                return false;
+            }
+            {
+                LOCK(cs_stratum);
+                poolJob = job;
+                nPoolJobSerial++;
+                poolStats.strJobId = job.strJobId;
+            }
+            PoolEvent(job.fClean ? POOL_NEWBLOCK : POOL_NEWJOB, strprintf("New job %s", job.strJobId.c_str()));
+        }
+        else if (strMethod == "mining.set_difficulty")
+        {
+            double dDifficulty = params.size() > 0 ? GetNumber(params[0]) : 0;
+            if (dDifficulty <= 0)
+            {
+                PoolEvent(POOL_ERROR, "Invalid difficulty from pool");
+                return false;
+            }
+            {
+                LOCK(cs_stratum);
+                hashPoolTarget = StratumDifficultyToTarget(dDifficulty);
+                poolStats.dDifficulty = dDifficulty;
+                nPoolJobSerial++;
+            }
+            LogPrint(LOG_MINING, "stratum: difficulty %g\n", dDifficulty);
+        }
+        else if (strMethod == "client.show_message" && params.size() > 0 && params[0].type() == str_type)
+            printf("stratum: message from pool: %s\n", params[0].get_str().c_str());
+        else
+            LogPrint(LOG_MINING, "stratum: ignoring %s\n", strMethod.c_str());
+        return true;
+    }
+
+    if (id.type() != int_type)
+        return true;
+    int nId = id.get_int();
+    if (nId == nSubscribeId)
+    {
+        // [[subscriptions...], extranonce1, extranonce2_size]
+        vector<unsigned char> vchExtraNonce1;
+        if (result.type() != array_type || result.get_array().size() < 3 ||
+            !ParseHexBytes(result.get_array()[1], vchExtraNonce1) || result.get_array()[2].type() != int_type)
+        {
+            PoolEvent(POOL_ERROR, "Pool refused subscription");
+            return false;
+        }
+        int nSize = result.get_array()[2].get_int();
+        if (nSize < 1 || nSize > 8)
+        {
+            PoolEvent(POOL_ERROR, "Unsupported extranonce2 size");
+            return false;
+        }
+        {
+            LOCK(cs_stratum);
+            vchPoolExtraNonce1 = vchExtraNonce1;
+            nPoolExtraNonce2Size = nSize;
+            nPoolExtraNonce2 = 0;
+            poolStats.fConnected = true;
+        }
+        PoolEvent(POOL_CONNECTED, strprintf("Connected to %s:%d", strPoolServer.c_str(), nPoolPort));
+    }
+    else if (nId == nAuthorizeId)
+    {
+        if (result.type() != bool_type || !result.get_bool())
+            PoolEvent(POOL_ERROR, strprintf("Pool did not accept worker %s, check the username and password", strPoolUser.c_str()));
+    }
+    else
+    {
+        bool fAccepted = result.type() == bool_type && result.get_bool();
+        {
+            LOCK(cs_stratum);
+            if (!setPendingShares.erase(nId))
+                return true;
+            if (fAccepted)
+                poolStats.nAccepted++;
+            else
+                poolStats.nRejected++;
+        }
+        if (fAccepted)
+            PoolEvent(POOL_SHARE_ACCEPTED, "Share accepted");
+        else
+        {
+            string strReason;
+            if (error.type() == array_type && error.get_array().size() > 1 && error.get_array()[1].type() == str_type)
+                strReason = ": " + error.get_array()[1].get_str();
+            PoolEvent(POOL_SHARE_REJECTED, "Share rejected" + strReason);
+        }
+    }
+    return true;
+}
+
+static void PoolConnection(SOCKET hSocket)
+{
+    {
+        LOCK(cs_stratumSend);
+        hPoolSocket = hSocket;
+    }
+
+    Array params;
+    params.push_back("AuroraCoin/" + FormatFullVersion());
+    nSubscribeId = SendPoolRequest("mining.subscribe", params);
+    params.clear();
+    params.push_back(strPoolUser);
+    params.push_back(strPoolPassword);
+    nAuthorizeId = SendPoolRequest("mining.authorize", params);
+
+    string strBuffer;
+    while (PoolMiningRunning() && nSubscribeId >= 0 && nAuthorizeId >= 0)
+    {
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 200000;
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        FD_SET(hSocket, &fdsetRecv);
+        int nSelect = select(hSocket + 1, &fdsetRecv, NULL, NULL, &timeout);
+        if (nSelect == 0)
+            continue;
+        if (nSelect == SOCKET_ERROR)
+            break;
+
+        char pchBuf[0x10000];
+        int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nBytes == 0)
+        {
+            PoolEvent(POOL_ERROR, "Pool closed the connection");
+            break;
+        }
+        if (nBytes < 0)
+        {
+            int nErr = WSAGetLastError();
+            if (nErr == WSAEWOULDBLOCK || nErr == WSAEMSGSIZE || nErr == WSAEINTR || nErr == WSAEINPROGRESS)
+                continue;
+            PoolEvent(POOL_ERROR, strprintf("Connection to pool failed: %d", nErr));
+            break;
+        }
+        strBuffer.append(pchBuf, nBytes);
+
+        size_t nPos;
+        bool fDrop = false;
+        while (!fDrop && (nPos = strBuffer.find('\n')) != string::npos)
+        {
+            string strLine = strBuffer.substr(0, nPos);
+            strBuffer.erase(0, nPos + 1);
+            if (strLine.find_first_not_of(" \r\t") != string::npos)
+                fDrop = !ProcessPoolMessage(strLine);
+        }
+        if (fDrop)
+            break;
+        if (strBuffer.size() > 1000000)
+        {
+            PoolEvent(POOL_ERROR, "Message from pool too large");
+            break;
+        }
+    }
+
+    {
+        LOCK(cs_stratumSend);
+        closesocket(hPoolSocket);
+        hPoolSocket = INVALID_SOCKET;
+    }
+    {
+        LOCK(cs_stratum);
+        // Stop the workers until there is new work
+        poolJob = CStratumJob();
+        nPoolJobSerial++;
+        setPendingShares.clear();
+        poolStats.fConnected = false;
+    }
+}
+
+static void ThreadPoolClient(void* parg)
+{
+    RenameThread("bitcoin-stratum");
+    try
+    {
+        while (PoolMiningRunning())
+        {
+            CService addrConnect;
+            SOCKET hSocket;
+            if (ConnectSocketByName(addrConnect, hSocket, strPoolServer.c_str(), nPoolPort))
+                PoolConnection(hSocket);
+            else
+                PoolEvent(POOL_ERROR, strprintf("Couldn't connect to %s:%d", strPoolServer.c_str(), nPoolPort));
+
+            // Retry every 10 seconds
+            for (int i = 0; i < 100 && PoolMiningRunning(); i++)
+                Sleep(100);
+        }
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadPoolClient()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadPoolClient()");
+    }
+    PoolThreadExited();
+}
+
+static void PoolMiner()
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+
+    while (PoolMiningRunning())
+    {
+        CStratumJob job;
+        vector<unsigned char> vchExtraNonce1;
+        vector<unsigned char> vchExtraNonce2;
+        uint256 hashTarget;
+        int nSerial;
+        {
+            LOCK(cs_stratum);
+            if (!poolJob.IsNull() && nPoolExtraNonce2Size > 0 && hashPoolTarget != 0)
+            {
+                job = poolJob;
+                vchExtraNonce1 = vchPoolExtraNonce1;
+                hashTarget = hashPoolTarget;
+                nSerial = nPoolJobSerial;
+
+                // Each scan gets its own extranonce2, so the workers never
+                // hash the same header twice
+                uint64 n = nPoolExtraNonce2++;
+                for (unsigned int i = 0; i < nPoolExtraNonce2Size; i++, n >>= 8)
+                    vchExtraNonce2.push_back(n & 0xff);
+            }
+        }
+        if (job.IsNull())
+        {
+            Sleep(100);
+            continue;
+        }
+
+        unsigned char header[80];
+        job.BuildHeader(job.GetMerkleRoot(vchExtraNonce1, vchExtraNonce2), 0, header);
+        int64 nStart = GetTime();
+        unsigned int nNonce = 0;
+        loop
+        {
+            uint256 hash;
+            for (int i = 0; i < 0x100; i++, nNonce++)
+            {
+                memcpy(header + 76, &nNonce, 4);
+                scrypt_1024_1_1_256_sp((const char*)header, BEGIN(hash), scratchpad);
+                if (hash <= hashTarget)
+                    SubmitShare(job, vchExtraNonce2, nNonce);
+            }
+
+            // Meter hashes/sec, and check whether the work is still current
+            {
+                LOCK(cs_stratum);
+                int64 nNow = GetTimeMillis();
+                nPoolHashCounter += 0x100;
+                if (nPoolHPSTimerStart == 0)
+                {
+                    nPoolHPSTimerStart = nNow;
+                    nPoolHashCounter = 0;
+                }
+                else if (nNow - nPoolHPSTimerStart > 4000)
+                {
+                    poolStats.dHashesPerSec = 1000.0 * nPoolHashCounter / (nNow - nPoolHPSTimerStart);
+                    nPoolHPSTimerStart = nNow;
+                    nPoolHashCounter = 0;
+                }
+                if (nSerial != nPoolJobSerial)
+                    break;
+            }
+            if (!PoolMiningRunning() || nNonce == 0 || GetTime() - nStart > nPoolScanTime)
+                break;
+        }
+    }
+}
+
+static void ThreadPoolMiner(void* parg)
+{
+    RenameThread("bitcoin-poolminer");
+    try
+    {
+        PoolMiner();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadPoolMiner()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadPoolMiner()");
+    }
+    PoolThreadExited();
+}
+
+bool StartPoolMining(const string& strServer, int nPort, const string& strUser, const string& strPassword, int nThreads, int nScanTime)
+{
+    if (nThreads < 1)
+        nThreads = 1;
+    {
+        LOCK(cs_stratum);
+        if (fPoolMining || nPoolThreadsRunning > 0)
+            return false;
+        fPoolMining = true;
+        strPoolServer = strServer;
+        nPoolPort = nPort;
+        strPoolUser = strUser;
+        strPoolPassword = strPassword;
+        nPoolScanTime = max(nScanTime, 1);
+
+        poolJob = CStratumJob();
+        vchPoolExtraNonce1.clear();
+        nPoolExtraNonce2Size = 0;
+        hashPoolTarget = StratumDifficultyToTarget(1.0);
+        setPendingShares.clear();
+        nPoolHPSTimerStart = 0;
+
+        poolStats = CPoolMiningStats();
+        poolStats.fRunning = true;
+        poolStats.fConnected = false;
+        poolStats.strServer = strprintf("%s:%d", strServer.c_str(), nPort);
+        poolStats.strUser = strUser;
+        poolStats.dDifficulty = 1.0;
+        poolStats.nThreads = nThreads;
+        poolStats.dHashesPerSec = 0;
+        poolStats.nAccepted = 0;
+        poolStats.nRejected = 0;
+    }
+
+    PoolEvent(POOL_STARTED, strprintf("Pool mining on %s:%d with %d thread(s)", strServer.c_str(), nPort, nThreads));
+    for (int i = 0; i <= nThreads; i++)
+    {
+        {
+            LOCK(cs_stratum);
+            nPoolThreadsRunning++;
+        }
+        if (!CreateThread(i == 0 ? ThreadPoolClient : ThreadPoolMiner, NULL))
+        {
+            printf("Error: CreateThread(ThreadPool%s) failed\n", i == 0 ? "Client" : "Miner");
+            LOCK(cs_stratum);
+            nPoolThreadsRunning--;
+        }
+    }
+    return true;
+}
+
+void StopPoolMining(bool fWait)
+{
+    bool fStopped = false;
+    {
+        LOCK(cs_stratum);
+        if (fPoolMining)
+        {
+            fPoolMining = false;
+
+            // Otherwise the last thread to exit reports the stop
+            if (nPoolThreadsRunning == 0)
+            {
+                poolStats.fRunning = false;
+                poolStats.fConnected = false;
+                poolStats.dHashesPerSec = 0;
+                fStopped = true;
+            }
+        }
+    }
+    if (fStopped)
+        PoolEvent(POOL_STOPPED, "Pool mining stopped");
+    if (!fWait)
+        return;
+
+    // Also waits for threads an earlier StopPoolMining(false) left running.
+    // Workers notice within a few hundred hashes, the client within 200ms
+    for (int i = 0; i < 200; i++)
+    {
+        {
+            LOCK(cs_stratum);
+            if (nPoolThreadsRunning == 0)
+                break;
+        }
+        Sleep(50);
+    }
+}
+
+void GetPoolMiningStats(CPoolMiningStats& stats)
+{
+    LOCK(cs_stratum);
+    stats = poolStats;
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2013 AuroraCoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include <string>
+#include <vector>
+
+#include "uint256.h"
+#include "util.h"
+
+/** Work for pool mining, from a stratum mining.notify message */
+class CStratumJob
+{
+public:
+    std::string strJobId;
+    std::vector<unsigned char> vchPrevHash; // as sent, the 4 byte words are byte swapped
+    std::vector<unsigned char> vchCoinbase1;
+    std::vector<unsigned char> vchCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+    unsigned int nVersion;
+    unsigned int nBits;
+    unsigned int nTime;
+    bool fClean;
+
+    CStratumJob()
+    {
+        nVersion = 0;
+        nBits = 0;
+        nTime = 0;
+        fClean = false;
+    }
+
+    bool IsNull() const { return strJobId.empty(); }
+
+    // Merkle root of the block with the given extranonces in its coinbase
+    uint256 GetMerkleRoot(const std::vector<unsigned char>& vchExtraNonce1, const std::vector<unsigned char>& vchExtraNonce2) const;
+
+    // Serialized 80 byte block header
+    void BuildHeader(const uint256& hashMerkleRoot, unsigned int nNonce, unsigned char* pheader) const;
+};
+
+/** Share target for a stratum difficulty. Difficulty 1 is the scrypt
+ *  pools' convention of 0x0000ffff00...00. */
+uint256 StratumDifficultyToTarget(double dDifficulty);
+
+/** Events reported through uiInterface.NotifyPoolMining */
+enum PoolMiningEvent
+{
+    POOL_STARTED,
+    POOL_CONNECTED,
+    POOL_NEWJOB,
+    POOL_NEWBLOCK,          // a job that starts work on a new block
+    POOL_SHARE_ACCEPTED,
+    POOL_SHARE_REJECTED,
+    POOL_ERROR,
+    POOL_STOPPED,
+};
+
+struct CPoolMiningStats
+{
+    bool fRunning;
+    bool fConnected;
+    std::string strServer;
+    std::string strUser;
+    std::string strJobId;
+    double dDifficulty;
+    int nThreads;
+    double dHashesPerSec;
+    int64 nAccepted;
+    int64 nRejected;
+    std::string strLastError;
+};
+
+/** Mine on a stratum pool with nThreads scrypt worker threads. Workers
+ *  fetch new extranonce2 space every nScanTime seconds. */
+bool StartPoolMining(const std::string& strServer, int nPort, const std::string& strUser, const std::string& strPassword, int nThreads, int nScanTime = 60);
+/** Tell the pool threads to stop. POOL_STOPPED is sent once they all
+ *  exited; with fWait this also waits up to 10s for them. */
+void StopPoolMining(bool fWait = true);
+void GetPoolMiningStats(CPoolMiningStats& stats);
+
+#endif
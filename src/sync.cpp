@@ -9,6 +9,90 @@
 
 #include <boost/foreach.hpp>
 
+#ifdef MAC_OSX
+#include <mach/mach_time.h>
+#endif
+
+//
+// Lock contention statistics
+//
+
+static CLockSite* plocksitesHead = NULL;
+static boost::mutex mutexLockSites;
+
+CLockSite::CLockSite(const char* pszNameIn, const char* pszFileIn, int nLineIn)
+{
+    pszName = pszNameIn;
+    pszFile = pszFileIn;
+    nLine = nLineIn;
+    nAcquired = 0;
+    nContended = 0;
+    nWaitMicros = 0;
+    nHoldMicros = 0;
+    nWaiting = 0;
+
+    // Not a LOCK: this runs inside the first LOCK of every site
+    boost::mutex::scoped_lock lock(mutexLockSites);
+    pnext = plocksitesHead;
+    plocksitesHead = this;
+}
+
+int64 GetLockTimeMicros()
+{
+#ifdef WIN32
+    static LARGE_INTEGER nFrequency;
+    if (nFrequency.QuadPart == 0)
+        QueryPerformanceFrequency(&nFrequency);
+    LARGE_INTEGER nCounter;
+    QueryPerformanceCounter(&nCounter);
+    return nCounter.QuadPart * 1000000 / nFrequency.QuadPart;
+#elif defined(MAC_OSX)
+    // No CLOCK_MONOTONIC before 10.12
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (int64)(mach_absolute_time() / 1000 * timebase.numer / timebase.denom);
+#else
+    // Needs -lrt with older glibc
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void GetLockStats(std::vector<CLockStats>& vStats)
+{
+    vStats.clear();
+    boost::mutex::scoped_lock lock(mutexLockSites);
+    for (CLockSite* psite = plocksitesHead; psite; psite = psite->pnext)
+    {
+        if (psite->nAcquired == 0 && psite->nWaiting == 0)
+            continue;
+        CLockStats stats;
+        stats.strName = psite->pszName;
+        stats.strFile = psite->pszFile;
+        stats.nLine = psite->nLine;
+        stats.nAcquired = psite->nAcquired;
+        stats.nContended = psite->nContended;
+        stats.nWaitMicros = psite->nWaitMicros;
+        stats.nHoldMicros = psite->nHoldMicros;
+        stats.nWaiting = psite->nWaiting;
+        vStats.push_back(stats);
+    }
+}
+
+void ResetLockStats()
+{
+    boost::mutex::scoped_lock lock(mutexLockSites);
+    for (CLockSite* psite = plocksitesHead; psite; psite = psite->pnext)
+    {
+        __sync_lock_test_and_set(&psite->nAcquired, 0);
+        __sync_lock_test_and_set(&psite->nContended, 0);
+        __sync_lock_test_and_set(&psite->nWaitMicros, 0);
+        __sync_lock_test_and_set(&psite->nHoldMicros, 0);
+    }
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
@@ -80,7 +164,7 @@ static void push_lock(void* c, const CLockLocation& locklocation, bool fTry)
     if (lockstack.get() == NULL)
         lockstack.reset(new LockStack);
 
-    if (fDebug) printf("Locking: %s\n", locklocation.ToString().c_str());
+    LogPrint(LOG_LOCK, "Locking: %s\n", locklocation.ToString().c_str());
     dd_mutex.lock();
 
     (*lockstack).push_back(std::make_pair(c, locklocation));
@@ -107,7 +191,7 @@ static void push_lock(void* c, const CLockLocation& locklocation, bool fTry)
 
 static void pop_lock()
 {
-    if (fDebug) 
+    if (LogAcceptCategory(LOG_LOCK))
     {
         const CLockLocation& locklocation = (*lockstack).rbegin()->second;
         printf("Unlocked: %s\n", locklocation.ToString().c_str());
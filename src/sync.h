@@ -12,6 +12,11 @@
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
 
+#include <string>
+#include <vector>
+
+typedef long long  int64;
+
 
 
 
@@ -33,12 +38,85 @@ void static inline LeaveCritical() {}
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/** Contention statistics of one LOCK/LOCK2/TRY_LOCK call site. Every
+ *  site has one static instance, so recording costs no lookups; the
+ *  counters are updated atomically because several mutexes may be locked
+ *  from the same site (for example pnode->cs_vSend). */
+class CLockSite
+{
+public:
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+    int64 nAcquired;      // times the lock was taken here
+    int64 nContended;     // times it had to wait for another thread
+    int64 nWaitMicros;    // total time spent waiting
+    int64 nHoldMicros;    // total time the lock was held
+    int nWaiting;         // threads waiting for it here right now
+    CLockSite* pnext;     // next registered site
+
+    // Registers the site, so it shows up in GetLockStats
+    CLockSite(const char* pszNameIn, const char* pszFileIn, int nLineIn);
+
+    void Acquired(int64 nWait)
+    {
+        __sync_fetch_and_add(&nAcquired, 1);
+        if (nWait >= 0)
+        {
+            __sync_fetch_and_add(&nContended, 1);
+            __sync_fetch_and_add(&nWaitMicros, nWait);
+        }
+    }
+
+    void Released(int64 nHold)
+    {
+        __sync_fetch_and_add(&nHoldMicros, nHold);
+    }
+
+    void Waiting(int nChange)
+    {
+        __sync_fetch_and_add(&nWaiting, nChange);
+    }
+};
+
+/** Monotonic clock in microseconds, cheap enough to read on every lock */
+int64 GetLockTimeMicros();
+
+struct CLockStats
+{
+    std::string strName;
+    std::string strFile;
+    int nLine;
+    int64 nAcquired;
+    int64 nContended;
+    int64 nWaitMicros;
+    int64 nHoldMicros;
+    int nWaiting;
+};
+
+/** Statistics of all lock sites that were used so far */
+void GetLockStats(std::vector<CLockStats>& vStats);
+void ResetLockStats();
+
 /** Wrapper around boost::interprocess::scoped_lock */
 template<typename Mutex>
 class CMutexLock
 {
 private:
     boost::unique_lock<Mutex> lock;
+    CLockSite* psite;
+    int64 nLockedTime;
+
+    void Locked(int64 nWait)
+    {
+        if (psite)
+        {
+            psite->Acquired(nWait);
+            if (nWait < 0)
+                nLockedTime = GetLockTimeMicros();
+        }
+    }
+
 public:
 
     void Enter(const char* pszName, const char* pszFile, int nLine)
@@ -46,15 +124,27 @@ public:
         if (!lock.owns_lock())
         {
             EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
-#ifdef DEBUG_LOCKCONTENTION
             if (!lock.try_lock())
             {
+#ifdef DEBUG_LOCKCONTENTION
                 PrintLockContention(pszName, pszFile, nLine);
 #endif
-            lock.lock();
-#ifdef DEBUG_LOCKCONTENTION
+                int64 nStart = 0;
+                if (psite)
+                {
+                    nStart = GetLockTimeMicros();
+                    psite->Waiting(1);
+                }
+                lock.lock();
+                if (psite)
+                {
+                    psite->Waiting(-1);
+                    nLockedTime = GetLockTimeMicros();
+                }
+                Locked(nLockedTime - nStart);
             }
-#endif
+            else
+                Locked(-1);
         }
     }
 
@@ -62,6 +152,8 @@ public:
     {
         if (lock.owns_lock())
         {
+            if (psite)
+                psite->Released(GetLockTimeMicros() - nLockedTime);
             lock.unlock();
             LeaveCritical();
         }
@@ -75,11 +167,13 @@ public:
             lock.try_lock();
             if (!lock.owns_lock())
                 LeaveCritical();
+            else
+                Locked(-1);
         }
         return lock.owns_lock();
     }
 
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false, CLockSite* psiteIn = NULL) : lock(mutexIn, boost::defer_lock), psite(psiteIn), nLockedTime(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -90,7 +184,11 @@ public:
     ~CMutexLock()
     {
         if (lock.owns_lock())
+        {
+            if (psite)
+                psite->Released(GetLockTimeMicros() - nLockedTime);
             LeaveCritical();
+        }
     }
 
     operator bool()
@@ -106,9 +204,13 @@ public:
 
 typedef CMutexLock<CCriticalSection> CCriticalBlock;
 
-#define LOCK(cs) CCriticalBlock criticalblock(cs, #cs, __FILE__, __LINE__)
-#define LOCK2(cs1,cs2) CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__),criticalblock2(cs2, #cs2, __FILE__, __LINE__)
-#define TRY_LOCK(cs,name) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true)
+#define LOCKSITE_PASTE(a,b) a ## b
+#define LOCKSITE_NAME(name,line) LOCKSITE_PASTE(name, line)
+#define LOCKSITE(name,cs) static CLockSite LOCKSITE_NAME(name, __LINE__)(#cs, __FILE__, __LINE__)
+
+#define LOCK(cs) LOCKSITE(locksite, cs); CCriticalBlock criticalblock(cs, #cs, __FILE__, __LINE__, false, &LOCKSITE_NAME(locksite, __LINE__))
+#define LOCK2(cs1,cs2) LOCKSITE(locksite1, cs1); LOCKSITE(locksite2, cs2); CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__, false, &LOCKSITE_NAME(locksite1, __LINE__)),criticalblock2(cs2, #cs2, __FILE__, __LINE__, false, &LOCKSITE_NAME(locksite2, __LINE__))
+#define TRY_LOCK(cs,name) LOCKSITE(locksite_##name, cs); CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true, &LOCKSITE_NAME(locksite_##name, __LINE__))
 
 #define ENTER_CRITICAL_SECTION(cs) \
     { \
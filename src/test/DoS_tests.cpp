@@ -20,6 +20,9 @@ extern bool AddOrphanTx(const CDataStream& vMsg);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
 extern std::map<uint256, CDataStream*> mapOrphanTransactions;
 extern std::map<uint256, std::map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+extern std::multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+extern CBlock* AddOrphanBlock(const CBlock& block);
+extern unsigned int LimitOrphanBlockSize(unsigned int nMaxSize);
 
 CService ip(uint32_t i)
 {
@@ -223,6 +226,39 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
 
+BOOST_AUTO_TEST_CASE(DoS_mapOrphanBlocks)
+{
+    // 10 chains of 10 orphan blocks each:
+    unsigned int nBlockSize = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        uint256 hashPrev = GetRandHash();
+        for (int j = 0; j < 10; j++)
+        {
+            CBlock block;
+            block.hashPrevBlock = hashPrev;
+            block.nNonce = j;
+            nBlockSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+            hashPrev = AddOrphanBlock(block)->GetHash();
+        }
+    }
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), 100U);
+
+    // Test LimitOrphanBlockSize() function, it keeps chains connected:
+    BOOST_CHECK_EQUAL(LimitOrphanBlockSize(40 * nBlockSize), 60U);
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), 40U);
+    BOOST_CHECK_EQUAL(mapOrphanBlocksByPrev.size(), 40U);
+    for (std::map<uint256, CBlock*>::iterator mi = mapOrphanBlocks.begin(); mi != mapOrphanBlocks.end(); ++mi)
+    {
+        const CBlock* pblock = (*mi).second;
+        if (pblock->nNonce > 0)
+            BOOST_CHECK(mapOrphanBlocks.count(pblock->hashPrevBlock));
+    }
+    LimitOrphanBlockSize(0);
+    BOOST_CHECK(mapOrphanBlocks.empty());
+    BOOST_CHECK(mapOrphanBlocksByPrev.empty());
+}
+
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
 {
     // Test signature caching code (see key.cpp Verify() methods)
@@ -0,0 +1,61 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "addrman.h"
+#include "util.h"
+
+using namespace std;
+
+static CAddress RandAddr()
+{
+    return CAddress(CService(strprintf("%d.%d.%d.%d", 1 + GetRandInt(9), GetRandInt(256), GetRandInt(256), 1 + GetRandInt(254)), 8333));
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_select)
+{
+    CAddrMan addrman;
+    BOOST_CHECK(!addrman.Select().IsValid());
+
+    // With a single address in both tables, selection must find it
+    // regardless of which of the many empty buckets it ended up in
+    CNetAddr source("250.1.2.1");
+    CAddress addrNew = RandAddr();
+    CAddress addrTried = RandAddr();
+    BOOST_CHECK(addrman.Add(addrNew, source));
+    BOOST_CHECK(addrman.Add(addrTried, source));
+    addrman.Good(addrTried);
+    for (int i = 0; i < 100; i++)
+    {
+        CAddress addr = addrman.Select(i % 2 ? 0 : 100);
+        BOOST_CHECK(addr == (i % 2 ? addrTried : addrNew));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(addrman_getaddr)
+{
+    CAddrMan addrman;
+    BOOST_CHECK(addrman.GetAddr().empty());
+
+    set<CService> setAdded;
+    for (int i = 0; i < 1000; i++)
+    {
+        CAddress addr = RandAddr();
+        if (addrman.Add(addr, CNetAddr(strprintf("250.%d.1.1", i % 256))))
+            setAdded.insert(addr);
+    }
+
+    // GetAddr returns distinct known addresses, even though they are
+    // sampled from a snapshot that is taken only now and then
+    vector<CAddress> vAddr = addrman.GetAddr();
+    BOOST_CHECK_EQUAL((int)vAddr.size(), ADDRMAN_GETADDR_MAX_PCT * addrman.size() / 100);
+    set<CService> setReturned;
+    BOOST_FOREACH(const CAddress& addr, vAddr)
+    {
+        BOOST_CHECK(setReturned.insert(addr).second);
+        BOOST_CHECK(setAdded.count(addr));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,6 +1,8 @@
 #include <boost/test/unit_test.hpp>
 
 #include "base58.h"
+#include "bignum.h"
+#include "util.h"
 
 BOOST_AUTO_TEST_SUITE(base58_tests)
 
@@ -83,5 +85,136 @@ BOOST_AUTO_TEST_CASE(base58_DecodeBase58)
     BOOST_CHECK(!DecodeBase58("invalid", result));
 }
 
+// The original CBigNum based codec, kept as a reference for the
+// byte-oriented implementation in base58.h
+static std::string EncodeBase58Reference(const std::vector<unsigned char>& vch)
+{
+    CAutoBN_CTX pctx;
+    CBigNum bn58 = 58;
+    CBigNum bn0 = 0;
+
+    std::vector<unsigned char> vchTmp(vch.size()+1, 0);
+    reverse_copy(vch.begin(), vch.end(), vchTmp.begin());
+    CBigNum bn;
+    bn.setvch(vchTmp);
+
+    std::string str;
+    CBigNum dv;
+    CBigNum rem;
+    while (bn > bn0)
+    {
+        if (!BN_div(&dv, &rem, &bn, &bn58, pctx))
+            throw bignum_error("EncodeBase58Reference : BN_div failed");
+        bn = dv;
+        str += pszBase58[rem.getulong()];
+    }
+    for (unsigned int i = 0; i < vch.size() && vch[i] == 0; i++)
+        str += pszBase58[0];
+    reverse(str.begin(), str.end());
+    return str;
+}
+
+static bool DecodeBase58Reference(const char* psz, std::vector<unsigned char>& vchRet)
+{
+    CAutoBN_CTX pctx;
+    vchRet.clear();
+    CBigNum bn58 = 58;
+    CBigNum bn = 0;
+    CBigNum bnChar;
+    while (isspace(*psz))
+        psz++;
+
+    for (const char* p = psz; *p; p++)
+    {
+        const char* p1 = strchr(pszBase58, *p);
+        if (p1 == NULL)
+        {
+            while (isspace(*p))
+                p++;
+            if (*p != '\0')
+                return false;
+            break;
+        }
+        bnChar.setulong(p1 - pszBase58);
+        if (!BN_mul(&bn, &bn, &bn58, pctx))
+            throw bignum_error("DecodeBase58Reference : BN_mul failed");
+        bn += bnChar;
+    }
+
+    std::vector<unsigned char> vchTmp = bn.getvch();
+    if (vchTmp.size() >= 2 && vchTmp.end()[-1] == 0 && vchTmp.end()[-2] >= 0x80)
+        vchTmp.erase(vchTmp.end()-1);
+
+    int nLeadingZeros = 0;
+    for (const char* p = psz; *p == pszBase58[0]; p++)
+        nLeadingZeros++;
+    vchRet.assign(nLeadingZeros + vchTmp.size(), 0);
+    reverse_copy(vchTmp.begin(), vchTmp.end(), vchRet.end() - vchTmp.size());
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(base58_reference)
+{
+    // Random data, with a bias towards leading zero bytes
+    for (int i = 0; i < 2000; i++)
+    {
+        std::vector<unsigned char> vch(GetRandInt(40));
+        int nZeroes = GetRandInt(4) == 0 ? GetRandInt(vch.size() + 1) : 0;
+        for (unsigned int j = 0; j < vch.size(); j++)
+            vch[j] = (int)j < nZeroes ? 0 : GetRandInt(256);
+
+        std::string str = EncodeBase58(vch);
+        BOOST_CHECK_EQUAL(str, EncodeBase58Reference(vch));
+
+        std::vector<unsigned char> result;
+        BOOST_CHECK(DecodeBase58(str, result));
+        BOOST_CHECK(result == vch);
+    }
+
+    // Random strings, including whitespace and characters outside the alphabet
+    static const char* pszChars = " \t11123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz0OIl";
+    for (int i = 0; i < 2000; i++)
+    {
+        std::string str;
+        int nLength = GetRandInt(30);
+        for (int j = 0; j < nLength; j++)
+            str += pszChars[GetRandInt(strlen(pszChars))];
+
+        std::vector<unsigned char> result, expected;
+        bool fRet = DecodeBase58(str, result);
+        BOOST_CHECK_EQUAL(fRet, DecodeBase58Reference(str.c_str(), expected));
+        if (fRet)
+            BOOST_CHECK(result == expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(base58_speed)
+{
+    // Typical address sized payloads; not a pass/fail check,
+    // just reported so regressions are visible in test logs
+    std::vector<unsigned char> vch(25);
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = GetRandInt(256);
+
+    int64 nStart = GetTimeMillis();
+    std::vector<unsigned char> result;
+    for (int i = 0; i < 10000; i++)
+    {
+        vch[i % vch.size()]++;
+        BOOST_CHECK(DecodeBase58(EncodeBase58(vch), result));
+    }
+    int64 nNew = GetTimeMillis() - nStart;
+
+    nStart = GetTimeMillis();
+    for (int i = 0; i < 10000; i++)
+    {
+        vch[i % vch.size()]++;
+        BOOST_CHECK(DecodeBase58Reference(EncodeBase58Reference(vch).c_str(), result));
+    }
+    int64 nReference = GetTimeMillis() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("base58 10000 round trips: %"PRI64d"ms, CBigNum reference: %"PRI64d"ms", nNew, nReference));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
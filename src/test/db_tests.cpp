@@ -0,0 +1,63 @@
+//
+// Unit tests for wallet database backups
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "base58.h"
+#include "db.h"
+#include "util.h"
+#include "wallet.h"
+#include "walletdb.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(db_tests)
+
+BOOST_AUTO_TEST_CASE(db_Backup)
+{
+    CKey key1, key2;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(true);
+    string strAddress1 = CBitcoinAddress(key1.GetPubKey().GetID()).ToString();
+    string strAddress2 = CBitcoinAddress(key2.GetPubKey().GetID()).ToString();
+
+    {
+        CWalletDB walletdb("backup_test.dat", "cr+");
+        BOOST_CHECK(walletdb.WriteKey(key1.GetPubKey(), key1.GetPrivKey()));
+        BOOST_CHECK(walletdb.WriteName(strAddress1, "one"));
+        BOOST_CHECK(walletdb.WriteName(strAddress2, "two"));
+    }
+
+    // A full backup, then nothing to do
+    boost::filesystem::path pathDest = GetDataDir() / "backups";
+    boost::filesystem::create_directory(pathDest);
+    pathDest /= "backup_test.dat";
+    unsigned int nChanged = 0;
+    BOOST_CHECK(CDB::Backup("backup_test.dat", pathDest, nChanged));
+    BOOST_CHECK_EQUAL(nChanged, 4U); // the keys and names, plus the version
+    BOOST_CHECK(CDB::Backup("backup_test.dat", pathDest, nChanged));
+    BOOST_CHECK_EQUAL(nChanged, 0U);
+
+    // One record changed, one deleted, one added
+    {
+        CWalletDB walletdb("backup_test.dat", "r+");
+        BOOST_CHECK(walletdb.WriteName(strAddress1, "uno"));
+        BOOST_CHECK(walletdb.EraseName(strAddress2));
+        BOOST_CHECK(walletdb.WriteKey(key2.GetPubKey(), key2.GetPrivKey()));
+    }
+    BOOST_CHECK(CDB::Backup("backup_test.dat", pathDest, nChanged));
+    BOOST_CHECK_EQUAL(nChanged, 3U);
+    BOOST_CHECK(!boost::filesystem::exists(pathDest.string() + ".tmp"));
+
+    // The backup loads like the wallet it was taken from
+    boost::filesystem::copy_file(pathDest, GetDataDir() / "backup_restored.dat");
+    CWallet wallet;
+    BOOST_CHECK_EQUAL(CWalletDB("backup_restored.dat", "r+").LoadWallet(&wallet), (int)DB_LOAD_OK);
+    BOOST_CHECK(wallet.HaveKey(key1.GetPubKey().GetID()));
+    BOOST_CHECK(wallet.HaveKey(key2.GetPubKey().GetID()));
+    BOOST_CHECK_EQUAL(wallet.mapAddressBook.size(), 1U);
+    BOOST_CHECK_EQUAL(wallet.mapAddressBook[key1.GetPubKey().GetID()], "uno");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,160 @@
+//
+// Unit tests for headers-first synchronization
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+extern CBlockIndex* AcceptBlockHeader(CBlock& header, int& nDoS);
+extern void SetBestHeader(CBlockIndex* pindexNew);
+extern void PruneHeaderIndex();
+extern void FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData);
+extern void MarkBlockReceived(const uint256& hash);
+
+static const int HEADER_CHAIN_LENGTH = 2000;
+
+// A header chain on top of a stand-in best block, without proof of work
+struct HeaderChainSetup
+{
+    vector<uint256> vHash;
+    vector<CBlockIndex*> vIndex;
+    map<uint256, int> mapHeight;
+    vector<CNode*> vNodesTest;
+    CBlockIndex* pindexBestSaved;
+
+    HeaderChainSetup()
+    {
+        vHash.resize(HEADER_CHAIN_LENGTH + 1);
+        for (int i = 0; i <= HEADER_CHAIN_LENGTH; i++)
+        {
+            vHash[i] = GetRandHash();
+            mapHeight[vHash[i]] = i;
+            CBlockIndex* pindex = new CBlockIndex();
+            pindex->phashBlock = &vHash[i];
+            pindex->nHeight = i;
+            pindex->pprev = i > 0 ? vIndex[i-1] : NULL;
+            vIndex.push_back(pindex);
+        }
+        pindexBestSaved = pindexBest;
+        pindexBest = vIndex[0];
+        SetBestHeader(vIndex[HEADER_CHAIN_LENGTH]);
+    }
+
+    ~HeaderChainSetup()
+    {
+        BOOST_FOREACH(CNode* pnode, vNodesTest)
+        {
+            BlockDownloadDisconnected(pnode);
+            delete pnode;
+        }
+        PruneHeaderIndex();
+        pindexBest = pindexBestSaved;
+        BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+            delete pindex;
+    }
+
+    CNode* NewNode()
+    {
+        CNode* pnode = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", GetDefaultPort())), "", true);
+        vNodesTest.push_back(pnode);
+        return pnode;
+    }
+
+    // Heights of the blocks requested from pnode
+    vector<int> Request(CNode* pnode)
+    {
+        vector<CInv> vGetData;
+        FindBlocksToDownload(pnode, vGetData);
+        vector<int> vHeight;
+        BOOST_FOREACH(const CInv& inv, vGetData)
+        {
+            BOOST_CHECK(inv.type == MSG_BLOCK && mapHeight.count(inv.hash));
+            vHeight.push_back(mapHeight[inv.hash]);
+        }
+        return vHeight;
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(headers_tests, HeaderChainSetup)
+
+BOOST_AUTO_TEST_CASE(headers_accept)
+{
+    CBlock header;
+    header.nVersion = 1;
+    header.nTime = GetTime();
+    header.nBits = 0x1d00ffff;
+
+    // Unconnected headers are refused
+    int nDoS = 0;
+    header.hashPrevBlock = GetRandHash();
+    BOOST_CHECK(AcceptBlockHeader(header, nDoS) == NULL);
+    BOOST_CHECK_EQUAL(nDoS, 10);
+
+    // and so are ones without the work they claim
+    mapBlockIndex[vHash[0]] = vIndex[0];
+    header.hashPrevBlock = vHash[0];
+    BOOST_CHECK(AcceptBlockHeader(header, nDoS) == NULL);
+    BOOST_CHECK_EQUAL(nDoS, 50);
+    mapBlockIndex.erase(vHash[0]);
+}
+
+BOOST_AUTO_TEST_CASE(headers_download_window)
+{
+    // A peer is only asked for blocks it announced
+    CNode* pnodeShort = NewNode();
+    pnodeShort->nStartingHeight = 5;
+    vector<int> vHeight = Request(pnodeShort);
+    BOOST_CHECK_EQUAL(vHeight.size(), 5U);
+    BOOST_CHECK(vHeight.front() == 1 && vHeight.back() == 5);
+
+    // Others get up to 16 blocks each, in order, and nothing past the
+    // window of 1024 blocks
+    set<int> setRequested(vHeight.begin(), vHeight.end());
+    int nLast = 5;
+    for (int i = 0; i < 100; i++)
+    {
+        vHeight = Request(NewNode());
+        if (vHeight.empty())
+            break;
+        BOOST_CHECK(vHeight.size() <= 16);
+        BOOST_FOREACH(int nHeight, vHeight)
+        {
+            BOOST_CHECK_EQUAL(nHeight, nLast + 1);
+            nLast = nHeight;
+            setRequested.insert(nHeight);
+        }
+    }
+    BOOST_CHECK_EQUAL(nLast, 1024);
+    BOOST_CHECK_EQUAL(setRequested.size(), 1024U);
+
+    // A block delivered by anyone clears the request, but the window
+    // doesn't move before the blocks connect
+    CNode* pnodeFirst = vNodesTest[1];
+    BOOST_CHECK_EQUAL(pnodeFirst->mapBlocksInFlight.size(), 16U);
+    mapBlockIndex[vHash[6]] = vIndex[6];
+    MarkBlockReceived(vHash[6]);
+    BOOST_CHECK_EQUAL(pnodeFirst->mapBlocksInFlight.size(), 15U);
+    BOOST_CHECK(Request(pnodeFirst).empty());
+
+    // The blocks of a peer that is gone go to others
+    CNode* pnodeGone = vNodesTest[2];
+    BlockDownloadDisconnected(pnodeGone);
+    BOOST_CHECK(pnodeGone->mapBlocksInFlight.empty());
+    vHeight = Request(NewNode());
+    BOOST_CHECK_EQUAL(vHeight.size(), 16U);
+    BOOST_CHECK(vHeight.front() == 22 && vHeight.back() == 37);
+
+    // and so do requests that time out
+    SetMockTime(GetTime() + 10 * 60);
+    vHeight = Request(pnodeFirst);
+    BOOST_CHECK_EQUAL(vHeight.size(), 15U);
+    BOOST_CHECK(vHeight.front() == 7 && vHeight.back() == 21);
+    SetMockTime(0);
+    mapBlockIndex.erase(vHash[6]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,87 @@
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+#include "invfilter.h"
+#include "util.h"
+
+#define NUM_TESTS 16
+#define MAX_SIZE 100
+
+static CInv RandInv()
+{
+    return CInv(1, GetRandHash()); // MSG_TX
+}
+
+BOOST_AUTO_TEST_SUITE(invfilter_tests)
+
+// Test that a filter behaves like a set, as long as no more than MAX_SIZE elements are in it
+BOOST_AUTO_TEST_CASE(invfilter_like_set)
+{
+    for (int nTest=0; nTest<NUM_TESTS; nTest++)
+    {
+        CInvFilter filter(MAX_SIZE);
+        std::vector<CInv> vInv;
+        std::set<CInv> setInv;
+        while (vInv.size() < MAX_SIZE)
+        {
+            // Insert new items and items seen before
+            CInv inv = (vInv.empty() || GetRand(2)) ? RandInv() : vInv[GetRand(vInv.size())];
+            bool fNew = setInv.insert(inv).second;
+            BOOST_CHECK(filter.insert(inv) == fNew);
+            if (fNew)
+                vInv.push_back(inv);
+            BOOST_CHECK(filter.size() == vInv.size());
+        }
+        for (unsigned int i=0; i<vInv.size(); i++)
+            BOOST_CHECK(filter.count(vInv[i]) == 1);
+        BOOST_CHECK(filter.count(RandInv()) == 0);
+    }
+}
+
+// Test that a filter acts like a moving window over the last MAX_SIZE items
+BOOST_AUTO_TEST_CASE(invfilter_window)
+{
+    CInvFilter filter(MAX_SIZE);
+    std::vector<CInv> vInv;
+    for (int n=0; n<10*MAX_SIZE; n++)
+    {
+        vInv.push_back(RandInv());
+        BOOST_CHECK(filter.insert(vInv.back()));
+        BOOST_CHECK(filter.size() <= MAX_SIZE);
+
+        // Check the window every now and then, removals must not lose entries
+        if (n % 37 == 0)
+            for (int i=0; i<(int)vInv.size(); i++)
+                BOOST_CHECK(filter.count(vInv[i]) == (i > (int)vInv.size() - 1 - MAX_SIZE ? 1 : 0));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(invfilter_timemap)
+{
+    // A tiny map to exercise replacement within full buckets
+    CInvTimeMap mapTime(4);
+    std::vector<CInv> vInv;
+    for (int n=0; n<100; n++)
+    {
+        vInv.push_back(RandInv());
+        mapTime.set(vInv.back(), n + 1);
+        BOOST_CHECK(mapTime.get(vInv.back()) == n + 1);
+    }
+
+    // Entries can be forgotten, but never report another item's time
+    int nFound = 0;
+    for (int n=0; n<100; n++)
+    {
+        int64 nTime = mapTime.get(vInv[n]);
+        BOOST_CHECK(nTime == 0 || nTime == n + 1);
+        if (nTime)
+            nFound++;
+    }
+    BOOST_CHECK(nFound > 0 && nFound <= 16);
+
+    mapTime.erase(vInv.back());
+    BOOST_CHECK(mapTime.get(vInv.back()) == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,189 @@
+//
+// Unit tests for message sending code
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+// Everything queued for sending, as it would go out on the socket
+static std::string SendQueue(const CNode& node)
+{
+    std::string str;
+    unsigned int nOffset = node.nSendOffset;
+    BOOST_FOREACH(const CMessagePayloadRef& pbuf, node.vSendMsg)
+    {
+        str.append(pbuf->vch.begin() + nOffset, pbuf->vch.end());
+        nOffset = 0;
+    }
+    return str;
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(net_PushMessageRaw)
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = 1390000000;
+    block.nBits = 0x1e0ffff0;
+    block.nNonce = 42;
+    block.vtx.resize(1);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].scriptSig = CScript() << 486604799 << CBigNum(4);
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 50 * COIN;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    CMessagePayloadRef payload(new CMessagePayload(ss));
+
+    CAddress addr(CService("127.0.0.1", GetDefaultPort()));
+    CNode node1(INVALID_SOCKET, addr, "", true);
+    CNode node2(INVALID_SOCKET, addr, "", true);
+
+    // A block sent from its serialized form must be exactly the same
+    // message as one serialized while sending
+    node1.PushMessage("block", block);
+    node2.PushMessageRaw("block", payload);
+    BOOST_CHECK(node1.nSendSize > payload->vch.size());
+    BOOST_CHECK(node1.nSendSize == node2.nSendSize);
+    BOOST_CHECK(SendQueue(node1) == SendQueue(node2));
+
+    // The payload is queued by reference, not copied
+    BOOST_CHECK_EQUAL(node2.vSendMsg.size(), 2U);
+    BOOST_CHECK(node2.vSendMsg.back() == payload);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(net_SocketSendData)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    CAddress addr(CService("127.0.0.1", GetDefaultPort()));
+    CNode node(fds[0], addr, "", true);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << std::vector<unsigned char>(5000, 0x55);
+    CMessagePayloadRef payload(new CMessagePayload(ss));
+    for (int i = 0; i < 100; i++)
+    {
+        node.PushMessage("ping", (uint64)i);
+        node.PushMessageRaw("test", payload);
+    }
+    std::string strQueued = SendQueue(node);
+    BOOST_CHECK(node.nSendSize == strQueued.size());
+
+    // Read while sending, the socket buffer fills up several times
+    std::string strReceived;
+    char buf[4096];
+    while (strReceived.size() < strQueued.size())
+    {
+        {
+            LOCK(node.cs_vSend);
+            node.SocketSendData();
+        }
+        int nBytes = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT);
+        BOOST_REQUIRE(nBytes > 0 || WSAGetLastError() == WSAEWOULDBLOCK);
+        if (nBytes > 0)
+            strReceived.append(buf, nBytes);
+    }
+    BOOST_CHECK(strReceived == strQueued);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK(node.nSendSize == 0);
+    BOOST_CHECK(node.nSendBytes == strQueued.size());
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(net_RelayPayload)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    CInv inv(MSG_TX, tx.GetHash());
+
+    RelayMessage(inv, tx);
+    CMessagePayloadRef payload;
+    {
+        LOCK(cs_mapRelay);
+        BOOST_CHECK(mapRelay.count(inv));
+        payload = mapRelay[inv];
+    }
+    BOOST_CHECK(payload);
+
+    // Every peer sends the same message as if it had serialized the
+    // transaction itself
+    CAddress addr(CService("127.0.0.1", GetDefaultPort()));
+    CNode node1(INVALID_SOCKET, addr, "", true);
+    CNode node2(INVALID_SOCKET, addr, "", true);
+    CNode node3(INVALID_SOCKET, addr, "", true);
+    node1.PushMessage("tx", tx);
+    node2.PushMessageRaw("tx", payload);
+    node3.PushMessageRaw("tx", payload);
+    BOOST_CHECK(SendQueue(node1) == SendQueue(node2));
+    BOOST_CHECK(SendQueue(node1) == SendQueue(node3));
+}
+
+BOOST_AUTO_TEST_CASE(net_CompactBlock)
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = 1390000000;
+    block.nBits = 0x1e0ffff0;
+    block.vtx.resize(4);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].scriptSig = CScript() << 486604799 << CBigNum(4);
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 50 * COIN;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].prevout.hash = GetRandHash();
+        block.vtx[i].vin[0].prevout.n = i;
+        block.vtx[i].vout.resize(1);
+        block.vtx[i].vout[0].nValue = i * CENT;
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxIds.size(), 3U);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CCompactBlock cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblock2.vShortTxIds == cmpctblock.vShortTxIds);
+
+    // The pool has all but the last transaction, plus one unrelated
+    CTxMemPool pool;
+    pool.addUnchecked(block.vtx[1].GetHash(), block.vtx[1]);
+    pool.addUnchecked(block.vtx[2].GetHash(), block.vtx[2]);
+    CTransaction txOther(block.vtx[3]);
+    txOther.vout[0].nValue++;
+    pool.addUnchecked(txOther.GetHash(), txOther);
+
+    CBlock block2;
+    std::vector<unsigned int> vMissing;
+    cmpctblock2.FillBlock(pool, block2, vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK_EQUAL(vMissing[0], 3U);
+
+    block2.vtx[vMissing[0]] = block.vtx[3];
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // Removed transactions leave the short id index too
+    pool.remove(block.vtx[2]);
+    BOOST_CHECK_EQUAL(pool.mapTxByShortId.size(), 2U);
+    cmpctblock2.FillBlock(pool, block2, vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 2U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
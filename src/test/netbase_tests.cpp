@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "netbase.h"
+#include "util.h"
 
 using namespace std;
 
@@ -99,4 +100,142 @@ BOOST_AUTO_TEST_CASE(onioncat_test)
     BOOST_CHECK(addr1.IsRoutable());
 }
 
+// Stub resolver: "hostN" resolves to 10.0.0.N, anything else fails
+static boost::mutex mutexStub;
+static boost::condition_variable condStub;
+static int nStubCalls = 0;
+static int nStubActive = 0;
+static int nStubMaxActive = 0;
+static int nStubBarrier = 0; // lookups wait until this many ran at once
+
+static bool StubLookup(const std::string& strName, std::vector<CNetAddr>& vIP)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStub);
+        nStubCalls++;
+        nStubActive++;
+        nStubMaxActive = max(nStubMaxActive, nStubActive);
+        condStub.notify_all();
+
+        // Give up after 5s, so lookups that don't run in parallel fail
+        // the test instead of hanging it
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds(5);
+        while (nStubMaxActive < nStubBarrier)
+            if (!condStub.timed_wait(lock, timeout))
+                break;
+        nStubActive--;
+    }
+    if (strName.compare(0, 4, "host") != 0)
+        return false;
+    vIP.push_back(CNetAddr(strprintf("10.0.0.%s", strName.substr(4).c_str())));
+    return true;
+}
+
+static std::vector<CNetAddr> vAsyncResult;
+
+static void StubCallback(void* parg, const std::string& strName, const std::vector<CNetAddr>& vIP)
+{
+    boost::unique_lock<boost::mutex> lock(mutexStub);
+    vAsyncResult = vIP;
+    *(bool*)parg = true;
+    condStub.notify_all();
+}
+
+BOOST_AUTO_TEST_CASE(netbase_resolver)
+{
+    nStubCalls = 0;
+    CResolver resolver(StubLookup);
+    resolver.Start(4);
+
+    // Lookups run in parallel: each one waits until all four are running
+    nStubBarrier = 4;
+    vector<string> vNames;
+    for (int i = 1; i <= 4; i++)
+        vNames.push_back(strprintf("host%d", i));
+    resolver.Prefetch(vNames);
+    vector<CNetAddr> vIP;
+    for (int i = 1; i <= 4; i++)
+    {
+        BOOST_CHECK(resolver.Lookup(vNames[i-1], vIP));
+        BOOST_CHECK(vIP.size() == 1 && vIP[0] == CNetAddr(strprintf("10.0.0.%d", i)));
+    }
+    BOOST_CHECK_EQUAL(nStubMaxActive, 4);
+    BOOST_CHECK_EQUAL(nStubCalls, 4);
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStub);
+        nStubBarrier = 0;
+    }
+
+    // Results and failures are cached
+    BOOST_CHECK(resolver.Lookup("host2", vIP));
+    BOOST_CHECK(!resolver.Lookup("nohost", vIP));
+    BOOST_CHECK(!resolver.Lookup("nohost", vIP));
+    BOOST_CHECK_EQUAL(nStubCalls, 5);
+    BOOST_CHECK_EQUAL(resolver.GetCacheSize(), 5U);
+
+    // Asynchronous lookup
+    bool fDone = false;
+    resolver.LookupAsync("host7", StubCallback, &fDone);
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStub);
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds(5);
+        while (!fDone)
+            if (!condStub.timed_wait(lock, timeout))
+                break;
+        BOOST_CHECK(fDone);
+    }
+    BOOST_CHECK(vAsyncResult.size() == 1 && vAsyncResult[0] == CNetAddr("10.0.0.7"));
+    resolver.Stop();
+
+    // Without threads the lookup is done by the caller
+    CResolver resolverInline(StubLookup);
+    BOOST_CHECK(resolverInline.Lookup("host9", vIP));
+    BOOST_CHECK(vIP.size() == 1 && vIP[0] == CNetAddr("10.0.0.9"));
+}
+
+#ifndef WIN32
+static bool WaitConnect(SOCKET hSocket)
+{
+    struct timeval timeout;
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, NULL, &fdset, NULL, &timeout) == 1;
+}
+
+BOOST_AUTO_TEST_CASE(netbase_connectasync)
+{
+    // Listen on a free port on localhost
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = 0;
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sockaddr, len) == 0);
+    BOOST_REQUIRE(listen(hListen, 1) == 0);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sockaddr, &len) == 0);
+    CService addrListen(sockaddr);
+
+    SOCKET hSocket;
+    BOOST_CHECK(StartConnectSocket(addrListen, hSocket));
+    BOOST_CHECK(WaitConnect(hSocket));
+    BOOST_CHECK(FinishConnectSocket(hSocket));
+    closesocket(hSocket);
+
+    // Nothing listens there anymore, the connect is refused
+    closesocket(hListen);
+    if (StartConnectSocket(addrListen, hSocket))
+    {
+        BOOST_CHECK(WaitConnect(hSocket));
+        BOOST_CHECK(!FinishConnectSocket(hSocket));
+        closesocket(hSocket);
+    }
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 #include <boost/foreach.hpp>
 
 #include "base58.h"
+#include "net.h"
 #include "util.h"
 #include "bitcoinrpc.h"
 
@@ -66,4 +67,185 @@ BOOST_FIXTURE_TEST_CASE(rpc_addmultisig, TestNetFixture)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+#ifndef WIN32
+static SOCKET ConnectRPC(int nPort)
+{
+    SOCKET hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hSocket == INVALID_SOCKET)
+        return hSocket;
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = htons(nPort);
+    if (connect(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) != 0)
+    {
+        closesocket(hSocket);
+        return INVALID_SOCKET;
+    }
+    return hSocket;
+}
+
+// Append what arrives within 30 seconds, returns 0 once the server closed
+// the connection and -1 on timeout
+static int Receive(SOCKET hSocket, string& strBuffer)
+{
+    struct timeval timeout;
+    timeout.tv_sec = 30;
+    timeout.tv_usec = 0;
+    fd_set fdsetRecv;
+    FD_ZERO(&fdsetRecv);
+    FD_SET(hSocket, &fdsetRecv);
+    if (select(hSocket + 1, &fdsetRecv, NULL, NULL, &timeout) <= 0)
+        return -1;
+    char pchBuf[4096];
+    int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), 0);
+    if (nBytes > 0)
+        strBuffer.append(pchBuf, nBytes);
+    return nBytes < 0 ? -1 : nBytes;
+}
+
+// Everything the server sends until it closes the connection
+static bool ReceiveUntilClosed(SOCKET hSocket, string& strData)
+{
+    int nBytes;
+    while ((nBytes = Receive(hSocket, strData)) > 0)
+        ;
+    return nBytes == 0;
+}
+
+static void SendRequest(SOCKET hSocket, const string& strMethod)
+{
+    string strBody = "{\"method\":\"" + strMethod + "\",\"params\":[],\"id\":1}";
+    string str = strprintf("POST / HTTP/1.1\r\n"
+                           "Host: 127.0.0.1\r\n"
+                           "Authorization: Basic %s\r\n"
+                           "Content-Type: application/json\r\n"
+                           "Content-Length: %d\r\n"
+                           "\r\n",
+                           EncodeBase64("user:password").c_str(), (int)strBody.size()) + strBody;
+    BOOST_REQUIRE(send(hSocket, str.data(), str.size(), MSG_NOSIGNAL) == (int)str.size());
+}
+
+// Read one Content-Length reply, returns its status or 0
+static int ReadReply(SOCKET hSocket, Object& objReply)
+{
+    string strBuffer;
+    size_t nHeaderEnd;
+    while ((nHeaderEnd = strBuffer.find("\r\n\r\n")) == string::npos)
+        if (Receive(hSocket, strBuffer) <= 0)
+            return 0;
+    size_t nLenPos = strBuffer.find("Content-Length: ");
+    if (strBuffer.compare(0, 9, "HTTP/1.1 ") != 0 || nLenPos == string::npos || nLenPos > nHeaderEnd)
+        return 0;
+    size_t nLen = atoi(strBuffer.c_str() + nLenPos + 16);
+    while (strBuffer.size() < nHeaderEnd + 4 + nLen)
+        if (Receive(hSocket, strBuffer) <= 0)
+            return 0;
+    Value valReply;
+    if (read_string(strBuffer.substr(nHeaderEnd + 4, nLen), valReply) && valReply.type() == obj_type)
+        objReply = valReply.get_obj();
+    return atoi(strBuffer.c_str() + 9);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_server_queue)
+{
+    // Find a free port for the server
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = 0;
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == 0);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sockaddr, &len) == 0);
+    closesocket(hListen);
+    int nPort = ntohs(sockaddr.sin_port);
+
+    // One worker, room for one waiting connection, one second per request
+    map<string, string> mapArgsSaved = mapArgs;
+    mapArgs["-rpcuser"] = "user";
+    mapArgs["-rpcpassword"] = "password";
+    mapArgs["-rpcport"] = strprintf("%d", nPort);
+    mapArgs["-rpcthreads"] = "1";
+    mapArgs["-rpcworkqueue"] = "1";
+    mapArgs["-rpcservertimeout"] = "1";
+    BOOST_REQUIRE(CreateThread(ThreadRPCServer, NULL));
+
+    SOCKET hSlow = INVALID_SOCKET;
+    for (int i = 0; i < 300 && hSlow == INVALID_SOCKET; i++)
+    {
+        hSlow = ConnectRPC(nPort);
+        if (hSlow == INVALID_SOCKET)
+            Sleep(100);
+    }
+    BOOST_REQUIRE(hSlow != INVALID_SOCKET);
+
+    // A request that never completes, it holds the worker or the queue
+    string strPartial = "POST / HTTP/1.1\r\n";
+    BOOST_REQUIRE(send(hSlow, strPartial.data(), strPartial.size(), MSG_NOSIGNAL) == (int)strPartial.size());
+    int64 nStart = GetTime();
+
+    // Two silent connections: with the worker busy and the queue full at
+    // least one of them is turned away with a 503
+    SOCKET hSilent1 = ConnectRPC(nPort);
+    SOCKET hSilent2 = ConnectRPC(nPort);
+    BOOST_REQUIRE(hSilent1 != INVALID_SOCKET && hSilent2 != INVALID_SOCKET);
+    string strData1, strData2;
+    BOOST_CHECK(ReceiveUntilClosed(hSilent1, strData1));
+    BOOST_CHECK(ReceiveUntilClosed(hSilent2, strData2));
+    BOOST_CHECK(strData1.find(" 503 ") != string::npos || strData2.find(" 503 ") != string::npos);
+
+    // The slow client is cut off after the request deadline, well before
+    // the idle timeout
+    string strSlowData;
+    BOOST_CHECK(ReceiveUntilClosed(hSlow, strSlowData));
+    BOOST_CHECK(strSlowData.empty());
+    BOOST_CHECK(GetTime() - nStart < 15);
+    closesocket(hSlow);
+    closesocket(hSilent1);
+    closesocket(hSilent2);
+
+    // An idle keep-alive connection does not hold the only worker
+    SOCKET hKeepAlive = ConnectRPC(nPort);
+    BOOST_REQUIRE(hKeepAlive != INVALID_SOCKET);
+    Object objReply;
+    SendRequest(hKeepAlive, "getrpcinfo");
+    BOOST_REQUIRE(ReadReply(hKeepAlive, objReply) == 200);
+    const Value& result = find_value(objReply, "result");
+    BOOST_REQUIRE(result.type() == obj_type);
+    BOOST_CHECK(find_value(result.get_obj(), "rejected").get_int64() >= 1);
+
+    SOCKET hOther = ConnectRPC(nPort);
+    BOOST_REQUIRE(hOther != INVALID_SOCKET);
+    SendRequest(hOther, "getrpcinfo");
+    BOOST_CHECK(ReadReply(hOther, objReply) == 200);
+    closesocket(hOther);
+
+    // and is served again once its next request arrives
+    SendRequest(hKeepAlive, "getrpcinfo");
+    BOOST_CHECK(ReadReply(hKeepAlive, objReply) == 200);
+    closesocket(hKeepAlive);
+
+    // Stop the server; each connection attempt wakes the acceptor until it
+    // is closed
+    fShutdown = true;
+    for (int i = 0; i < 300; i++)
+    {
+        SOCKET hSocket = ConnectRPC(nPort);
+        if (hSocket == INVALID_SOCKET)
+            break;
+        closesocket(hSocket);
+        Sleep(100);
+    }
+    for (int i = 0; i < 300 && vnThreadsRunning[THREAD_RPCHANDLER] > 0; i++)
+        Sleep(100);
+    BOOST_CHECK_EQUAL(vnThreadsRunning[THREAD_RPCHANDLER], 0);
+    fShutdown = false;
+    mapArgs = mapArgsSaved;
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -328,6 +328,43 @@ BOOST_AUTO_TEST_CASE(script_CHECKMULTISIG23)
     BOOST_CHECK(!VerifyScript(badsig6, scriptPubKey23, txTo23, 0, true, 0));
 }    
 
+BOOST_AUTO_TEST_CASE(script_pubKeyCache)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    CScript scriptPubKey;
+    scriptPubKey << OP_1 << key.GetPubKey() << OP_1 << OP_CHECKMULTISIG;
+
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].scriptPubKey = scriptPubKey;
+
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vin[0].prevout.n = 0;
+    txTo.vin[0].prevout.hash = txFrom.GetHash();
+    txTo.vout[0].nValue = 1;
+
+    CPubKeyCacheStats before, after;
+    GetPubKeyCacheStats(before);
+
+    // Same key, different signature hashes: the second check must
+    // reuse the parsed key instead of decoding it again.
+    CScript sig1 = sign_multisig(scriptPubKey, key, txTo);
+    BOOST_CHECK(VerifyScript(sig1, scriptPubKey, txTo, 0, true, 0));
+    txTo.vout[0].nValue = 2;
+    CScript sig2 = sign_multisig(scriptPubKey, key, txTo);
+    BOOST_CHECK(VerifyScript(sig2, scriptPubKey, txTo, 0, true, 0));
+    BOOST_CHECK(!VerifyScript(sig1, scriptPubKey, txTo, 0, true, 0));
+
+    GetPubKeyCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nMisses, before.nMisses + 1);
+    BOOST_CHECK_EQUAL(after.nHits, before.nHits + 2);
+    BOOST_CHECK(after.nSize <= after.nMaxSize);
+}
+
 BOOST_AUTO_TEST_CASE(script_combineSigs)
 {
     // Test the CombineSignatures function
@@ -0,0 +1,272 @@
+//
+// Unit tests for the stratum pool mining client
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "netbase.h"
+#include "scrypt.h"
+#include "stratum.h"
+#include "util.h"
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+#include "json/json_spirit_utils.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// A block with a coinbase that has room for the extranonces, and the job a
+// pool would send for it
+static CBlock PoolBlock(const vector<unsigned char>& vchExtraNonce1, const vector<unsigned char>& vchExtraNonce2, CStratumJob& job)
+{
+    vector<unsigned char> vchExtraNonce(vchExtraNonce1);
+    vchExtraNonce.insert(vchExtraNonce.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1390000000;
+    block.nBits = 0x1e0ffff0;
+    block.vtx.resize(5);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].scriptSig = CScript() << 486604799 << vchExtraNonce;
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 25 * COIN;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].prevout.hash = GetRandHash();
+        block.vtx[i].vin[0].prevout.n = i;
+        block.vtx[i].vout.resize(1);
+        block.vtx[i].vout[0].nValue = i * CENT;
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    // Split the coinbase around the extranonces
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block.vtx[0];
+    vector<unsigned char> vchCoinbase(ss.begin(), ss.end());
+    vector<unsigned char>::iterator it = search(vchCoinbase.begin(), vchCoinbase.end(), vchExtraNonce.begin(), vchExtraNonce.end());
+    BOOST_REQUIRE(it != vchCoinbase.end());
+
+    job.strJobId = "1a";
+    job.vchPrevHash.resize(32);
+    for (int i = 0; i < 32; i++)
+        job.vchPrevHash[i] = ((unsigned char*)&block.hashPrevBlock)[(i & ~3) + 3 - (i & 3)];
+    job.vchCoinbase1.assign(vchCoinbase.begin(), it);
+    job.vchCoinbase2.assign(it + vchExtraNonce.size(), vchCoinbase.end());
+    job.vMerkleBranch = block.GetMerkleBranch(0);
+    job.nVersion = block.nVersion;
+    job.nBits = block.nBits;
+    job.nTime = block.nTime;
+    job.fClean = true;
+    return block;
+}
+
+#ifndef WIN32
+// Read one line from the socket, waiting up to 30 seconds
+static bool ReadLine(SOCKET hSocket, string& strBuffer, string& strLine)
+{
+    int64 nStart = GetTime();
+    size_t nPos;
+    while ((nPos = strBuffer.find('\n')) == string::npos)
+    {
+        if (GetTime() - nStart > 30)
+            return false;
+        struct timeval timeout;
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        FD_SET(hSocket, &fdsetRecv);
+        if (select(hSocket + 1, &fdsetRecv, NULL, NULL, &timeout) <= 0)
+            continue;
+        char pchBuf[4096];
+        int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), 0);
+        if (nBytes <= 0)
+            return false;
+        strBuffer.append(pchBuf, nBytes);
+    }
+    strLine = strBuffer.substr(0, nPos);
+    strBuffer.erase(0, nPos + 1);
+    return true;
+}
+
+static void SendLine(SOCKET hSocket, const Object& obj)
+{
+    string str = write_string(Value(obj), false) + "\n";
+    BOOST_REQUIRE(send(hSocket, str.data(), str.size(), MSG_NOSIGNAL) == (int)str.size());
+}
+
+static Object Response(const Value& id, const Value& result)
+{
+    Object obj;
+    obj.push_back(Pair("id", id));
+    obj.push_back(Pair("result", result));
+    obj.push_back(Pair("error", Value::null));
+    return obj;
+}
+
+static Object Notification(const string& strMethod, const Array& params)
+{
+    Object obj;
+    obj.push_back(Pair("id", Value::null));
+    obj.push_back(Pair("method", strMethod));
+    obj.push_back(Pair("params", params));
+    return obj;
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+BOOST_AUTO_TEST_CASE(stratum_header)
+{
+    vector<unsigned char> vchExtraNonce1 = ParseHex("f0000001");
+    vector<unsigned char> vchExtraNonce2 = ParseHex("01020304");
+    CStratumJob job;
+    CBlock block = PoolBlock(vchExtraNonce1, vchExtraNonce2, job);
+    block.nNonce = 0x12345678;
+
+    // The job rebuilds exactly the header of the block
+    uint256 hashMerkleRoot = job.GetMerkleRoot(vchExtraNonce1, vchExtraNonce2);
+    BOOST_CHECK(hashMerkleRoot == block.hashMerkleRoot);
+    unsigned char header[80];
+    job.BuildHeader(hashMerkleRoot, block.nNonce, header);
+    BOOST_CHECK(memcmp(header, BEGIN(block.nVersion), 80) == 0);
+
+    uint256 hash;
+    scrypt_1024_1_1_256((const char*)header, BEGIN(hash));
+    BOOST_CHECK(hash == block.GetPoWHash());
+
+    // Another extranonce2 is another block
+    BOOST_CHECK(job.GetMerkleRoot(vchExtraNonce1, ParseHex("01020305")) != block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(stratum_difficulty)
+{
+    CBigNum bnOne = CBigNum(0xffff) << 224;
+    BOOST_CHECK(StratumDifficultyToTarget(1.0) == bnOne.getuint256());
+    BOOST_CHECK(StratumDifficultyToTarget(2.0) == CBigNum(bnOne / 2).getuint256());
+    BOOST_CHECK(StratumDifficultyToTarget(1000.0) == CBigNum(bnOne / 1000).getuint256());
+    BOOST_CHECK(StratumDifficultyToTarget(1.0 / 256) == CBigNum(bnOne << 8).getuint256());
+    BOOST_CHECK(StratumDifficultyToTarget(1e-12) == ~uint256(0));
+    BOOST_CHECK(StratumDifficultyToTarget(0) == ~uint256(0));
+}
+
+#ifndef WIN32
+// Mine against a minimal pool on the loopback interface
+BOOST_AUTO_TEST_CASE(stratum_pool)
+{
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = 0;
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == 0);
+    BOOST_REQUIRE(listen(hListen, 1) == 0);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sockaddr, &len) == 0);
+
+    BOOST_REQUIRE(StartPoolMining("127.0.0.1", ntohs(sockaddr.sin_port), "worker", "x", 1));
+    BOOST_CHECK(!StartPoolMining("127.0.0.1", ntohs(sockaddr.sin_port), "worker", "x", 1));
+
+    SOCKET hSocket = accept(hListen, NULL, NULL);
+    BOOST_REQUIRE(hSocket != INVALID_SOCKET);
+
+    vector<unsigned char> vchExtraNonce1 = ParseHex("f0000001");
+    CStratumJob job;
+    PoolBlock(vchExtraNonce1, ParseHex("00000000"), job);
+    double dDifficulty = 1.0 / 256;
+
+    string strBuffer, strLine;
+    bool fSubmitted = false;
+    while (!fSubmitted && ReadLine(hSocket, strBuffer, strLine))
+    {
+        Value valRequest;
+        BOOST_REQUIRE(read_string(strLine, valRequest) && valRequest.type() == obj_type);
+        const Object& request = valRequest.get_obj();
+        string strMethod = find_value(request, "method").get_str();
+        const Value& id = find_value(request, "id");
+        const Array& params = find_value(request, "params").get_array();
+
+        if (strMethod == "mining.subscribe")
+        {
+            Array result;
+            result.push_back(Array());
+            result.push_back(HexStr(vchExtraNonce1));
+            result.push_back(4);
+            SendLine(hSocket, Response(id, result));
+        }
+        else if (strMethod == "mining.authorize")
+        {
+            BOOST_CHECK_EQUAL(params[0].get_str(), "worker");
+            SendLine(hSocket, Response(id, true));
+
+            Array diffParams;
+            diffParams.push_back(dDifficulty);
+            SendLine(hSocket, Notification("mining.set_difficulty", diffParams));
+
+            Array jobParams;
+            jobParams.push_back(job.strJobId);
+            jobParams.push_back(HexStr(job.vchPrevHash));
+            jobParams.push_back(HexStr(job.vchCoinbase1));
+            jobParams.push_back(HexStr(job.vchCoinbase2));
+            Array branch;
+            BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+                branch.push_back(HexStr(BEGIN(hash), END(hash)));
+            jobParams.push_back(branch);
+            jobParams.push_back(strprintf("%08x", job.nVersion));
+            jobParams.push_back(strprintf("%08x", job.nBits));
+            jobParams.push_back(strprintf("%08x", job.nTime));
+            jobParams.push_back(true);
+            SendLine(hSocket, Notification("mining.notify", jobParams));
+        }
+        else if (strMethod == "mining.submit")
+        {
+            // The share must meet the difficulty for the work we gave out
+            BOOST_REQUIRE_EQUAL(params.size(), 5U);
+            BOOST_CHECK_EQUAL(params[0].get_str(), "worker");
+            BOOST_CHECK_EQUAL(params[1].get_str(), job.strJobId);
+            vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+            BOOST_CHECK_EQUAL(vchExtraNonce2.size(), 4U);
+            BOOST_CHECK_EQUAL(params[3].get_str(), strprintf("%08x", job.nTime));
+            unsigned int nNonce = strtoul(params[4].get_str().c_str(), NULL, 16);
+
+            unsigned char header[80];
+            job.BuildHeader(job.GetMerkleRoot(vchExtraNonce1, vchExtraNonce2), nNonce, header);
+            uint256 hash;
+            scrypt_1024_1_1_256((const char*)header, BEGIN(hash));
+            BOOST_CHECK(hash <= StratumDifficultyToTarget(dDifficulty));
+
+            SendLine(hSocket, Response(id, true));
+            fSubmitted = true;
+        }
+    }
+    BOOST_CHECK(fSubmitted);
+
+    // Wait for the client to count the accepted share
+    CPoolMiningStats stats;
+    for (int i = 0; i < 100; i++)
+    {
+        GetPoolMiningStats(stats);
+        if (stats.nAccepted > 0)
+            break;
+        Sleep(100);
+    }
+    BOOST_CHECK(stats.fRunning);
+    BOOST_CHECK(stats.fConnected);
+    BOOST_CHECK_EQUAL(stats.strJobId, job.strJobId);
+    BOOST_CHECK(stats.nAccepted >= 1);
+
+    StopPoolMining();
+    GetPoolMiningStats(stats);
+    BOOST_CHECK(!stats.fRunning);
+    closesocket(hSocket);
+    closesocket(hListen);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
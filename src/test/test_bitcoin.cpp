@@ -1,6 +1,7 @@
 #define BOOST_TEST_MODULE Bitcoin Test Suite
 #include <boost/test/unit_test.hpp>
 
+#include "db.h"
 #include "main.h"
 #include "wallet.h"
 
@@ -11,9 +12,20 @@ extern bool fPrintToConsole;
 extern void noui_connect();
 
 struct TestingSetup {
+    boost::filesystem::path pathTemp;
+
     TestingSetup() {
         fPrintToConsole = true; // don't want to write to debug.log file
         noui_connect();
+        // Tests that use databases get a data directory of their own
+#if BOOST_FILESYSTEM_VERSION >= 3
+        pathTemp = boost::filesystem::temp_directory_path();
+#else
+        pathTemp = boost::filesystem::current_path();
+#endif
+        pathTemp /= strprintf("test_AuroraCoin_%"PRI64d"_%d", GetTime(), GetRandInt(100000));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
         pwalletMain = new CWallet();
         RegisterWallet(pwalletMain);
     }
@@ -21,6 +33,8 @@ struct TestingSetup {
     {
         delete pwalletMain;
         pwalletMain = NULL;
+        bitdb.Flush(true);
+        boost::filesystem::remove_all(pathTemp);
     }
 };
 
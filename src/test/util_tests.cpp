@@ -259,4 +259,92 @@ BOOST_AUTO_TEST_CASE(util_IsHex)
     BOOST_CHECK(!IsHex("0x0000"));
 }
 
+static CCriticalSection csLockStatsTest;
+
+static const CLockStats* FindLockStats(const vector<CLockStats>& vStats, int nLine)
+{
+    BOOST_FOREACH(const CLockStats& stats, vStats)
+        if (stats.strName == "csLockStatsTest" && stats.nLine == nLine)
+            return &stats;
+    return NULL;
+}
+
+static void LockStatsTestThread(int* pnLine)
+{
+    *pnLine = __LINE__ + 1;
+    LOCK(csLockStatsTest);
+}
+
+BOOST_AUTO_TEST_CASE(util_LockStats)
+{
+    int nLine = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        nLine = __LINE__ + 1;
+        LOCK(csLockStatsTest);
+    }
+    vector<CLockStats> vStats;
+    GetLockStats(vStats);
+    const CLockStats* pstats = FindLockStats(vStats, nLine);
+    BOOST_REQUIRE(pstats);
+    BOOST_CHECK_EQUAL(pstats->nAcquired, 10);
+    BOOST_CHECK_EQUAL(pstats->nContended, 0);
+    BOOST_CHECK_EQUAL(pstats->nWaitMicros, 0);
+
+    // Another thread has to wait while we hold the lock, release it only
+    // once the thread is blocked on it
+    int nThreadLine = 0;
+    int64 nStart = GetTimeMillis();
+    {
+        LOCK(csLockStatsTest);
+        boost::thread thread(LockStatsTestThread, &nThreadLine);
+        do
+        {
+            boost::this_thread::yield();
+            GetLockStats(vStats);
+            pstats = nThreadLine ? FindLockStats(vStats, nThreadLine) : NULL;
+        } while (!pstats || pstats->nWaiting == 0);
+        BOOST_CHECK_EQUAL(pstats->nAcquired, 0);
+        criticalblock.Leave();
+        thread.join();
+    }
+    GetLockStats(vStats);
+    pstats = FindLockStats(vStats, nThreadLine);
+    BOOST_REQUIRE(pstats);
+    BOOST_CHECK_EQUAL(pstats->nAcquired, 1);
+    BOOST_CHECK_EQUAL(pstats->nContended, 1);
+    BOOST_CHECK_EQUAL(pstats->nWaiting, 0);
+    BOOST_CHECK(pstats->nWaitMicros > 0);
+    BOOST_CHECK(pstats->nWaitMicros <= (GetTimeMillis() - nStart + 1) * 1000);
+
+    ResetLockStats();
+    GetLockStats(vStats);
+    BOOST_CHECK(FindLockStats(vStats, nLine) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(util_ParseLogCategories)
+{
+    vector<string> v;
+    BOOST_CHECK_EQUAL(ParseLogCategories(v), 0U);
+    v.push_back("");
+    BOOST_CHECK_EQUAL(ParseLogCategories(v), (unsigned int)LOG_ALL);
+    v[0] = "0";
+    BOOST_CHECK_EQUAL(ParseLogCategories(v), 0U);
+    v[0] = "net,mining";
+    BOOST_CHECK_EQUAL(ParseLogCategories(v), (unsigned int)(LOG_NET | LOG_MINING));
+    v.push_back("lock");
+    v.push_back("nosuchcategory");
+    BOOST_CHECK_EQUAL(ParseLogCategories(v), (unsigned int)(LOG_NET | LOG_MINING | LOG_LOCK));
+
+    // The arguments of a disabled category are never evaluated
+    unsigned int nLogCategoriesSaved = nLogCategories;
+    nLogCategories = LOG_NET;
+    int nEvaluated = 0;
+    LogPrint(LOG_MINING, "%d\n", ++nEvaluated);
+    BOOST_CHECK_EQUAL(nEvaluated, 0);
+    LogPrint(LOG_NET, "%d\n", ++nEvaluated);
+    BOOST_CHECK_EQUAL(nEvaluated, 1);
+    nLogCategories = nLogCategoriesSaved;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 
 #include "main.h"
 #include "wallet.h"
+#include "walletdb.h"
 
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
@@ -292,4 +293,121 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_large)
+{
+    static CoinSet setCoinsRet;
+    static int64 nValueRet;
+
+    // A payout wallet with lots of small coins, an exact subset is found
+    // without going through the stochastic approximation
+    empty_wallet();
+    for (int i = 0; i < 100000; i++)
+        add_coin((1 + GetRandInt(1000)) * CENT);
+
+    int64 nStart = GetTimeMillis();
+    BOOST_CHECK(wallet.SelectCoinsMinConf(12345 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 12345 * CENT);
+    BOOST_TEST_MESSAGE(strprintf("selected %d of %d coins in %"PRI64d"ms", (int)setCoinsRet.size(), (int)vCoins.size(), GetTimeMillis() - nStart));
+
+    // Without one, selection still finishes in bounded time
+    nStart = GetTimeMillis();
+    BOOST_CHECK(wallet.SelectCoinsMinConf(12345 * CENT + 1, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK(nValueRet > 12345 * CENT + 1);
+    BOOST_TEST_MESSAGE(strprintf("selected %d of %d coins in %"PRI64d"ms", (int)setCoinsRet.size(), (int)vCoins.size(), GetTimeMillis() - nStart));
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(unlock_cache)
+{
+    // Its destructor stops the expiry thread
+    CWallet cryptwallet;
+    SecureString strPassphrase("correct horse");
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE, 0x42);
+    CMasterKey kMasterKey;
+    kMasterKey.vchSalt.assign(WALLET_CRYPTO_SALT_SIZE, 0x17);
+    kMasterKey.nDeriveIterations = 25000;
+    CCrypter crypter;
+    BOOST_REQUIRE(crypter.SetKeyFromPassphrase(strPassphrase, kMasterKey.vchSalt, kMasterKey.nDeriveIterations, kMasterKey.nDerivationMethod));
+    BOOST_REQUIRE(crypter.Encrypt(vMasterKey, kMasterKey.vchCryptedKey));
+    cryptwallet.mapMasterKeys[1] = kMasterKey;
+
+    CKey key;
+    key.MakeNewKey(true);
+    bool fCompressed;
+    vector<unsigned char> vchCryptedSecret;
+    BOOST_REQUIRE(EncryptSecret(vMasterKey, key.GetSecret(fCompressed), key.GetPubKey().GetHash(), vchCryptedSecret));
+    BOOST_REQUIRE(cryptwallet.LoadCryptedKey(key.GetPubKey(), vchCryptedSecret));
+    BOOST_CHECK(cryptwallet.IsLocked());
+
+    // Nothing is cached unless asked for
+    BOOST_CHECK(cryptwallet.Unlock(strPassphrase));
+    BOOST_CHECK(cryptwallet.Lock());
+    BOOST_CHECK(!cryptwallet.ExpireUnlockCache());
+
+    mapArgs["-walletunlockcache"] = "60";
+    BOOST_CHECK(!cryptwallet.Unlock(SecureString("wrong")));
+    BOOST_CHECK(cryptwallet.Unlock(strPassphrase));
+    BOOST_CHECK(cryptwallet.Lock());
+    BOOST_CHECK(cryptwallet.ExpireUnlockCache());
+
+    // Stopping the expiry thread forgets the key, the next unlock starts it again
+    cryptwallet.StopUnlockCacheExpiry();
+    BOOST_CHECK(!cryptwallet.ExpireUnlockCache());
+    BOOST_CHECK(cryptwallet.Unlock(strPassphrase));
+    BOOST_CHECK(cryptwallet.Lock());
+    BOOST_CHECK(cryptwallet.ExpireUnlockCache());
+
+    // Once cached, the passphrase unlocks without deriving the key again
+    cryptwallet.mapMasterKeys[1].vchCryptedKey[0] ^= 1;
+    BOOST_CHECK(!cryptwallet.Unlock(SecureString("wrong")));
+    BOOST_CHECK(cryptwallet.IsLocked());
+    BOOST_CHECK(cryptwallet.Unlock(strPassphrase));
+    BOOST_CHECK(!cryptwallet.IsLocked());
+    BOOST_CHECK(cryptwallet.Lock());
+
+    BOOST_CHECK(!cryptwallet.ExpireUnlockCache(true));
+    BOOST_CHECK(!cryptwallet.Unlock(strPassphrase));
+    mapArgs.erase("-walletunlockcache");
+}
+
+BOOST_AUTO_TEST_CASE(keypool_AddKeysToPool)
+{
+    CWalletDB("keypool_test.dat", "cr+");
+    CWallet keywallet("keypool_test.dat");
+    mapArgs["-keypool"] = "5";
+
+    vector<CKey> vKeys(3);
+    BOOST_FOREACH(CKey& key, vKeys)
+        key.MakeNewKey(true);
+    {
+        LOCK(keywallet.cs_wallet);
+        BOOST_CHECK(keywallet.AddKeysToPool(vKeys, 1));
+        BOOST_CHECK_EQUAL(keywallet.GetKeyPoolSize(), 3);
+    }
+
+    // Each key is in the wallet and pooled in the database, in order
+    {
+        CWalletDB walletdb("keypool_test.dat");
+        for (unsigned int i = 0; i < vKeys.size(); i++)
+        {
+            CKeyPool keypool;
+            BOOST_CHECK(walletdb.ReadPool(i + 1, keypool));
+            BOOST_CHECK(keypool.vchPubKey == vKeys[i].GetPubKey());
+            BOOST_CHECK(keywallet.HaveKey(vKeys[i].GetPubKey().GetID()));
+        }
+    }
+
+    // Topping up continues after them, and the oldest key is used first
+    BOOST_CHECK(keywallet.TopUpKeyPool());
+    BOOST_CHECK_EQUAL(keywallet.GetKeyPoolSize(), 6);
+    CPubKey pubkey;
+    BOOST_CHECK(keywallet.GetKeyFromPool(pubkey, false));
+    BOOST_CHECK(pubkey == vKeys[0].GetPubKey());
+    BOOST_CHECK_EQUAL(keywallet.GetKeyPoolSize(), 5);
+    CKeyPool keypool;
+    BOOST_CHECK(!CWalletDB("keypool_test.dat").ReadPool(1, keypool));
+
+    mapArgs.erase("-keypool");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -79,7 +79,8 @@ public:
     /** Translate a message to the native language of the user. */
     boost::signals2::signal<std::string (const char* psz)> Translate;
 
-    /** Block chain changed. */
+    /** Block chain or the peers' idea of its height changed. Sent very often
+     * while syncing, handlers should only note that an update is due. */
     boost::signals2::signal<void ()> NotifyBlocksChanged;
 
     /** Number of network connections changed. */
@@ -90,6 +91,9 @@ public:
      * @note called with lock cs_mapAlerts held.
      */
     boost::signals2::signal<void (const uint256 &hash, ChangeType status)> NotifyAlertChanged;
+
+    /** Pool mining client event (a PoolMiningEvent), with a message for the user. */
+    boost::signals2::signal<void (int nEvent, const std::string& message)> NotifyPoolMining;
 };
 
 extern CClientUIInterface uiInterface;
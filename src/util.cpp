@@ -11,6 +11,8 @@
 #include "version.h"
 #include "ui_interface.h"
 #include <boost/algorithm/string/join.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
 
 // Work around clang compilation problem in Boost 1.46:
 // /usr/include/boost/program_options/detail/config_file.hpp:163:17: error: call to function 'to_internal' that is neither visible in the template definition nor found by argument-dependent lookup
@@ -76,6 +78,7 @@ bool fNoListen = false;
 bool fLogTimestamps = false;
 CMedianFilter<int64> vTimeOffsets(200,0);
 bool fReopenDebugLog = false;
+unsigned int nLogCategories = 0;
 
 // Init openssl library multithreading support
 static CCriticalSection** ppmutexOpenSSL;
@@ -195,6 +198,125 @@ uint256 GetRandHash()
 
 
 
+//
+// debug.log is written by a separate thread. Callers only format their
+// message and append it to strLogBuffer, so they never wait for disk I/O
+// while holding locks such as cs_main.
+//
+static boost::mutex mutexDebugLog;         // protects the variables below
+static boost::condition_variable condDebugLog;
+static std::string strLogBuffer;
+static bool fStartedNewLine = true;
+static bool fLogWriterRunning = false;
+static boost::mutex mutexDebugLogFile;     // held while writing the buffer out
+
+// Above this many bytes callers write the buffer themselves rather than
+// letting it grow while the writer thread falls behind
+static const unsigned int MAX_LOG_BUFFER = 4 * 1000000;
+
+static void WriteLogBuffer()
+{
+    boost::mutex::scoped_lock lockFile(mutexDebugLogFile);
+    std::string strWrite;
+    {
+        boost::mutex::scoped_lock lock(mutexDebugLog);
+        strWrite.swap(strLogBuffer);
+    }
+    if (strWrite.empty() && !fReopenDebugLog)
+        return;
+
+    static FILE* fileout = NULL;
+    if (!fileout)
+    {
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        fileout = fopen(pathDebug.string().c_str(), "a");
+    }
+    else if (fReopenDebugLog)
+    {
+        // reopen the log file, if requested
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(), "a", fileout) == NULL)
+            fileout = NULL;
+    }
+    fReopenDebugLog = false;
+    if (fileout)
+    {
+        fwrite(strWrite.data(), 1, strWrite.size(), fileout);
+        fflush(fileout);
+    }
+}
+
+static void ThreadLogWriter(void* parg)
+{
+    RenameThread("bitcoin-log");
+    loop
+    {
+        {
+            boost::mutex::scoped_lock lock(mutexDebugLog);
+            while (fLogWriterRunning && strLogBuffer.empty() && !fReopenDebugLog)
+                condDebugLog.wait(lock);
+            if (!fLogWriterRunning)
+                break;
+        }
+        // Everything logged while this write is in progress goes out with the next one
+        WriteLogBuffer();
+    }
+}
+
+void StartLogWriter()
+{
+    {
+        boost::mutex::scoped_lock lock(mutexDebugLog);
+        if (fLogWriterRunning || fPrintToConsole)
+            return;
+        fLogWriterRunning = true;
+    }
+    if (!CreateThread(ThreadLogWriter, NULL))
+    {
+        boost::mutex::scoped_lock lock(mutexDebugLog);
+        fLogWriterRunning = false;
+    }
+}
+
+void StopLogWriter()
+{
+    {
+        boost::mutex::scoped_lock lock(mutexDebugLog);
+        fLogWriterRunning = false;
+    }
+    condDebugLog.notify_all();
+    WriteLogBuffer();
+}
+
+unsigned int ParseLogCategories(const std::vector<std::string>& vCategories)
+{
+    static const struct { const char* pszName; unsigned int nCategory; } categories[] =
+    {
+        { "net",      LOG_NET },
+        { "mempool",  LOG_MEMPOOL },
+        { "mining",   LOG_MINING },
+        { "retarget", LOG_RETARGET },
+        { "lock",     LOG_LOCK },
+    };
+
+    unsigned int nCategories = 0;
+    BOOST_FOREACH(const std::string& strArg, vCategories)
+    {
+        std::vector<std::string> vNames;
+        boost::split(vNames, strArg, boost::is_any_of(","));
+        BOOST_FOREACH(const std::string& strName, vNames)
+        {
+            // plain -debug (or -debug=1) turns everything on
+            if (strName == "" || strName == "1" || strName == "all")
+                nCategories = LOG_ALL;
+            for (unsigned int i = 0; i < ARRAYLEN(categories); i++)
+                if (strName == categories[i].pszName)
+                    nCategories |= categories[i].nCategory;
+        }
+    }
+    return nCategories;
+}
+
 inline int OutputDebugStringF(const char* pszFormat, ...)
 {
     int ret = 0;
@@ -208,42 +330,41 @@ inline int OutputDebugStringF(const char* pszFormat, ...)
     }
     else
     {
-        // print to debug.log
-        static FILE* fileout = NULL;
+        // format outside of the lock
+        va_list arg_ptr;
+        va_start(arg_ptr, pszFormat);
+        std::string str = vstrprintf(pszFormat, arg_ptr);
+        va_end(arg_ptr);
+        ret = str.size();
 
-        if (!fileout)
-        {
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            fileout = fopen(pathDebug.string().c_str(), "a");
-            if (fileout) setbuf(fileout, NULL); // unbuffered
-        }
-        if (fileout)
+        bool fWriteNow;
+        bool fWasEmpty;
         {
-            static bool fStartedNewLine = true;
-            static boost::mutex mutexDebugLog;
-            boost::mutex::scoped_lock scoped_lock(mutexDebugLog);
-
-            // reopen the log file, if requested
-            if (fReopenDebugLog) {
-                fReopenDebugLog = false;
-                boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-                if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                    setbuf(fileout, NULL); // unbuffered
-            }
+            boost::mutex::scoped_lock lock(mutexDebugLog);
+            fWasEmpty = strLogBuffer.empty();
 
-            // Debug print useful for profiling
+            // Debug print useful for profiling. The timestamp only changes once a second.
             if (fLogTimestamps && fStartedNewLine)
-                fprintf(fileout, "%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-            if (pszFormat[strlen(pszFormat) - 1] == '\n')
-                fStartedNewLine = true;
-            else
-                fStartedNewLine = false;
+            {
+                static int64 nTimestamp = 0;
+                static std::string strTimestamp;
+                int64 nNow = GetTime();
+                if (nNow != nTimestamp)
+                {
+                    nTimestamp = nNow;
+                    strTimestamp = DateTimeStrFormat("%x %H:%M:%S", nNow) + " ";
+                }
+                strLogBuffer += strTimestamp;
+            }
+            fStartedNewLine = !str.empty() && str[str.size() - 1] == '\n';
+            strLogBuffer += str;
 
-            va_list arg_ptr;
-            va_start(arg_ptr, pszFormat);
-            ret = vfprintf(fileout, pszFormat, arg_ptr);
-            va_end(arg_ptr);
+            fWriteNow = !fLogWriterRunning || strLogBuffer.size() > MAX_LOG_BUFFER;
         }
+        if (fWriteNow)
+            WriteLogBuffer();
+        else if (fWasEmpty)
+            condDebugLog.notify_one();
     }
 
 #ifdef WIN32
@@ -121,9 +121,29 @@ extern bool fNoListen;
 extern bool fLogTimestamps;
 extern bool fReopenDebugLog;
 
+/** Debug log categories, selected with -debug=<category> */
+enum
+{
+    LOG_NET      = (1U << 0),
+    LOG_MEMPOOL  = (1U << 1),
+    LOG_MINING   = (1U << 2),
+    LOG_RETARGET = (1U << 3),
+    LOG_LOCK     = (1U << 4),
+
+    LOG_ALL      = ~0U,
+};
+extern unsigned int nLogCategories;
+
+/** Only evaluates the arguments if the category is enabled */
+#define LogAcceptCategory(category) ((nLogCategories & (category)) != 0)
+#define LogPrint(category, ...) do { if (LogAcceptCategory(category)) printf(__VA_ARGS__); } while (0)
+
 void RandAddSeed();
 void RandAddSeedPerfmon();
 int OutputDebugStringF(const char* pszFormat, ...);
+unsigned int ParseLogCategories(const std::vector<std::string>& vCategories);
+void StartLogWriter();
+void StopLogWriter();
 int my_snprintf(char* buffer, size_t limit, const char* format, ...);
 
 /* It is not allowed to use va_start with a pass-by-reference argument.
@@ -290,6 +310,12 @@ inline int64 GetTimeMillis()
             boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_milliseconds();
 }
 
+inline int64 GetTimeMicros()
+{
+    return (boost::posix_time::ptime(boost::posix_time::microsec_clock::universal_time()) -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
 inline std::string DateTimeStrFormat(const char* pszFormat, int64 nTime)
 {
     time_t n = nTime;
@@ -33,7 +33,7 @@ extern const std::string CLIENT_DATE;
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 1030000;
+static const int PROTOCOL_VERSION = 1030100;
 
 // earlier versions not supported as of Feb 2012, and are disconnected
 static const int MIN_PROTO_VERSION = 209;
@@ -49,4 +49,7 @@ static const int NOBLKS_VERSION_END = 32400;
 // BIP 0031, pong message, is enabled for all versions AFTER this one
 static const int BIP0031_VERSION = 60000;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" messages, starting with this version
+static const int COMPACT_BLOCKS_VERSION = 1030100;
+
 #endif
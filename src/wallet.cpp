@@ -11,6 +11,8 @@
 #include "ui_interface.h"
 #include "base58.h"
 
+#include <openssl/sha.h>
+
 using namespace std;
 
 
@@ -52,7 +54,12 @@ bool CWallet::AddKey(const CKey& key)
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
+    {
+        LOCK(cs_wallet);
+        if (pwalletdbEncryption)
+            return pwalletdbEncryption->WriteKey(key.GetPubKey(), key.GetPrivKey());
         return CWalletDB(strWalletFile).WriteKey(key.GetPubKey(), key.GetPrivKey());
+    }
     return true;
 }
 
@@ -81,6 +88,82 @@ bool CWallet::AddCScript(const CScript& redeemScript)
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
+// Salted digest to recognise a passphrase again without deriving its key
+static void HashPassphrase(const SecureString& strPassphrase, const std::vector<unsigned char>& vchSalt, CKeyingMaterial& vchHash)
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    if (!vchSalt.empty())
+        SHA256_Update(&ctx, &vchSalt[0], vchSalt.size());
+    SHA256_Update(&ctx, strPassphrase.data(), strPassphrase.size());
+    vchHash.resize(SHA256_DIGEST_LENGTH);
+    SHA256_Final(&vchHash[0], &ctx);
+    OPENSSL_cleanse(&ctx, sizeof(ctx));
+}
+
+static void ThreadExpireUnlockCache(CWallet* pwallet)
+{
+    // Make this thread recognisable as the unlock cache expiry thread
+    RenameThread("bitcoin-unlk-ca");
+
+    try
+    {
+        while (true)
+        {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(500));
+            pwallet->ExpireUnlockCache();
+        }
+    }
+    catch (boost::thread_interrupted&)
+    {
+    }
+}
+
+bool CWallet::ExpireUnlockCache(bool fForce)
+{
+    LOCK(cs_wallet);
+    if (vCachedMasterKey.empty())
+        return false;
+    if (!fForce && GetTime() < nCachedMasterKeyExpires)
+        return true;
+    vCachedMasterKey.clear();
+    vchCachedPassphraseHash.clear();
+    nCachedMasterKeyExpires = 0;
+    return false;
+}
+
+void CWallet::CacheMasterKey(const CKeyingMaterial& vchPassphraseHash, const CKeyingMaterial& vMasterKey)
+{
+    int64 nSeconds = GetArg("-walletunlockcache", 0);
+    if (nSeconds <= 0)
+        return;
+
+    // The expiry thread is started with the first cached key and runs
+    // until the wallet is destroyed
+    if (threadExpireUnlockCache.get_id() == boost::thread::id())
+    {
+        try
+        {
+            boost::thread(ThreadExpireUnlockCache, this).swap(threadExpireUnlockCache);
+        }
+        catch (boost::thread_resource_error&)
+        {
+            printf("CWallet::CacheMasterKey : could not start the expiry thread, not caching\n");
+            return;
+        }
+    }
+    vCachedMasterKey = vMasterKey;
+    vchCachedPassphraseHash = vchPassphraseHash;
+    nCachedMasterKeyExpires = GetTime() + nSeconds;
+}
+
+void CWallet::StopUnlockCacheExpiry()
+{
+    ExpireUnlockCache(true);
+    threadExpireUnlockCache.interrupt();
+    threadExpireUnlockCache.join();
+}
+
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
 {
     if (!IsLocked())
@@ -91,6 +174,14 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
 
     {
         LOCK(cs_wallet);
+        if (mapMasterKeys.empty())
+            return false;
+        CKeyingMaterial vchPassphraseHash;
+        HashPassphrase(strWalletPassphrase, mapMasterKeys.begin()->second.vchSalt, vchPassphraseHash);
+        if (!vCachedMasterKey.empty() && GetTime() < nCachedMasterKeyExpires && vchPassphraseHash == vchCachedPassphraseHash)
+            return CCryptoKeyStore::Unlock(vCachedMasterKey);
+
+        int64 nStart = GetTimeMillis();
         BOOST_FOREACH(const MasterKeyMap::value_type& pMasterKey, mapMasterKeys)
         {
             if(!crypter.SetKeyFromPassphrase(strWalletPassphrase, pMasterKey.second.vchSalt, pMasterKey.second.nDeriveIterations, pMasterKey.second.nDerivationMethod))
@@ -98,7 +189,11 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 return false;
             if (CCryptoKeyStore::Unlock(vMasterKey))
+            {
+                printf("CWallet::Unlock : key derivation took %"PRI64d"ms\n", GetTimeMillis() - nStart);
+                CacheMasterKey(vchPassphraseHash, vMasterKey);
                 return true;
+            }
         }
     }
     return false;
@@ -111,6 +206,7 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
     {
         LOCK(cs_wallet);
         Lock();
+        ExpireUnlockCache(true);
 
         CCrypter crypter;
         CKeyingMaterial vMasterKey;
@@ -791,6 +887,8 @@ void CWalletTx::RelayWalletTransaction(CTxDB& txdb)
         if (!txdb.ContainsTx(hash))
         {
             printf("Relaying wtx %s\n", hash.ToString().substr(0,10).c_str());
+            if (fFromMe)
+                AddOwnInventory(CInv(MSG_TX, hash));
             RelayMessage(CInv(MSG_TX, hash), (CTransaction)*this);
         }
     }
@@ -929,7 +1027,7 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed) const
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
+static void ApproximateBestSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTotalLower, int64 nTargetValue,
                                   vector<char>& vfBest, int64& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -967,7 +1065,57 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
     }
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+// Branch and bound search for a subset of vValue, sorted by decreasing value,
+// that adds up to exactly nTargetValue. Gives up after nMaxTries steps.
+static bool SelectCoinsExact(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue,
+                             vector<char>& vfBest, int nMaxTries = 100000)
+{
+    unsigned int nSize = vValue.size();
+
+    // Sum of the coins from each position on, to cut off branches that can't
+    // reach the target anymore
+    vector<int64> vRemaining(nSize + 1, 0);
+    for (unsigned int i = nSize; i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<char> vfIncluded(nSize, false);
+    vector<unsigned int> vIncluded;
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBest = vfIncluded;
+            return true;
+        }
+        if (i < nSize && nTotal + vRemaining[i] >= nTargetValue)
+        {
+            // Take the coin if it fits, try without it when backtracking
+            if (nTotal + vValue[i].first <= nTargetValue)
+            {
+                nTotal += vValue[i].first;
+                vfIncluded[i] = true;
+                vIncluded.push_back(i);
+            }
+            i++;
+            continue;
+        }
+
+        // Backtrack, leave out the last coin taken. Coins of the same value
+        // would only lead to the same sums again.
+        if (vIncluded.empty())
+            return false;
+        unsigned int j = vIncluded.back();
+        vIncluded.pop_back();
+        nTotal -= vValue[j].first;
+        vfIncluded[j] = false;
+        for (i = j + 1; i < nSize && vValue[i].first == vValue[j].first; i++);
+    }
+    return false;
+}
+
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
@@ -980,9 +1128,13 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Instead of shuffling all coins, pick at random among coins of the
+    // same value that could be taken on their own
+    pair<const CWalletTx*,unsigned int> coinExact(NULL, 0);
+    int nExact = 0;
+    int nLowestLarger = 0;
 
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -996,9 +1148,8 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
 
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            if (GetRandInt(++nExact) == 0)
+                coinExact = coin.second;
         }
         else if (n < nTargetValue + CENT)
         {
@@ -1006,11 +1157,23 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
             nTotalLower += n;
         }
         else if (n < coinLowestLarger.first)
+        {
+            coinLowestLarger = coin;
+            nLowestLarger = 1;
+        }
+        else if (n == coinLowestLarger.first && GetRandInt(++nLowestLarger) == 0)
         {
             coinLowestLarger = coin;
         }
     }
 
+    if (nExact > 0)
+    {
+        setCoinsRet.insert(coinExact);
+        nValueRet += nTargetValue;
+        return true;
+    }
+
     if (nTotalLower == nTargetValue)
     {
         for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -1030,14 +1193,24 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Coins of the same value end up in random order
+    random_shuffle(vValue.begin(), vValue.end(), GetRandInt);
+    stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     int64 nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    // Look for a set of coins that needs no change first. Otherwise solve
+    // subset sum by stochastic approximation, each iteration walks all the
+    // coins so big wallets get fewer of them.
+    int nIterations = max(10, min(1000, 10000000 / (int)vValue.size()));
+    if (SelectCoinsExact(vValue, nTargetValue, vfBest))
+        nBest = nTargetValue;
+    else
+    {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nIterations);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1066,11 +1239,8 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     return true;
 }
 
-bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+bool CWallet::SelectCoins(int64 nTargetValue, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins);
-
     return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
             SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
             SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet));
@@ -1098,6 +1268,10 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
         // txdb must be opened before the mapWallet lock
         CTxDB txdb("r");
         {
+            // The spendable coins don't change while we look for the fee
+            vector<COutput> vCoins;
+            AvailableCoins(vCoins);
+
             nFeeRet = nTransactionFee;
             loop
             {
@@ -1114,7 +1288,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 int64 nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn))
+                if (!SelectCoins(nTotalValue, vCoins, setCoins, nValueIn))
                     return false;
                 BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
                 {
@@ -1399,6 +1573,67 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
     return true;
 }
 
+static void MakeNewKeyRange(vector<CKey>* pvKeys, unsigned int nBegin, unsigned int nEnd, bool fCompressed)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++)
+        (*pvKeys)[i].MakeNewKey(fCompressed);
+}
+
+// Generating a key is by far the slowest part of filling the key pool,
+// large batches are spread over all cores
+static void MakeNewKeys(vector<CKey>& vKeys, bool fCompressed)
+{
+    RandAddSeedPerfmon();
+    unsigned int nThreads = min(boost::thread::hardware_concurrency(), (unsigned int)vKeys.size() / 100);
+    if (nThreads <= 1)
+    {
+        MakeNewKeyRange(&vKeys, 0, vKeys.size(), fCompressed);
+        return;
+    }
+    boost::thread_group threadGroup;
+    unsigned int nPerThread = (vKeys.size() + nThreads - 1) / nThreads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&MakeNewKeyRange, &vKeys, min(i * nPerThread, (unsigned int)vKeys.size()),
+                                              min((i + 1) * nPerThread, (unsigned int)vKeys.size()), fCompressed));
+    threadGroup.join_all();
+}
+
+// Store new keys and put them in the key pool at nFirstIndex onwards, all
+// in one database transaction. Call with cs_wallet held.
+bool CWallet::AddKeysToPool(vector<CKey>& vKeys, int64 nFirstIndex)
+{
+    if (vKeys.empty())
+        return true;
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (vKeys[0].IsCompressed())
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    CWalletDB walletdb(strWalletFile);
+    bool fTxn = fFileBacked && walletdb.TxnBegin();
+    if (fTxn)
+        pwalletdbEncryption = &walletdb;
+
+    bool fOk = true;
+    for (unsigned int i = 0; i < vKeys.size() && fOk; i++)
+        fOk = AddKey(vKeys[i]) && walletdb.WritePool(nFirstIndex + i, CKeyPool(vKeys[i].GetPubKey()));
+
+    if (fTxn)
+    {
+        pwalletdbEncryption = NULL;
+        if (fOk)
+            fOk = walletdb.TxnCommit();
+        else
+            walletdb.TxnAbort();
+    }
+    if (!fOk)
+        return false;
+
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        setKeyPool.insert(nFirstIndex + i);
+    return true;
+}
+
 //
 // Mark old keypool keys as used,
 // and generate all new keys
@@ -1416,12 +1651,10 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        vector<CKey> vKeys(nKeys);
+        MakeNewKeys(vKeys, CanSupportFeature(FEATURE_COMPRPUBKEY));
+        if (!AddKeysToPool(vKeys, 1))
+            throw runtime_error("NewKeyPool() : writing generated keys failed");
         printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
     }
     return true;
@@ -1429,26 +1662,43 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool()
 {
+    // The keys are generated without holding cs_wallet, a large refill
+    // doesn't stall everything else that uses the wallet
+    unsigned int nMissing;
+    bool fCompressed;
     {
         LOCK(cs_wallet);
 
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
+        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
+        nMissing = setKeyPool.size() < nTargetSize + 1 ? nTargetSize + 1 - setKeyPool.size() : 0;
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+    }
+    if (nMissing == 0)
+        return true;
 
-        // Top up key pool
+    vector<CKey> vKeys(nMissing);
+    MakeNewKeys(vKeys, fCompressed);
+
+    {
+        LOCK(cs_wallet);
+
+        // The wallet may have been locked, or topped up by someone else
+        if (IsLocked())
+            return false;
         unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
-        {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRI64d", size=%d\n", nEnd, setKeyPool.size());
-        }
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
+        vKeys.resize(min((unsigned int)vKeys.size(), nTargetSize + 1 - (unsigned int)setKeyPool.size()));
+
+        int64 nEnd = 1;
+        if (!setKeyPool.empty())
+            nEnd = *(--setKeyPool.end()) + 1;
+        if (!AddKeysToPool(vKeys, nEnd))
+            throw runtime_error("TopUpKeyPool() : writing generated keys failed");
+        printf("keypool added keys %"PRI64d"-%"PRI64d", size=%d\n", nEnd, nEnd + (int64)vKeys.size() - 1, (int)setKeyPool.size());
     }
     return true;
 }
@@ -1457,12 +1707,13 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
     keypool.vchPubKey = CPubKey();
+
+    if (!IsLocked())
+        TopUpKeyPool();
+
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
-
         // Get the oldest key
         if(setKeyPool.empty())
             return;
@@ -1520,6 +1771,10 @@ bool CWallet::GetKeyFromPool(CPubKey& result, bool fAllowReuse)
 {
     int64 nIndex = 0;
     CKeyPool keypool;
+
+    // Before taking cs_wallet, so an empty pool isn't refilled under it
+    if (!IsLocked())
+        TopUpKeyPool();
     {
         LOCK(cs_wallet);
         ReserveKeyFromKeyPool(nIndex, keypool);
@@ -63,10 +63,21 @@ public:
 class CWallet : public CCryptoKeyStore
 {
 private:
-    bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoins(int64 nTargetValue, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
 
+    // Open database transaction while encrypting the wallet or filling the
+    // key pool, new keys are written through it
     CWalletDB *pwalletdbEncryption;
 
+    // Master key of the last unlock, kept for -walletunlockcache seconds so
+    // unlocking again with the same passphrase skips the key derivation
+    CKeyingMaterial vCachedMasterKey;
+    CKeyingMaterial vchCachedPassphraseHash;
+    int64 nCachedMasterKeyExpires;
+    boost::thread threadExpireUnlockCache;
+
+    void CacheMasterKey(const CKeyingMaterial& vchPassphraseHash, const CKeyingMaterial& vMasterKey);
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -93,6 +104,7 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        nCachedMasterKeyExpires = 0;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -102,6 +114,11 @@ public:
         fFileBacked = true;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        nCachedMasterKeyExpires = 0;
+    }
+    ~CWallet()
+    {
+        StopUnlockCacheExpiry();
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -115,7 +132,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
 
     // keystore implementation
     // Generate a new key
@@ -137,6 +154,11 @@ public:
     bool Unlock(const SecureString& strWalletPassphrase);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
     bool EncryptWallet(const SecureString& strWalletPassphrase);
+    // Forget the cached master key, returns whether it is still cached
+    bool ExpireUnlockCache(bool fForce = false);
+    // Forget the cached master key and join the thread expiring it. Must
+    // not be called with cs_wallet held.
+    void StopUnlockCacheExpiry();
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn);
@@ -158,6 +180,7 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool();
+    bool AddKeysToPool(std::vector<CKey>& vKeys, int64 nFirstIndex);
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
@@ -8,6 +8,9 @@
 #include "walletdb.h"
 #include "wallet.h"
 #include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost;
@@ -104,12 +107,135 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 }
 
 
+// Transactions and keys are costly to parse. LoadWallet only collects
+// their records while reading the file, they are parsed on all cores
+// afterwards.
+struct CWalletTxRecord
+{
+    uint256 hash;
+    CWalletTx* pwtx;
+    CDataStream ssValue;
+    bool fUpgraded;
+    bool fError;
+
+    CWalletTxRecord(const uint256& hashIn, CWalletTx* pwtxIn, const CDataStream& ssValueIn) :
+        hash(hashIn), pwtx(pwtxIn), ssValue(ssValueIn), fUpgraded(false), fError(false) {}
+};
+
+struct CWalletKeyRecord
+{
+    bool fWalletKey;
+    vector<unsigned char> vchPubKey;
+    CDataStream ssValue;
+    CKey key;
+    string strError;
+
+    CWalletKeyRecord(bool fWalletKeyIn, const vector<unsigned char>& vchPubKeyIn, const CDataStream& ssValueIn) :
+        fWalletKey(fWalletKeyIn), vchPubKey(vchPubKeyIn), ssValue(ssValueIn) {}
+};
+
+static void ParseTxRecords(vector<CWalletTxRecord>* pvRecords, CWallet* pwallet, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++)
+    {
+        CWalletTxRecord& rec = (*pvRecords)[i];
+        CWalletTx& wtx = *rec.pwtx;
+        try
+        {
+            rec.ssValue >> wtx;
+            wtx.BindWallet(pwallet);
+
+            if (wtx.GetHash() != rec.hash)
+                printf("Error in wallet.dat, hash mismatch\n");
+
+            // Undo serialize changes in 31600
+            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+            {
+                if (!rec.ssValue.empty())
+                {
+                    char fTmp;
+                    char fUnused;
+                    rec.ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+                    printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), rec.hash.ToString().c_str());
+                    wtx.fTimeReceivedIsTxTime = fTmp;
+                }
+                else
+                {
+                    printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, rec.hash.ToString().c_str());
+                    wtx.fTimeReceivedIsTxTime = 0;
+                }
+                rec.fUpgraded = true;
+            }
+        }
+        catch (std::exception& e) {
+            rec.fError = true;
+        }
+    }
+}
+
+static void ParseKeyRecords(vector<CWalletKeyRecord>* pvRecords, bool fCheckKeys, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++)
+    {
+        CWalletKeyRecord& rec = (*pvRecords)[i];
+        const char* pszKind = rec.fWalletKey ? "CWalletKey" : "CPrivKey";
+        try
+        {
+            CPrivKey pkey;
+            if (rec.fWalletKey)
+            {
+                CWalletKey wkey;
+                rec.ssValue >> wkey;
+                pkey = wkey.vchPrivKey;
+            }
+            else
+                rec.ssValue >> pkey;
+            rec.key.SetPubKey(rec.vchPubKey);
+            if (!rec.key.SetPrivKey(pkey))
+            {
+                rec.strError = strprintf("invalid %s", pszKind);
+                continue;
+            }
+
+            // Deriving the public key again is the slowest part of loading a
+            // key, -checkwalletkeys=0 trusts the file instead
+            if (!fCheckKeys)
+                continue;
+            if (rec.key.GetPubKey() != rec.vchPubKey)
+                rec.strError = strprintf("%s pubkey inconsistency", pszKind);
+            else if (!rec.key.IsValid())
+                rec.strError = strprintf("invalid %s", pszKind);
+        }
+        catch (std::exception& e) {
+            rec.strError = strprintf("%s unreadable", pszKind);
+        }
+    }
+}
+
+// Run fn(nBegin, nEnd) over nItems, split across the available cores
+static void ParseInParallel(unsigned int nItems, boost::function<void (unsigned int, unsigned int)> fn)
+{
+    unsigned int nThreads = min(boost::thread::hardware_concurrency(), nItems / 100);
+    if (nThreads <= 1)
+    {
+        fn(0, nItems);
+        return;
+    }
+    boost::thread_group threadGroup;
+    unsigned int nPerThread = (nItems + nThreads - 1) / nThreads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(fn, min(i * nPerThread, nItems), min((i + 1) * nPerThread, nItems)));
+    threadGroup.join_all();
+}
+
 int CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
     int nFileVersion = 0;
     vector<uint256> vWalletUpgrade;
     bool fIsEncrypted = false;
+    vector<CWalletTxRecord> vTxRecords;
+    vector<CWalletKeyRecord> vKeyRecords;
 
     //// todo: shouldn't we catch exceptions and try to recover and continue?
     {
@@ -157,41 +283,10 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             }
             else if (strType == "tx")
             {
+                // Parsed below, into its place in mapWallet
                 uint256 hash;
                 ssKey >> hash;
-                CWalletTx& wtx = pwallet->mapWallet[hash];
-                ssValue >> wtx;
-                wtx.BindWallet(pwallet);
-
-                if (wtx.GetHash() != hash)
-                    printf("Error in wallet.dat, hash mismatch\n");
-
-                // Undo serialize changes in 31600
-                if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-                {
-                    if (!ssValue.empty())
-                    {
-                        char fTmp;
-                        char fUnused;
-                        ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                        printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = fTmp;
-                    }
-                    else
-                    {
-                        printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = 0;
-                    }
-                    vWalletUpgrade.push_back(hash);
-                }
-
-                //// debug print
-                //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-                //printf(" %12"PRI64d"  %s  %s  %s\n",
-                //    wtx.vout[0].nValue,
-                //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
-                //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-                //    wtx.mapValue["message"].c_str());
+                vTxRecords.push_back(CWalletTxRecord(hash, &pwallet->mapWallet[hash], ssValue));
             }
             else if (strType == "acentry")
             {
@@ -204,48 +299,10 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             }
             else if (strType == "key" || strType == "wkey")
             {
+                // Parsed below
                 vector<unsigned char> vchPubKey;
                 ssKey >> vchPubKey;
-                CKey key;
-                if (strType == "key")
-                {
-                    CPrivKey pkey;
-                    ssValue >> pkey;
-                    key.SetPubKey(vchPubKey);
-                    key.SetPrivKey(pkey);
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        printf("Error reading wallet database: CPrivKey pubkey inconsistency\n");
-                        return DB_CORRUPT;
-                    }
-                    if (!key.IsValid())
-                    {
-                        printf("Error reading wallet database: invalid CPrivKey\n");
-                        return DB_CORRUPT;
-                    }
-                }
-                else
-                {
-                    CWalletKey wkey;
-                    ssValue >> wkey;
-                    key.SetPubKey(vchPubKey);
-                    key.SetPrivKey(wkey.vchPrivKey);
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        printf("Error reading wallet database: CWalletKey pubkey inconsistency\n");
-                        return DB_CORRUPT;
-                    }
-                    if (!key.IsValid())
-                    {
-                        printf("Error reading wallet database: invalid CWalletKey\n");
-                        return DB_CORRUPT;
-                    }
-                }
-                if (!pwallet->LoadKey(key))
-                {
-                    printf("Error reading wallet database: LoadKey failed\n");
-                    return DB_CORRUPT;
-                }
+                vKeyRecords.push_back(CWalletKeyRecord(strType == "wkey", vchPubKey, ssValue));
             }
             else if (strType == "mkey")
             {
@@ -305,6 +362,36 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             }
         }
         pcursor->close();
+
+        int64 nStart = GetTimeMillis();
+        ParseInParallel(vTxRecords.size(), boost::bind(&ParseTxRecords, &vTxRecords, pwallet, _1, _2));
+        ParseInParallel(vKeyRecords.size(), boost::bind(&ParseKeyRecords, &vKeyRecords, GetBoolArg("-checkwalletkeys", true), _1, _2));
+
+        BOOST_FOREACH(const CWalletTxRecord& rec, vTxRecords)
+        {
+            if (rec.fError)
+            {
+                printf("Error reading wallet database: unreadable transaction %s\n", rec.hash.ToString().c_str());
+                return DB_CORRUPT;
+            }
+            if (rec.fUpgraded)
+                vWalletUpgrade.push_back(rec.hash);
+        }
+        BOOST_FOREACH(const CWalletKeyRecord& rec, vKeyRecords)
+        {
+            if (!rec.strError.empty())
+            {
+                printf("Error reading wallet database: %s\n", rec.strError.c_str());
+                return DB_CORRUPT;
+            }
+            if (!pwallet->LoadKey(rec.key))
+            {
+                printf("Error reading wallet database: LoadKey failed\n");
+                return DB_CORRUPT;
+            }
+        }
+        printf("LoadWallet parsed %d transactions and %d keys in %"PRI64d"ms\n",
+               (int)vTxRecords.size(), (int)vKeyRecords.size(), GetTimeMillis() - nStart);
     }
 
     BOOST_FOREACH(uint256 hash, vWalletUpgrade)
@@ -338,6 +425,7 @@ void ThreadFlushWalletDB(void* parg)
 
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
+    unsigned int nLastCheckpointed = nWalletDBUpdated;
     int64 nLastWalletUpdate = GetTime();
     while (!fShutdown)
     {
@@ -351,36 +439,45 @@ void ThreadFlushWalletDB(void* parg)
 
         if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
-            TRY_LOCK(bitdb.cs_db,lockDb);
-            if (lockDb)
+            bool fInUse = true;
             {
-                // Don't do this if any databases are in use
-                int nRefCount = 0;
-                map<string, int>::iterator mi = bitdb.mapFileUseCount.begin();
-                while (mi != bitdb.mapFileUseCount.end())
+                TRY_LOCK(bitdb.cs_db,lockDb);
+                if (lockDb)
                 {
-                    nRefCount += (*mi).second;
-                    mi++;
-                }
+                    // Don't close it while the wallet is in use, other
+                    // databases don't matter
+                    int nRefCount = 0;
+                    if (bitdb.mapFileUseCount.count(strFile))
+                        nRefCount = bitdb.mapFileUseCount[strFile];
 
-                if (nRefCount == 0 && !fShutdown)
-                {
-                    map<string, int>::iterator mi = bitdb.mapFileUseCount.find(strFile);
-                    if (mi != bitdb.mapFileUseCount.end())
+                    if (nRefCount == 0 && !fShutdown)
                     {
-                        printf("Flushing wallet.dat\n");
-                        nLastFlushed = nWalletDBUpdated;
-                        int64 nStart = GetTimeMillis();
-
-                        // Flush wallet.dat so it's self contained
-                        bitdb.CloseDb(strFile);
-                        bitdb.CheckpointLSN(strFile);
-
-                        bitdb.mapFileUseCount.erase(mi++);
-                        printf("Flushed wallet.dat %"PRI64d"ms\n", GetTimeMillis() - nStart);
+                        fInUse = false;
+                        map<string, int>::iterator mi = bitdb.mapFileUseCount.find(strFile);
+                        if (mi != bitdb.mapFileUseCount.end())
+                        {
+                            printf("Flushing wallet.dat\n");
+                            nLastFlushed = nWalletDBUpdated;
+                            int64 nStart = GetTimeMillis();
+
+                            // Flush wallet.dat so it's self contained
+                            bitdb.CloseDb(strFile);
+                            bitdb.CheckpointLSN(strFile);
+
+                            bitdb.mapFileUseCount.erase(mi++);
+                            printf("Flushed wallet.dat %"PRI64d"ms\n", GetTimeMillis() - nStart);
+                        }
                     }
                 }
             }
+
+            // Can't close it, at least get the logged changes into the
+            // file. This doesn't need cs_db, nobody waits for it.
+            if (fInUse && nLastCheckpointed != nWalletDBUpdated && !fShutdown)
+            {
+                nLastCheckpointed = nWalletDBUpdated;
+                bitdb.dbenv.txn_checkpoint(0, 0, 0);
+            }
         }
     }
 }
@@ -389,38 +486,18 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
-    while (!fShutdown)
+
+    filesystem::path pathDest(strDest);
+    if (filesystem::is_directory(pathDest))
+        pathDest /= wallet.strWalletFile;
+
+    int64 nStart = GetTimeMillis();
+    unsigned int nChanged = 0;
+    if (!CDB::Backup(wallet.strWalletFile, pathDest, nChanged))
     {
-        {
-            LOCK(bitdb.cs_db);
-            if (!bitdb.mapFileUseCount.count(wallet.strWalletFile) || bitdb.mapFileUseCount[wallet.strWalletFile] == 0)
-            {
-                // Flush log data to the dat file
-                bitdb.CloseDb(wallet.strWalletFile);
-                bitdb.CheckpointLSN(wallet.strWalletFile);
-                bitdb.mapFileUseCount.erase(wallet.strWalletFile);
-
-                // Copy wallet.dat
-                filesystem::path pathSrc = GetDataDir() / wallet.strWalletFile;
-                filesystem::path pathDest(strDest);
-                if (filesystem::is_directory(pathDest))
-                    pathDest /= wallet.strWalletFile;
-
-                try {
-#if BOOST_VERSION >= 104000
-                    filesystem::copy_file(pathSrc, pathDest, filesystem::copy_option::overwrite_if_exists);
-#else
-                    filesystem::copy_file(pathSrc, pathDest);
-#endif
-                    printf("copied wallet.dat to %s\n", pathDest.string().c_str());
-                    return true;
-                } catch(const filesystem::filesystem_error &e) {
-                    printf("error copying wallet.dat to %s - %s\n", pathDest.string().c_str(), e.what());
-                    return false;
-                }
-            }
-        }
-        Sleep(100);
+        printf("error backing up wallet.dat to %s\n", pathDest.string().c_str());
+        return false;
     }
-    return false;
+    printf("backed up wallet.dat to %s, %u records changed %"PRI64d"ms\n", pathDest.string().c_str(), nChanged, GetTimeMillis() - nStart);
+    return true;
 }